@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Compiles shader/*.vert|frag to SPIR-V for the renderer.
+
+Writes src/shaders/EmbeddedShaders.inc, which VulkanShaderLibrary.cpp
+compiles in, and optionally a shader pack (see VulkanShaderLibrary.h for the
+layout) that can replace the embedded shaders without rebuilding.
+
+  build_shaders.py [--pack out.wdsp] [--pack-only]
+
+--pack-only embeds no shaders, for binaries that always load a pack.
+
+Run as the pre-build step of both configurations; needs glslangValidator
+from the Vulkan SDK on the PATH (or $VULKAN_SDK_PATH/bin).
+"""
+
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SHADER_DIR = os.path.join(ROOT, 'shader')
+OUTPUT = os.path.join(ROOT, 'src', 'shaders', 'EmbeddedShaders.inc')
+STAGES = ('.vert', '.frag', '.comp')
+
+PACK_MAGIC = 0x50534457  # 'WDSP'
+PACK_VERSION = 1
+PACK_NAME_SIZE = 56
+
+
+def find_compiler():
+    compiler = shutil.which('glslangValidator')
+    if compiler:
+        return compiler
+    sdk = os.environ.get('VULKAN_SDK_PATH') or os.environ.get('VULKAN_SDK')
+    if sdk:
+        candidate = os.path.join(sdk, 'bin', 'glslangValidator')
+        if os.path.exists(candidate):
+            return candidate
+    sys.exit('build_shaders.py: glslangValidator not found')
+
+
+def compile_shader(compiler, source, tmp_dir):
+    output = os.path.join(tmp_dir, os.path.basename(source) + '.spv')
+    subprocess.check_call([compiler, '-V', '-o', output, source],
+                          stdout=subprocess.DEVNULL)
+    with open(output, 'rb') as f:
+        code = f.read()
+    if len(code) % 4:
+        sys.exit('build_shaders.py: %s: truncated SPIR-V' % source)
+    return code
+
+
+def write_if_changed(path, contents):
+    # Keeps the timestamp, and with it the incremental build, when nothing
+    # changed.
+    if os.path.exists(path):
+        with open(path, 'rb') as f:
+            if f.read() == contents:
+                return
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb') as f:
+        f.write(contents)
+
+
+def embed(shaders):
+    # Always a table, if an empty one: a missing file is a build error.
+    lines = ['// Generated by shader/build_shaders.py. Do not edit.', '']
+    for i, (name, code) in enumerate(shaders):
+        words = struct.unpack('<%dI' % (len(code) // 4), code)
+        lines.append('// %s' % name)
+        lines.append('constexpr uint32_t kShader%d[] = {' % i)
+        for j in range(0, len(words), 6):
+            lines.append('  ' + ', '.join('0x%08x' % w
+                                          for w in words[j:j + 6]) + ',')
+        lines.append('};')
+        lines.append('')
+    lines.append('constexpr EmbeddedShader kEmbeddedShaders[] = {')
+    for i, (name, _) in enumerate(shaders):
+        lines.append('  { "%s", kShader%d, sizeof(kShader%d) },' % (name, i, i))
+    lines.append('  { nullptr, nullptr, 0 },')
+    lines.append('};')
+    return ('\n'.join(lines) + '\n').encode()
+
+
+def pack(shaders):
+    header_size = 12 + len(shaders) * (PACK_NAME_SIZE + 8)
+    offset = (header_size + 15) & ~15
+    entries = b''
+    data = b''
+    for name, code in shaders:
+        encoded = name.encode()
+        if len(encoded) >= PACK_NAME_SIZE:
+            sys.exit('build_shaders.py: name too long: %s' % name)
+        entries += struct.pack('<%dsII' % PACK_NAME_SIZE, encoded,
+                               offset + len(data), len(code))
+        data += code + b'\0' * (-len(code) % 16)
+    header = struct.pack('<III', PACK_MAGIC, PACK_VERSION, len(shaders))
+    header += entries
+    return header + b'\0' * (offset - len(header)) + data
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--pack', help='also write a shader pack here')
+    parser.add_argument('--pack-only', action='store_true',
+                        help='embed no shaders; the binary needs a pack')
+    args = parser.parse_args()
+    if args.pack_only and not args.pack:
+        parser.error('--pack-only needs --pack')
+
+    compiler = find_compiler()
+    sources = sorted(f for f in os.listdir(SHADER_DIR) if f.endswith(STAGES))
+    tmp_dir = tempfile.mkdtemp()
+    try:
+        shaders = [(name, compile_shader(compiler,
+                                         os.path.join(SHADER_DIR, name),
+                                         tmp_dir))
+                   for name in sources]
+    finally:
+        shutil.rmtree(tmp_dir)
+
+    write_if_changed(OUTPUT, embed([] if args.pack_only else shaders))
+    if args.pack:
+        write_if_changed(args.pack, pack(shaders))
+
+
+if __name__ == '__main__':
+    main()
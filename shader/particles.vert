@@ -0,0 +1,24 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+// One particle per instance, straight from the simulation's buffer.
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec4 inVelocity;
+
+layout(location = 0) out vec3 fragColor;
+
+// A tiny triangle per particle; no vertex buffer needed.
+const vec2 kCorners[3] = vec2[](
+    vec2(0.0, -1.0), vec2(0.866, 0.5), vec2(-0.866, 0.5));
+const float kSize = 0.003;
+
+void main() {
+    gl_Position = vec4(inPosition.xy + kCorners[gl_VertexIndex] * kSize,
+                       inPosition.z, 1.0);
+    float speed = clamp(length(inVelocity.xy) * 0.5, 0.0, 1.0);
+    fragColor = mix(vec3(0.2, 0.4, 1.0), vec3(1.0, 0.6, 0.2), speed);
+}
@@ -5,21 +5,27 @@ out gl_PerVertex {
     vec4 gl_Position;
 };
 
-layout(location = 0) out vec3 fragColor;
+struct InstanceData {
+    mat4 transform;
+    vec4 color;
+    uint material_index;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Instances {
+    InstanceData instances[];
+};
+
+layout(push_constant) uniform DrawConstants {
+    uint instance_base;
+} draw;
 
-vec2 positions[3] = vec2[] (
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
 
-vec3 colors[3] = vec3[] (
-    vec3(1.0, 0.0, 0.0),
-    vec3(0.0, 1.0, 0.0),
-    vec3(0.0, 0.0, 1.0)
-);
+layout(location = 0) out vec3 fragColor;
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = colors[gl_VertexIndex];
+    InstanceData instance = instances[draw.instance_base + gl_InstanceIndex];
+    gl_Position = instance.transform * vec4(inPosition, 0.0, 1.0);
+    fragColor = inColor * instance.color.rgb;
 }
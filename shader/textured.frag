@@ -0,0 +1,24 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(set = 1, binding = 0) uniform texture2D textures[];
+layout(set = 1, binding = 2) uniform sampler samplers[];
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) flat in uint fragTexture;
+layout(location = 3) flat in uint fragSampler;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    vec3 color = fragColor;
+    // Not streamed in yet.
+    if (fragTexture != 0xFFFFFFFFu) {
+        color *= texture(sampler2D(textures[nonuniformEXT(fragTexture)],
+                                   samplers[nonuniformEXT(fragSampler)]),
+                         fragTexCoord).rgb;
+    }
+    outColor = vec4(color, 1.0);
+}
@@ -0,0 +1,40 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+struct InstanceData {
+    mat4 transform;
+    vec4 color;
+    uint material_index;
+    uint texture_index;
+    uint sampler_index;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Instances {
+    InstanceData instances[];
+};
+
+layout(push_constant) uniform DrawConstants {
+    uint instance_base;
+} draw;
+
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) flat out uint fragTexture;
+layout(location = 3) flat out uint fragSampler;
+
+void main() {
+    InstanceData instance = instances[draw.instance_base + gl_InstanceIndex];
+    gl_Position = instance.transform * vec4(inPosition, 0.0, 1.0);
+    fragColor = inColor * instance.color.rgb;
+    // The mesh spans [-0.5, 0.5].
+    fragTexCoord = inPosition + 0.5;
+    fragTexture = instance.texture_index;
+    fragSampler = instance.sampler_index;
+}
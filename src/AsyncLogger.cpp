@@ -0,0 +1,207 @@
+
+#include "AsyncLogger.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// How long the writer sleeps when the ring is empty. Producers never wake
+// it, which keeps Write() free of system calls; only Flush() does.
+const std::chrono::milliseconds kIdleWait(2);
+
+uint32_t NowMilliseconds() {
+  static const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+void FlushAtExit() {
+  AsyncLogger::Get()->Flush();
+}
+
+}  // namespace
+
+
+const size_t AsyncLogger::kMaxRecordSize;
+const size_t AsyncLogger::kSlotCount;
+const uint32_t AsyncLogger::kBurst;
+const uint32_t AsyncLogger::kWindowMs;
+const size_t AsyncLogger::kRateSlotCount;
+
+// static
+AsyncLogger* AsyncLogger::Get() {
+  // Never destroyed: static destructors may still log. atexit() drains what
+  // is left instead.
+  static AsyncLogger* logger = [] {
+    AsyncLogger* instance = new AsyncLogger;
+    std::atexit(&FlushAtExit);
+    return instance;
+  }();
+  return logger;
+}
+
+AsyncLogger::AsyncLogger()
+    : slots_(new Slot[kSlotCount]),
+      enqueue_position_(0),
+      dequeue_position_(0),
+      dropped_(0),
+      total_dropped_(0) {
+  for (size_t i = 0; i < kSlotCount; ++i)
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  for (RateSlot& slot : rate_slots_) {
+    slot.key.store(0, std::memory_order_relaxed);
+    slot.state.store(0, std::memory_order_relaxed);
+    slot.suppressed.store(0, std::memory_order_relaxed);
+  }
+  writer_ = std::thread(&AsyncLogger::WriterLoop, this);
+}
+
+AsyncLogger::~AsyncLogger() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_cv_.notify_one();
+  writer_.join();
+  delete[] slots_;
+}
+
+void AsyncLogger::Write(int severity, const char* text, size_t length) {
+  uint64_t position = enqueue_position_.load(std::memory_order_relaxed);
+  Slot* slot = nullptr;
+  for (;;) {
+    slot = &slots_[position % kSlotCount];
+    const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    const int64_t diff =
+        static_cast<int64_t>(sequence) - static_cast<int64_t>(position);
+    if (diff == 0) {
+      if (enqueue_position_.compare_exchange_weak(
+              position, position + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // Full. Dropping the newest record keeps producers wait-free.
+      // FATAL records are the last words of the process and bypass the
+      // ring once it has drained.
+      if (severity >= LOG_SEVERITY_FATAL) {
+        Flush();
+        fwrite(text, 1, length, stdout);
+        fputc('\n', stdout);
+        fflush(stdout);
+        return;
+      }
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      total_dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      position = enqueue_position_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->length = static_cast<uint32_t>(std::min(length, kMaxRecordSize));
+  memcpy(slot->text, text, slot->length);
+  slot->sequence.store(position + 1, std::memory_order_release);
+
+  if (severity >= LOG_SEVERITY_FATAL)
+    Flush();
+}
+
+void AsyncLogger::Flush() {
+  const uint64_t target = enqueue_position_.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(mutex_);
+  wake_cv_.notify_one();
+  drained_cv_.wait(lock, [this, target] {
+    return stopping_ ||
+           dequeue_position_.load(std::memory_order_acquire) >= target;
+  });
+}
+
+bool AsyncLogger::Allow(uint64_t key, uint32_t* suppressed) {
+  *suppressed = 0;
+  RateSlot& slot = rate_slots_[key % kRateSlotCount];
+  // Colliding keys share a slot; the loser just starts a fresh window.
+  if (slot.key.load(std::memory_order_relaxed) != key) {
+    slot.key.store(key, std::memory_order_relaxed);
+    slot.state.store(0, std::memory_order_relaxed);
+    slot.suppressed.store(0, std::memory_order_relaxed);
+  }
+
+  const uint64_t window = NowMilliseconds() / kWindowMs + 1;
+  uint64_t state = slot.state.load(std::memory_order_relaxed);
+  for (;;) {
+    uint64_t next;
+    if ((state >> 32) != window)
+      next = (window << 32) | 1;
+    else if ((state & 0xffffffff) < kBurst)
+      next = state + 1;
+    else
+      break;
+    if (slot.state.compare_exchange_weak(state, next,
+                                         std::memory_order_relaxed)) {
+      *suppressed = slot.suppressed.exchange(0, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  slot.suppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void AsyncLogger::WriterLoop() {
+  for (;;) {
+    const bool wrote = Drain();
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained_cv_.notify_all();
+    if (stopping_)
+      break;
+    if (!wrote)
+      wake_cv_.wait_for(lock, kIdleWait);
+  }
+  Drain();
+  drained_cv_.notify_all();
+}
+
+bool AsyncLogger::Drain() {
+  bool wrote = false;
+  uint64_t position = dequeue_position_.load(std::memory_order_relaxed);
+  for (;;) {
+    Slot& slot = slots_[position % kSlotCount];
+    // A producer may have claimed the slot without filling it yet; the
+    // record goes out with the next batch.
+    if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+      break;
+
+    ReportDropped();
+    fwrite(slot.text, 1, slot.length, stdout);
+    fputc('\n', stdout);
+    wrote = true;
+
+    slot.sequence.store(position + kSlotCount, std::memory_order_release);
+    ++position;
+    dequeue_position_.store(position, std::memory_order_release);
+  }
+  wrote |= ReportDropped();
+  // One flush per batch rather than per line.
+  if (wrote)
+    fflush(stdout);
+  return wrote;
+}
+
+bool AsyncLogger::ReportDropped() {
+  const uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+  if (!dropped)
+    return false;
+  fprintf(stdout, "[WARNING] %llu log records dropped\n",
+          static_cast<unsigned long long>(dropped));
+  return true;
+}
+
+void WriteLogMessage(int severity, const std::string& message) {
+  AsyncLogger::Get()->Write(severity, message.data(), message.size());
+}
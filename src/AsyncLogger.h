@@ -0,0 +1,86 @@
+#ifndef ASYNC_LOGGER_H_
+#define ASYNC_LOGGER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Backend of LogMessage: moves formatting output off the calling thread.
+//
+// Producers copy a finished record into a fixed ring of slots (a bounded
+// MPSC queue; claiming a slot is one CAS, no locks) and return. A background
+// thread drains the ring to stdout in batches. When the ring is full the
+// record is dropped and counted; the writer reports the count in its next
+// batch, so a log storm costs bounded memory and never blocks the render
+// thread. FATAL records are never dropped and are on stdout before Write()
+// returns.
+class AsyncLogger
+{
+public:
+  // Records longer than this are truncated.
+  static const size_t kMaxRecordSize = 1024;
+  static const size_t kSlotCount = 1024;
+
+  // The process-wide logger, started on first use and drained at exit.
+  static AsyncLogger* Get();
+
+  void Write(int severity, const char* text, size_t length);
+  // Blocks until everything written so far is on stdout.
+  void Flush();
+
+  // Rate limiter for messages that repeat at high rates, like validation
+  // messages. Returns whether the message with identity |key| may be logged:
+  // at most kBurst per kWindowMs per key. |suppressed| receives how many were
+  // refused since the last one let through.
+  bool Allow(uint64_t key, uint32_t* suppressed);
+
+  uint64_t dropped() const { return total_dropped_.load(); }
+
+private:
+  static const uint32_t kBurst = 8;
+  static const uint32_t kWindowMs = 1000;
+  static const size_t kRateSlotCount = 256;
+
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    uint32_t length;
+    char text[kMaxRecordSize];
+  };
+
+  struct RateSlot {
+    std::atomic<uint64_t> key;
+    // Window index in the high 32 bits, messages let through in the low.
+    std::atomic<uint64_t> state;
+    std::atomic<uint32_t> suppressed;
+  };
+
+  AsyncLogger();
+  ~AsyncLogger();
+
+  void WriterLoop();
+  // Writes out every ready record. Returns whether there was any.
+  bool Drain();
+  // Prints and resets the count of dropped records, if any.
+  bool ReportDropped();
+
+  Slot* slots_;
+  std::atomic<uint64_t> enqueue_position_;
+  // Only touched by the writer thread (and Flush() waiting on it).
+  std::atomic<uint64_t> dequeue_position_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> total_dropped_;
+
+  RateSlot rate_slots_[kRateSlotCount];
+
+  std::thread writer_;
+  std::mutex mutex_;
+  std::condition_variable wake_cv_;
+  std::condition_variable drained_cv_;
+  bool stopping_ = false;
+};
+
+#endif /* ASYNC_LOGGER_H_ */
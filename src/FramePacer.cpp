@@ -0,0 +1,124 @@
+
+#include "FramePacer.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+// Share of the measured error the controller corrects per frame; small
+// enough that one slow frame does not throw the sample point around.
+const double kGain = 0.25;
+// Weight of the newest sample in smoothed values.
+const double kSmoothing = 0.1;
+// Sleeps can overshoot by about a scheduler tick; the last stretch before
+// the wake-up time is spun instead.
+const double kSpinMilliseconds = 1.0;
+
+double Milliseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+std::chrono::steady_clock::duration FromMilliseconds(double milliseconds) {
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double, std::milli>(milliseconds));
+}
+
+}  // namespace
+
+
+const double FramePacer::kSlackMilliseconds = 1.0;
+
+FramePacer::FramePacer(uint32_t frames_in_flight)
+    : slot_inputs_(std::max(frames_in_flight, 1u)) {}
+
+FramePacer::~FramePacer() {}
+
+void FramePacer::SetTargetFrameTime(double milliseconds) {
+  target_frame_ms_ = std::max(milliseconds, 0.0);
+}
+
+void FramePacer::WaitForInput() {
+  if (!enabled_ || !has_present_)
+    return;
+
+  Clock::time_point wake = last_present_ + FromMilliseconds(input_delay_ms_);
+  if (target_frame_ms_ > 0.0)
+    wake = std::max(wake, last_input_ + FromMilliseconds(target_frame_ms_));
+
+  const Clock::time_point sleep_until =
+      wake - FromMilliseconds(kSpinMilliseconds);
+  if (Clock::now() < sleep_until)
+    std::this_thread::sleep_until(sleep_until);
+  while (Clock::now() < wake)
+    std::this_thread::yield();
+}
+
+void FramePacer::MarkInputSampled() {
+  pending_input_ = last_input_ = Clock::now();
+}
+
+void FramePacer::MarkSlotFree(uint32_t slot, double waited_ms) {
+  DCHECK(slot < slot_inputs_.size());
+  slot_ = slot;
+  // The frame that occupied the slot is done on the GPU. Without a wait it
+  // finished earlier still, so the estimate is an upper bound then. Cleared
+  // so a retried frame does not count it twice.
+  Clock::time_point& input = slot_inputs_[slot_];
+  if (Clock::time_point() != input) {
+    const double latency_ms = Milliseconds(Clock::now() - input);
+    latency_sum_ms_ += latency_ms;
+    ++latency_count_;
+    stats_.max_latency_ms = std::max(stats_.max_latency_ms, latency_ms);
+  }
+  input = Clock::time_point();
+
+  stats_.slot_wait_ms += kSmoothing * (waited_ms - stats_.slot_wait_ms);
+
+  // A wait beyond the slack means input could have been sampled that much
+  // later. No wait at all means it was sampled too late by an unknown
+  // amount, which backs off by the slack per frame. Sampling more than a
+  // frame after the present would only skip frames.
+  input_delay_ms_ += kGain * (waited_ms - kSlackMilliseconds);
+  input_delay_ms_ = std::max(input_delay_ms_, 0.0);
+  if (stats_.interval_ms > 0.0)
+    input_delay_ms_ = std::min(input_delay_ms_, stats_.interval_ms);
+  stats_.input_delay_ms = enabled_ ? input_delay_ms_ : 0.0;
+}
+
+void FramePacer::MarkPresented() {
+  const Clock::time_point now = Clock::now();
+  if (has_present_) {
+    const double interval_ms = Milliseconds(now - last_present_);
+    if (stats_.interval_ms > 0.0)
+      stats_.interval_ms += kSmoothing * (interval_ms - stats_.interval_ms);
+    else
+      stats_.interval_ms = interval_ms;
+  }
+  last_present_ = now;
+  has_present_ = true;
+  slot_inputs_[slot_] = pending_input_;
+  ++stats_.frames;
+}
+
+std::string FramePacer::Report() {
+  stats_.latency_ms = latency_count_ ? latency_sum_ms_ / latency_count_ : 0.0;
+
+  std::ostringstream stream;
+  stream << std::fixed << std::setprecision(2);
+  stream << "pacing frames=" << stats_.frames
+         << " interval_ms=" << stats_.interval_ms
+         << " target_ms=" << target_frame_ms_
+         << " latency_ms=" << stats_.latency_ms
+         << " max_latency_ms=" << stats_.max_latency_ms
+         << " input_delay_ms=" << stats_.input_delay_ms
+         << " slot_wait_ms=" << stats_.slot_wait_ms;
+
+  latency_sum_ms_ = 0.0;
+  latency_count_ = 0;
+  stats_.max_latency_ms = 0.0;
+  return stream.str();
+}
@@ -0,0 +1,95 @@
+#ifndef FRAME_PACER_H_
+#define FRAME_PACER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Paces an interactive main loop so that input is sampled as late as
+// possible instead of as soon as the previous frame is queued.
+//
+// Each frame goes through
+//   pacer.WaitForInput();        // sleeps
+//   <poll input, build the frame>
+//   pacer.MarkInputSampled();
+//   pacer.MarkSlotFree(renderer.currentFrameSlot(),
+//                      renderer.waitForFrameSlot());
+//   if (renderer.render())
+//     pacer.MarkPresented();
+//
+// The pacer measures how long the loop still blocks on the frame slot's
+// fence after sampling input. A controller moves the input sample point
+// later until that wait shrinks to a small slack: the CPU no longer runs
+// ahead of the GPU, the frames in flight stop being a queue of stale input,
+// and the slot frees just as the frame is ready to be submitted. On top of
+// that frames start no more often than the target frame time.
+//
+// Input-to-present latency is estimated per frame as the time from its
+// input sample to the moment its slot frees again, i.e. the GPU finished
+// it; the swapchain's own queueing (one refresh with FIFO) comes on top.
+class FramePacer
+{
+public:
+  struct Stats {
+    uint64_t frames = 0;
+    // Present-to-present interval, smoothed.
+    double interval_ms = 0.0;
+    // Estimated input-to-present latency over the last report window.
+    double latency_ms = 0.0;
+    double max_latency_ms = 0.0;
+    // Sleep between present and the next input sample.
+    double input_delay_ms = 0.0;
+    // Fence wait left after sampling input, smoothed.
+    double slot_wait_ms = 0.0;
+  };
+
+  // Aim for this much fence wait after input: the controller's margin for
+  // frame-to-frame jitter.
+  static const double kSlackMilliseconds;
+
+  explicit FramePacer(uint32_t frames_in_flight);
+  ~FramePacer();
+
+  // 0 follows the display (or the GPU, whichever is slower).
+  void SetTargetFrameTime(double milliseconds);
+  double target_frame_time() const { return target_frame_ms_; }
+  // Off, WaitForInput() returns at once; measuring goes on.
+  void SetEnabled(bool enabled) { enabled_ = enabled; }
+
+  void WaitForInput();
+  void MarkInputSampled();
+  // |slot| is the renderer's frame slot and |waited_ms| how long its fence
+  // wait blocked.
+  void MarkSlotFree(uint32_t slot, double waited_ms);
+  // Only for frames actually submitted; a skipped frame leaves the slot's
+  // last frame to be measured when the slot frees next time.
+  void MarkPresented();
+
+  const Stats& stats() const { return stats_; }
+  // "pacing frames=600 interval_ms=16.67 latency_ms=18.20 ...": key=value
+  // pairs as in the startup report. Starts a new latency window.
+  std::string Report();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  bool enabled_ = true;
+  double target_frame_ms_ = 0.0;
+  double input_delay_ms_ = 0.0;
+
+  Clock::time_point last_present_;
+  Clock::time_point last_input_;
+  Clock::time_point pending_input_;
+  bool has_present_ = false;
+  // Input sample time of the frame occupying each slot.
+  std::vector<Clock::time_point> slot_inputs_;
+  // The slot last freed, which the next presented frame occupies.
+  uint32_t slot_ = 0;
+
+  double latency_sum_ms_ = 0.0;
+  uint32_t latency_count_ = 0;
+  Stats stats_;
+};
+
+#endif /* FRAME_PACER_H_ */
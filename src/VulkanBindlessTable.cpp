@@ -0,0 +1,256 @@
+#include "VulkanBindlessTable.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+
+namespace {
+
+const VkDescriptorType kDescriptorTypes[] = {
+  VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+  VK_DESCRIPTOR_TYPE_SAMPLER,
+};
+
+const char* const kBindingNames[] = {
+  "sampled image",
+  "storage buffer",
+  "sampler",
+};
+
+}  // namespace
+
+
+const VulkanBindlessTable::Handle VulkanBindlessTable::kInvalidHandle;
+const uint32_t VulkanBindlessTable::kMaxSampledImages;
+const uint32_t VulkanBindlessTable::kMaxStorageBuffers;
+const uint32_t VulkanBindlessTable::kMaxSamplers;
+
+VulkanBindlessTable::VulkanBindlessTable() {}
+
+VulkanBindlessTable::~VulkanBindlessTable() {
+  DCHECK_EQ(static_cast<VkDescriptorPool>(VK_NULL_HANDLE), descriptor_pool_);
+}
+
+bool VulkanBindlessTable::Initialize(
+    VkDevice device,
+    const VkPhysicalDeviceDescriptorIndexingPropertiesEXT& properties,
+    uint32_t frame_slots) {
+  DCHECK_NE(0u, frame_slots);
+  device_ = device;
+  frame_slot_ = 0;
+
+  // Every stage sees the whole table, so the per-stage limits apply too.
+  uint32_t capacities[kBindingCount] = {
+    std::min({ kMaxSampledImages,
+               properties.maxDescriptorSetUpdateAfterBindSampledImages,
+               properties.maxPerStageDescriptorUpdateAfterBindSampledImages }),
+    std::min({ kMaxStorageBuffers,
+               properties.maxDescriptorSetUpdateAfterBindStorageBuffers,
+               properties.maxPerStageDescriptorUpdateAfterBindStorageBuffers }),
+    std::min({ kMaxSamplers,
+               properties.maxDescriptorSetUpdateAfterBindSamplers,
+               properties.maxPerStageDescriptorUpdateAfterBindSamplers }),
+  };
+  // All three count against one per-stage total; the images give way.
+  const uint32_t resources = properties.maxPerStageUpdateAfterBindResources;
+  const uint32_t others =
+      capacities[kStorageBufferBinding] + capacities[kSamplerBinding];
+  capacities[kSampledImageBinding] =
+      std::min(capacities[kSampledImageBinding],
+               resources > others ? resources - others : 0u);
+
+  VkDescriptorSetLayoutBinding bindings[kBindingCount] = {};
+  VkDescriptorBindingFlagsEXT binding_flags[kBindingCount] = {};
+  VkDescriptorPoolSize pool_sizes[kBindingCount] = {};
+  for (uint32_t i = 0; i < kBindingCount; ++i) {
+    Slots& slots = slots_[i];
+    slots.capacity = capacities[i];
+    slots.high_water = 0;
+    slots.live = 0;
+    slots.free.clear();
+    slots.retired.assign(frame_slots, std::vector<Handle>());
+
+    bindings[i].binding = i;
+    bindings[i].descriptorType = kDescriptorTypes[i];
+    bindings[i].descriptorCount = capacities[i];
+    bindings[i].stageFlags = VK_SHADER_STAGE_ALL;
+    // Partially bound: only the slots handed out are ever written.
+    // Unused while pending: new slots are written while frames reading
+    // other slots are still on the GPU.
+    binding_flags[i] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+                       VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT |
+                       VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+
+    pool_sizes[i].type = kDescriptorTypes[i];
+    pool_sizes[i].descriptorCount = capacities[i];
+  }
+
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flags_info = {};
+  flags_info.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+  flags_info.bindingCount = kBindingCount;
+  flags_info.pBindingFlags = binding_flags;
+
+  VkDescriptorSetLayoutCreateInfo layout_info = {};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.pNext = &flags_info;
+  layout_info.flags =
+      VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+  layout_info.bindingCount = kBindingCount;
+  layout_info.pBindings = bindings;
+  VkResult result = vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                                &set_layout_);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateDescriptorSetLayout() failed: " << result;
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, set_layout_,
+                "bindless set layout");
+
+  VkDescriptorPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = kBindingCount;
+  pool_info.pPoolSizes = pool_sizes;
+  result = vkCreateDescriptorPool(device_, &pool_info, nullptr,
+                                  &descriptor_pool_);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateDescriptorPool() failed: " << result;
+    Destroy();
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_DESCRIPTOR_POOL, descriptor_pool_,
+                "bindless pool");
+
+  VkDescriptorSetAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = descriptor_pool_;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &set_layout_;
+  result = vkAllocateDescriptorSets(device_, &alloc_info, &descriptor_set_);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkAllocateDescriptorSets() failed: " << result;
+    Destroy();
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_DESCRIPTOR_SET, descriptor_set_,
+                "bindless set");
+
+  LOG(INFO) << "Bindless table: " << capacities[kSampledImageBinding]
+            << " images, " << capacities[kStorageBufferBinding]
+            << " buffers, " << capacities[kSamplerBinding] << " samplers";
+  return true;
+}
+
+void VulkanBindlessTable::Destroy() {
+  if (VK_NULL_HANDLE == device_)
+    return;
+  // Frees the set along with the pool.
+  vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
+  descriptor_pool_ = VK_NULL_HANDLE;
+  descriptor_set_ = VK_NULL_HANDLE;
+  vkDestroyDescriptorSetLayout(device_, set_layout_, nullptr);
+  set_layout_ = VK_NULL_HANDLE;
+  for (Slots& slots : slots_)
+    slots = Slots();
+  device_ = VK_NULL_HANDLE;
+}
+
+void VulkanBindlessTable::BeginFrame(uint32_t frame_slot) {
+  DCHECK(frame_slot < slots_[0].retired.size());
+  frame_slot_ = frame_slot;
+  for (Slots& slots : slots_) {
+    std::vector<Handle>& retired = slots.retired[frame_slot];
+    slots.free.insert(slots.free.end(), retired.begin(), retired.end());
+    retired.clear();
+  }
+}
+
+VulkanBindlessTable::Handle VulkanBindlessTable::AddSampledImage(
+    VkImageView view, VkImageLayout layout) {
+  Handle handle = Allocate(kSampledImageBinding);
+  if (kInvalidHandle == handle)
+    return kInvalidHandle;
+  VkDescriptorImageInfo image_info = {};
+  image_info.imageView = view;
+  image_info.imageLayout = layout;
+  Write(kSampledImageBinding, handle, &image_info, nullptr);
+  return handle;
+}
+
+VulkanBindlessTable::Handle VulkanBindlessTable::AddStorageBuffer(
+    VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range) {
+  Handle handle = Allocate(kStorageBufferBinding);
+  if (kInvalidHandle == handle)
+    return kInvalidHandle;
+  VkDescriptorBufferInfo buffer_info = {};
+  buffer_info.buffer = buffer;
+  buffer_info.offset = offset;
+  buffer_info.range = range;
+  Write(kStorageBufferBinding, handle, nullptr, &buffer_info);
+  return handle;
+}
+
+VulkanBindlessTable::Handle VulkanBindlessTable::AddSampler(
+    VkSampler sampler) {
+  Handle handle = Allocate(kSamplerBinding);
+  if (kInvalidHandle == handle)
+    return kInvalidHandle;
+  VkDescriptorImageInfo image_info = {};
+  image_info.sampler = sampler;
+  Write(kSamplerBinding, handle, &image_info, nullptr);
+  return handle;
+}
+
+void VulkanBindlessTable::Bind(VkCommandBuffer command_buffer,
+                               VkPipelineBindPoint bind_point,
+                               VkPipelineLayout layout,
+                               uint32_t set_index) const {
+  DCHECK_NE(static_cast<VkDescriptorSet>(VK_NULL_HANDLE), descriptor_set_);
+  vkCmdBindDescriptorSets(command_buffer, bind_point, layout, set_index, 1,
+                          &descriptor_set_, 0, nullptr);
+}
+
+VulkanBindlessTable::Handle VulkanBindlessTable::Allocate(Binding binding) {
+  Slots& slots = slots_[binding];
+  Handle handle = kInvalidHandle;
+  if (!slots.free.empty()) {
+    handle = slots.free.back();
+    slots.free.pop_back();
+  } else if (slots.high_water < slots.capacity) {
+    handle = slots.high_water++;
+  } else {
+    LOG(WARNING) << "Bindless table out of " << kBindingNames[binding]
+                 << " slots (" << slots.capacity << ")";
+    return kInvalidHandle;
+  }
+  ++slots.live;
+  return handle;
+}
+
+void VulkanBindlessTable::Retire(Binding binding, Handle handle) {
+  if (kInvalidHandle == handle)
+    return;
+  Slots& slots = slots_[binding];
+  DCHECK(handle < slots.high_water);
+  DCHECK(slots.live > 0);
+  --slots.live;
+  slots.retired[frame_slot_].push_back(handle);
+}
+
+void VulkanBindlessTable::Write(Binding binding, Handle handle,
+                                const VkDescriptorImageInfo* image_info,
+                                const VkDescriptorBufferInfo* buffer_info) {
+  VkWriteDescriptorSet write = {};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstSet = descriptor_set_;
+  write.dstBinding = binding;
+  write.dstArrayElement = handle;
+  write.descriptorCount = 1;
+  write.descriptorType = kDescriptorTypes[binding];
+  write.pImageInfo = image_info;
+  write.pBufferInfo = buffer_info;
+  vkUpdateDescriptorSets(device_, 1, &write, 0, nullptr);
+}
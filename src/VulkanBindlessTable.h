@@ -0,0 +1,118 @@
+#ifndef VULKAN_BINDLESS_TABLE_H_
+#define VULKAN_BINDLESS_TABLE_H_
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+// One large descriptor set holding the sampled images, storage buffers and
+// samplers of the whole renderer, bound once per command buffer. Shaders
+// reach a resource through a 32-bit handle, its index in the matching
+// array, passed in push constants or instance data; draws never bind
+// descriptors of their own however many materials there are.
+//
+// Declared in GLSL (GL_EXT_nonuniform_qualifier) as
+//   layout(set = S, binding = 0) uniform texture2D textures[];
+//   layout(set = S, binding = 1) buffer Buffers { ... } buffers[];
+//   layout(set = S, binding = 2) uniform sampler samplers[];
+//
+// The arrays are update-after-bind and partially bound: slots are written
+// as resources come and go, even while frames using the set are in flight,
+// and slots never written or since removed must simply not be read. A
+// removed handle is recycled only once no frame can read it any more:
+// Remove*() retires it to the current frame slot, and the next BeginFrame()
+// of that slot, which follows its fence wait, returns it to the free list.
+// To point a handle at another resource, add the new one and remove the
+// old handle; slots in use by pending frames are never rewritten.
+//
+// Requires VulkanDeviceQueue::DESCRIPTOR_INDEXING_FLAG. Not thread-safe.
+class VulkanBindlessTable
+{
+public:
+  typedef uint32_t Handle;
+
+  enum Binding {
+    kSampledImageBinding = 0,
+    kStorageBufferBinding,
+    kSamplerBinding,
+    kBindingCount,
+  };
+
+  static const Handle kInvalidHandle = UINT32_MAX;
+
+  // Array sizes, lowered by Initialize() to what the device allows.
+  static const uint32_t kMaxSampledImages = 1 << 16;
+  static const uint32_t kMaxStorageBuffers = 1 << 14;
+  static const uint32_t kMaxSamplers = 256;
+
+  VulkanBindlessTable();
+  ~VulkanBindlessTable();
+
+  // |properties| are the device's update-after-bind limits; |frame_slots|
+  // is the number of frames in flight.
+  bool Initialize(
+      VkDevice device,
+      const VkPhysicalDeviceDescriptorIndexingPropertiesEXT& properties,
+      uint32_t frame_slots);
+  void Destroy();
+
+  // Call when |frame_slot| starts recording, after its fence wait. Frees
+  // the handles retired while the slot was last in use.
+  void BeginFrame(uint32_t frame_slot);
+
+  // Return kInvalidHandle once the array is full. |layout| is the one the
+  // image is in whenever a frame samples it.
+  Handle AddSampledImage(VkImageView view, VkImageLayout layout);
+  Handle AddStorageBuffer(VkBuffer buffer, VkDeviceSize offset,
+                          VkDeviceSize range);
+  Handle AddSampler(VkSampler sampler);
+
+  void RemoveSampledImage(Handle handle) {
+    Retire(kSampledImageBinding, handle);
+  }
+  void RemoveStorageBuffer(Handle handle) {
+    Retire(kStorageBufferBinding, handle);
+  }
+  void RemoveSampler(Handle handle) { Retire(kSamplerBinding, handle); }
+
+  // Binds the table as set |set_index| of |layout|.
+  void Bind(VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point,
+            VkPipelineLayout layout, uint32_t set_index) const;
+
+  VkDescriptorSetLayout set_layout() const { return set_layout_; }
+  VkDescriptorSet descriptor_set() const { return descriptor_set_; }
+  uint32_t capacity(Binding binding) const {
+    return slots_[binding].capacity;
+  }
+  // Live handles, not counting retired ones.
+  uint32_t used(Binding binding) const { return slots_[binding].live; }
+
+private:
+  struct Slots {
+    uint32_t capacity = 0;
+    // Slots below this have been handed out at least once; the ones above
+    // come next once the free list runs dry.
+    uint32_t high_water = 0;
+    uint32_t live = 0;
+    std::vector<Handle> free;
+    // Per frame slot, the handles removed while it was the current one.
+    std::vector<std::vector<Handle> > retired;
+  };
+
+  Handle Allocate(Binding binding);
+  void Retire(Binding binding, Handle handle);
+  void Write(Binding binding, Handle handle,
+             const VkDescriptorImageInfo* image_info,
+             const VkDescriptorBufferInfo* buffer_info);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool descriptor_pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet descriptor_set_ = VK_NULL_HANDLE;
+
+  Slots slots_[kBindingCount];
+  uint32_t frame_slot_ = 0;
+};
+
+#endif /* VULKAN_BINDLESS_TABLE_H_ */
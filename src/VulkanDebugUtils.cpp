@@ -0,0 +1,104 @@
+
+#include "VulkanDebugUtils.h"
+
+#if VULKAN_DEBUG_UTILS_ENABLED
+
+#include <cstdarg>
+#include <cstdio>
+
+namespace {
+
+PFN_vkSetDebugUtilsObjectNameEXT set_object_name = nullptr;
+PFN_vkCmdBeginDebugUtilsLabelEXT cmd_begin_label = nullptr;
+PFN_vkCmdEndDebugUtilsLabelEXT cmd_end_label = nullptr;
+PFN_vkCmdInsertDebugUtilsLabelEXT cmd_insert_label = nullptr;
+PFN_vkQueueBeginDebugUtilsLabelEXT queue_begin_label = nullptr;
+PFN_vkQueueEndDebugUtilsLabelEXT queue_end_label = nullptr;
+
+template <typename T>
+void LoadEntryPoint(VkInstance instance, const char* name, T* function) {
+  *function = reinterpret_cast<T>(vkGetInstanceProcAddr(instance, name));
+}
+
+VkDebugUtilsLabelEXT MakeLabel(const char* name) {
+  VkDebugUtilsLabelEXT label = {};
+  label.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+  label.pLabelName = name;
+  return label;
+}
+
+}  // namespace
+
+
+void InitializeVulkanDebugUtils(VkInstance instance) {
+  LoadEntryPoint(instance, "vkSetDebugUtilsObjectNameEXT", &set_object_name);
+  LoadEntryPoint(instance, "vkCmdBeginDebugUtilsLabelEXT", &cmd_begin_label);
+  LoadEntryPoint(instance, "vkCmdEndDebugUtilsLabelEXT", &cmd_end_label);
+  LoadEntryPoint(instance, "vkCmdInsertDebugUtilsLabelEXT", &cmd_insert_label);
+  LoadEntryPoint(instance, "vkQueueBeginDebugUtilsLabelEXT",
+                 &queue_begin_label);
+  LoadEntryPoint(instance, "vkQueueEndDebugUtilsLabelEXT", &queue_end_label);
+}
+
+bool VulkanDebugUtilsEnabled() {
+  return set_object_name != nullptr;
+}
+
+void SetVulkanObjectName(VkDevice device, VkObjectType type, uint64_t handle,
+                         const char* format, ...) {
+  if (!set_object_name || 0 == handle)
+    return;
+
+  char name[128];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(name, sizeof(name), format, args);
+  va_end(args);
+
+  VkDebugUtilsObjectNameInfoEXT name_info = {};
+  name_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT;
+  name_info.objectType = type;
+  name_info.objectHandle = handle;
+  name_info.pObjectName = name;
+  set_object_name(device, &name_info);
+}
+
+
+VulkanDebugLabel::VulkanDebugLabel(VkCommandBuffer command_buffer,
+                                   const char* name)
+    : command_buffer_(command_buffer) {
+  if (!cmd_begin_label)
+    return;
+  VkDebugUtilsLabelEXT label = MakeLabel(name);
+  cmd_begin_label(command_buffer_, &label);
+}
+
+VulkanDebugLabel::~VulkanDebugLabel() {
+  if (cmd_end_label)
+    cmd_end_label(command_buffer_);
+}
+
+// static
+void VulkanDebugLabel::Insert(VkCommandBuffer command_buffer,
+                              const char* name) {
+  if (!cmd_insert_label)
+    return;
+  VkDebugUtilsLabelEXT label = MakeLabel(name);
+  cmd_insert_label(command_buffer, &label);
+}
+
+
+VulkanQueueDebugLabel::VulkanQueueDebugLabel(VkQueue queue, const char* name)
+    : queue_(queue) {
+  if (!queue_begin_label)
+    return;
+  VkDebugUtilsLabelEXT label = MakeLabel(name);
+  queue_begin_label(queue_, &label);
+}
+
+VulkanQueueDebugLabel::~VulkanQueueDebugLabel() {
+  if (queue_end_label)
+    queue_end_label(queue_);
+}
+
+#endif  // VULKAN_DEBUG_UTILS_ENABLED
@@ -0,0 +1,74 @@
+#ifndef VULKAN_DEBUG_UTILS_H_
+#define VULKAN_DEBUG_UTILS_H_
+
+#include <vulkan/vulkan.h>
+
+#include "VulkanInstance.h"
+
+// VK_EXT_debug_utils object names and label regions, which make captures
+// from RenderDoc, Nsight, RGP and the like readable. Debug builds only: in
+// release builds the labels are empty inline classes and VK_DEBUG_NAME()
+// expands to nothing, arguments included. Until the instance has enabled the
+// extension every call is a no-op.
+#define VULKAN_DEBUG_UTILS_ENABLED DCHECK_IS_ON()
+
+#if VULKAN_DEBUG_UTILS_ENABLED
+
+// Loads the entry points; called by the instance once it enabled the
+// extension.
+void InitializeVulkanDebugUtils(VkInstance instance);
+bool VulkanDebugUtilsEnabled();
+
+// |format| is printf-style.
+void SetVulkanObjectName(VkDevice device, VkObjectType type, uint64_t handle,
+                         const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+// Names |handle| of |type|, e.g.
+//   VK_DEBUG_NAME(device, VK_OBJECT_TYPE_IMAGE, image, "shadow map %u", i);
+#define VK_DEBUG_NAME(device, type, handle, ...) \
+  SetVulkanObjectName(device, type, (uint64_t)(handle), __VA_ARGS__)
+
+#else
+
+#define VK_DEBUG_NAME(device, type, handle, ...) ((void) 0)
+
+#endif  // VULKAN_DEBUG_UTILS_ENABLED
+
+// Labels the commands recorded into |command_buffer| during its lifetime.
+// Regions nest and may not cross command buffer boundaries.
+class VulkanDebugLabel
+{
+public:
+#if VULKAN_DEBUG_UTILS_ENABLED
+  VulkanDebugLabel(VkCommandBuffer command_buffer, const char* name);
+  ~VulkanDebugLabel();
+
+  // A single point in the command stream rather than a region.
+  static void Insert(VkCommandBuffer command_buffer, const char* name);
+
+private:
+  VkCommandBuffer command_buffer_;
+#else
+  VulkanDebugLabel(VkCommandBuffer, const char*) {}
+
+  static void Insert(VkCommandBuffer, const char*) {}
+#endif
+};
+
+// Labels the submissions made to |queue| during its lifetime.
+class VulkanQueueDebugLabel
+{
+public:
+#if VULKAN_DEBUG_UTILS_ENABLED
+  VulkanQueueDebugLabel(VkQueue queue, const char* name);
+  ~VulkanQueueDebugLabel();
+
+private:
+  VkQueue queue_;
+#else
+  VulkanQueueDebugLabel(VkQueue, const char*) {}
+#endif
+};
+
+#endif /* VULKAN_DEBUG_UTILS_H_ */
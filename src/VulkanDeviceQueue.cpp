@@ -8,8 +8,103 @@
 #include "VulkanInstance.h"
 #include "VulkanDeviceQueue.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 
+namespace {
+
+bool IsDigits(const std::string& s) {
+  if (s.empty())
+    return false;
+  for (char c : s) {
+    if (!isdigit(static_cast<unsigned char>(c)))
+      return false;
+  }
+  return true;
+}
+
+bool ParseHex(const std::string& s, uint32_t* value) {
+  std::string digits = s;
+  if (digits.size() > 2 && digits[0] == '0' &&
+      (digits[1] == 'x' || digits[1] == 'X'))
+    digits = digits.substr(2);
+  if (digits.empty() || digits.size() > 8)
+    return false;
+  for (char c : digits) {
+    if (!isxdigit(static_cast<unsigned char>(c)))
+      return false;
+  }
+  *value = static_cast<uint32_t>(strtoul(digits.c_str(), nullptr, 16));
+  return true;
+}
+
+bool HasDeviceExtension(VkPhysicalDevice device, const char* name) {
+  uint32_t count = 0;
+  if (VK_SUCCESS != vkEnumerateDeviceExtensionProperties(device, nullptr,
+                                                         &count, nullptr))
+    return false;
+  std::vector<VkExtensionProperties> extensions(count);
+  if (VK_SUCCESS != vkEnumerateDeviceExtensionProperties(device, nullptr,
+                                                         &count,
+                                                         extensions.data()))
+    return false;
+  for (const VkExtensionProperties& extension : extensions) {
+    if (strcmp(extension.extensionName, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+std::string ToLower(std::string s) {
+  for (char& c : s)
+    c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+  return s;
+}
+
+// Whether the device at |index| with |properties| is the one |selector|
+// asks for; see SetDeviceSelector().
+bool MatchesSelector(const std::string& selector, size_t index,
+                     const VkPhysicalDeviceProperties& properties) {
+  if (IsDigits(selector))
+    return strtoul(selector.c_str(), nullptr, 10) == index;
+
+  size_t colon = selector.find(':');
+  uint32_t vendor_id = 0;
+  uint32_t device_id = 0;
+  if (colon != std::string::npos) {
+    if (ParseHex(selector.substr(0, colon), &vendor_id) &&
+        ParseHex(selector.substr(colon + 1), &device_id)) {
+      return properties.vendorID == vendor_id &&
+             properties.deviceID == device_id;
+    }
+  } else if (selector.compare(0, 2, "0x") == 0 &&
+             ParseHex(selector, &vendor_id)) {
+    return properties.vendorID == vendor_id;
+  }
+
+  return ToLower(properties.deviceName).find(ToLower(selector)) !=
+         std::string::npos;
+}
+
+const char* DeviceTypeName(VkPhysicalDeviceType type) {
+  switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      return "cpu";
+    default:
+      return "other";
+  }
+}
+
+}  // namespace
 
 VulkanDeviceQueue::VulkanDeviceQueue() {}
 
@@ -19,18 +114,57 @@ VulkanDeviceQueue::~VulkanDeviceQueue() {
   DCHECK_EQ(static_cast<VkQueue>(VK_NULL_HANDLE), vk_queue_);
 }
 
+void VulkanDeviceQueue::SetQueuePriority(QueueType type, float priority) {
+  DCHECK_EQ(static_cast<VkDevice>(VK_NULL_HANDLE), vk_device_);
+  queue_priorities_[type] = std::min(std::max(priority, 0.0f), 1.0f);
+}
+
+void VulkanDeviceQueue::SetDeviceSelector(const std::string& selector) {
+  DCHECK_EQ(static_cast<VkDevice>(VK_NULL_HANDLE), vk_device_);
+  device_selector_ = selector;
+}
+
 bool VulkanDeviceQueue::Initialize(uint32_t options) {
   if (!SelectPhysicalDevice(options))
     return false;
 
-  float queue_priority = 0.0f;
-  VkDeviceQueueCreateInfo queue_create_info = {};
-  queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queue_create_info.queueFamilyIndex = vk_queue_index_;
-  queue_create_info.queueCount = 1;
-  queue_create_info.pQueuePriorities = &queue_priority;
+  SelectDedicatedQueueFamilies(options);
+
+  // One queue per distinct family. A type sharing the graphics family
+  // shares the graphics queue too, and with it the graphics priority.
+  std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
+  for (uint32_t type = 0; type < QUEUE_TYPE_COUNT; ++type) {
+    bool seen = false;
+    for (const VkDeviceQueueCreateInfo& info : queue_create_infos)
+      seen |= info.queueFamilyIndex == vk_queue_indices_[type];
+    if (seen)
+      continue;
+
+    VkDeviceQueueCreateInfo queue_create_info = {};
+    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_create_info.queueFamilyIndex = vk_queue_indices_[type];
+    queue_create_info.queueCount = 1;
+    queue_create_info.pQueuePriorities = &queue_priorities_[type];
+    queue_create_infos.push_back(queue_create_info);
+  }
 
-  const char* device_extensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+  // Offscreen-only devices never present, so they do not need (and may not
+  // expose) the swapchain extension.
+  std::vector<const char*> device_extensions;
+  if (options & DeviceQueueOption::PRESENTATION_SUPPORT_QUEUE_FLAG)
+    device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+
+  // Chained into the create info, so it has to outlive vkCreateDevice().
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {};
+  indexing_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  descriptor_indexing_enabled_ =
+      (options & DeviceQueueOption::DESCRIPTOR_INDEXING_FLAG) &&
+      QueryDescriptorIndexing(&indexing_features);
+  if (descriptor_indexing_enabled_) {
+    device_extensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+    device_extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+  }
 
   std::vector<const char*> enabled_layer_names;
 #if false //DCHECK_IS_ON()
@@ -64,23 +198,137 @@ bool VulkanDeviceQueue::Initialize(uint32_t options) {
 
   VkDeviceCreateInfo device_create_info = {};
   device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  device_create_info.queueCreateInfoCount = 1;
-  device_create_info.pQueueCreateInfos = &queue_create_info;
+  if (descriptor_indexing_enabled_)
+    device_create_info.pNext = &indexing_features;
+  device_create_info.queueCreateInfoCount = queue_create_infos.size();
+  device_create_info.pQueueCreateInfos = queue_create_infos.data();
   device_create_info.enabledLayerCount = enabled_layer_names.size();
   device_create_info.ppEnabledLayerNames = enabled_layer_names.data();
-  device_create_info.enabledExtensionCount = arraysize(device_extensions);
-  device_create_info.ppEnabledExtensionNames = device_extensions;
+  device_create_info.enabledExtensionCount = device_extensions.size();
+  device_create_info.ppEnabledExtensionNames = device_extensions.data();
 
   VkResult result = vkCreateDevice(vk_physical_device_, &device_create_info, nullptr,
                                    &vk_device_);
-  if (VK_SUCCESS != result)
+  if (VK_SUCCESS != result) {
+    descriptor_indexing_enabled_ = false;
     return false;
+  }
 
   vkGetDeviceQueue(vk_device_, vk_queue_index_, 0, &vk_queue_);
+  for (uint32_t type = 0; type < QUEUE_TYPE_COUNT; ++type)
+    vkGetDeviceQueue(vk_device_, vk_queue_indices_[type], 0, &vk_queues_[type]);
 
+  DLOG(INFO) << "Queue families: graphics " << vk_queue_index_
+             << ", compute " << vk_queue_indices_[COMPUTE_QUEUE]
+             << ", transfer " << vk_queue_indices_[TRANSFER_QUEUE];
   return true;
 }
 
+bool VulkanDeviceQueue::QueryDescriptorIndexing(
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT* features) {
+  if (!VulkanPhysicalDeviceProperties2Supported() ||
+      !HasDeviceExtension(vk_physical_device_,
+                          VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) ||
+      !HasDeviceExtension(vk_physical_device_,
+                          VK_KHR_MAINTENANCE3_EXTENSION_NAME)) {
+    LOG(INFO) << "Descriptor indexing unavailable";
+    return false;
+  }
+
+  VkInstance vk_instance = GetVulkanInstance();
+  PFN_vkGetPhysicalDeviceFeatures2KHR vkGetPhysicalDeviceFeatures2KHR =
+      reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(
+          vkGetInstanceProcAddr(vk_instance,
+                                "vkGetPhysicalDeviceFeatures2KHR"));
+  PFN_vkGetPhysicalDeviceProperties2KHR vkGetPhysicalDeviceProperties2KHR =
+      reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(
+          vkGetInstanceProcAddr(vk_instance,
+                                "vkGetPhysicalDeviceProperties2KHR"));
+  if (!vkGetPhysicalDeviceFeatures2KHR || !vkGetPhysicalDeviceProperties2KHR)
+    return false;
+
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported = {};
+  supported.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features2.pNext = &supported;
+  vkGetPhysicalDeviceFeatures2KHR(vk_physical_device_, &features2);
+
+  // Slots are written while frames using other slots are in flight, and
+  // only the slots written so far are valid.
+  if (!supported.runtimeDescriptorArray ||
+      !supported.descriptorBindingPartiallyBound ||
+      !supported.descriptorBindingUpdateUnusedWhilePending ||
+      !supported.descriptorBindingSampledImageUpdateAfterBind ||
+      !supported.descriptorBindingStorageBufferUpdateAfterBind ||
+      !supported.shaderSampledImageArrayNonUniformIndexing) {
+    LOG(INFO) << "Descriptor indexing lacks update-after-bind features";
+    return false;
+  }
+
+  features->runtimeDescriptorArray = VK_TRUE;
+  features->descriptorBindingPartiallyBound = VK_TRUE;
+  features->descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+  features->descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+  features->descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+  features->shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+  features->shaderStorageBufferArrayNonUniformIndexing =
+      supported.shaderStorageBufferArrayNonUniformIndexing;
+
+  descriptor_indexing_properties_ = {};
+  descriptor_indexing_properties_.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+  VkPhysicalDeviceProperties2KHR properties2 = {};
+  properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+  properties2.pNext = &descriptor_indexing_properties_;
+  vkGetPhysicalDeviceProperties2KHR(vk_physical_device_, &properties2);
+  descriptor_indexing_properties_.pNext = nullptr;
+  return true;
+}
+
+void VulkanDeviceQueue::SelectDedicatedQueueFamilies(uint32_t options) {
+  for (uint32_t type = 0; type < QUEUE_TYPE_COUNT; ++type)
+    vk_queue_indices_[type] = vk_queue_index_;
+
+  uint32_t queue_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(vk_physical_device_, &queue_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> queue_properties(queue_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(vk_physical_device_, &queue_count,
+                                           queue_properties.data());
+
+  int compute_index = -1;
+  int transfer_index = -1;
+  int transfer_fallback_index = -1;
+  for (size_t n = 0; n < queue_properties.size(); ++n) {
+    const VkQueueFlags flags = queue_properties[n].queueFlags;
+    if (queue_properties[n].queueCount == 0 || (flags & VK_QUEUE_GRAPHICS_BIT))
+      continue;
+
+    if ((flags & VK_QUEUE_COMPUTE_BIT) && compute_index == -1)
+      compute_index = static_cast<int>(n);
+
+    // Compute families can copy too; prefer a pure transfer (DMA) family,
+    // but settle for a second async family over the graphics one.
+    if (flags & (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_COMPUTE_BIT)) {
+      if (!(flags & VK_QUEUE_COMPUTE_BIT) && transfer_index == -1)
+        transfer_index = static_cast<int>(n);
+      else if (transfer_fallback_index == -1 &&
+               static_cast<int>(n) != compute_index)
+        transfer_fallback_index = static_cast<int>(n);
+    }
+  }
+  if (transfer_index == -1)
+    transfer_index = transfer_fallback_index;
+
+  if ((options & DeviceQueueOption::COMPUTE_QUEUE_FLAG) && compute_index != -1)
+    vk_queue_indices_[COMPUTE_QUEUE] = compute_index;
+  if ((options & DeviceQueueOption::TRANSFER_QUEUE_FLAG) &&
+      transfer_index != -1)
+    vk_queue_indices_[TRANSFER_QUEUE] = transfer_index;
+}
+
 
 bool VulkanDeviceQueue::SelectPhysicalDevice(uint32_t options) {
   VkInstance vk_instance = GetVulkanInstance();
@@ -114,8 +362,12 @@ bool VulkanDeviceQueue::SelectPhysicalDevice(uint32_t options) {
 
   int device_index = -1;
   int queue_index = -1;
+  uint64_t best_score = 0;
+  int selected_index = -1;
+  int selected_queue_index = -1;
   for (size_t i = 0; i < devices.size(); ++i) {
     const VkPhysicalDevice& device = devices[i];
+    int device_queue_index = -1;
     uint32_t queue_count = 0;
     vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_count, nullptr);
     if (queue_count) {
@@ -134,25 +386,133 @@ bool VulkanDeviceQueue::SelectPhysicalDevice(uint32_t options) {
         }
 #endif
 
-        queue_index = static_cast<int>(n);
+        device_queue_index = static_cast<int>(n);
         break;
       }
+    }
 
-      if (-1 != queue_index) {
-        device_index = static_cast<int>(i);
-        break;
-      }
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (-1 == device_queue_index) {
+      DLOG(INFO) << "Device " << i << " (" << properties.deviceName
+                 << "): no suitable queue family";
+      continue;
+    }
+
+    // Devices enumerate in no particular order; rank them rather than
+    // taking whichever comes first, which on hybrid systems tends to be
+    // the integrated GPU. Ties keep the enumeration order.
+    const uint64_t score = ScorePhysicalDevice(device);
+    DLOG(INFO) << "Device " << i << " (" << properties.deviceName << ", "
+               << DeviceTypeName(properties.deviceType) << ", " << std::hex
+               << properties.vendorID << ":" << properties.deviceID
+               << std::dec << "): score " << score;
+    if (-1 == device_index || score > best_score) {
+      device_index = static_cast<int>(i);
+      queue_index = device_queue_index;
+      best_score = score;
+    }
+
+    if (!device_selector_.empty() && -1 == selected_index &&
+        MatchesSelector(device_selector_, i, properties)) {
+      selected_index = static_cast<int>(i);
+      selected_queue_index = device_queue_index;
     }
   }
 
   if (queue_index == -1)
     return false;
 
+  if (-1 != selected_index) {
+    device_index = selected_index;
+    queue_index = selected_queue_index;
+  } else if (!device_selector_.empty()) {
+    LOG(WARNING) << "No suitable device matches \"" << device_selector_
+                 << "\"; using the highest ranked one";
+  }
+
   vk_physical_device_ = devices[device_index];
   vk_queue_index_ = queue_index;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(vk_physical_device_, &properties);
+  LOG(INFO) << "Using device " << device_index << ": "
+            << properties.deviceName << " ("
+            << DeviceTypeName(properties.deviceType) << ")";
   return true;
 }
 
+// static
+uint64_t VulkanDeviceQueue::ScorePhysicalDevice(VkPhysicalDevice device) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device, &properties);
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(device, &features);
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(device, &memory_properties);
+
+  // Each tier outweighs everything below it put together.
+  uint64_t score = 0;
+  switch (properties.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      score = 4;
+      break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      score = 3;
+      break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      score = 2;
+      break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      score = 1;
+      break;
+    default:
+      break;
+  }
+  score <<= 40;
+
+  // Largest device-local heap in MB, capped at 1TB.
+  VkDeviceSize local_heap = 0;
+  for (uint32_t i = 0; i < memory_properties.memoryHeapCount; ++i) {
+    const VkMemoryHeap& heap = memory_properties.memoryHeaps[i];
+    if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      local_heap = std::max(local_heap, heap.size);
+  }
+  score += std::min<uint64_t>(local_heap >> 20, (1u << 20) - 1) << 20;
+
+  // Features and limits the renderer uses or benefits from.
+  uint64_t capabilities = 0;
+  capabilities += features.multiDrawIndirect ? 64 : 0;
+  capabilities += features.drawIndirectFirstInstance ? 32 : 0;
+  capabilities += features.samplerAnisotropy ? 16 : 0;
+  capabilities += properties.limits.timestampComputeAndGraphics ? 16 : 0;
+  capabilities += std::min(properties.limits.maxImageDimension2D / 1024, 32u);
+  capabilities +=
+      std::min(properties.limits.maxPushConstantsSize / 64, 16u);
+
+  // Separate compute and transfer families let uploads and async compute
+  // overlap with rendering.
+  uint32_t queue_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_count, nullptr);
+  std::vector<VkQueueFamilyProperties> queue_properties(queue_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_count,
+                                           queue_properties.data());
+  bool async_compute = false;
+  bool async_transfer = false;
+  for (const VkQueueFamilyProperties& family : queue_properties) {
+    if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+      continue;
+    if (family.queueFlags & VK_QUEUE_COMPUTE_BIT)
+      async_compute = true;
+    else if (family.queueFlags & VK_QUEUE_TRANSFER_BIT)
+      async_transfer = true;
+  }
+  capabilities += async_compute ? 128 : 0;
+  capabilities += async_transfer ? 64 : 0;
+
+  return score + std::min<uint64_t>(capabilities, (1u << 20) - 1);
+}
+
 void VulkanDeviceQueue::Destroy() {
   if (VK_NULL_HANDLE != vk_device_) {
     vkDestroyDevice(vk_device_, nullptr);
@@ -161,6 +521,11 @@ void VulkanDeviceQueue::Destroy() {
 
   vk_queue_ = VK_NULL_HANDLE;
   vk_queue_index_ = 0;
+  for (uint32_t type = 0; type < QUEUE_TYPE_COUNT; ++type) {
+    vk_queues_[type] = VK_NULL_HANDLE;
+    vk_queue_indices_[type] = 0;
+  }
 
   vk_physical_device_ = VK_NULL_HANDLE;
+  descriptor_indexing_enabled_ = false;
 }
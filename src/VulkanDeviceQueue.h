@@ -11,17 +11,44 @@
 #include <vulkan/vulkan.h>
 #include "VulkanInstance.h"
 
+#include <string>
+
 class VulkanDeviceQueue
 {
 public:
   enum DeviceQueueOption {
     GRAPHICS_QUEUE_FLAG = 0x01,
     PRESENTATION_SUPPORT_QUEUE_FLAG = 0x02,
+    // Look for a transfer-only family (a DMA engine) for uploads.
+    TRANSFER_QUEUE_FLAG = 0x04,
+    // Look for a compute family without graphics for async compute.
+    COMPUTE_QUEUE_FLAG = 0x08,
+    // Enable the descriptor indexing features a bindless descriptor table
+    // needs (VK_EXT_descriptor_indexing), if the device has all of them.
+    DESCRIPTOR_INDEXING_FLAG = 0x10,
+  };
+
+  enum QueueType {
+    GRAPHICS_QUEUE = 0,
+    COMPUTE_QUEUE,
+    TRANSFER_QUEUE,
+    QUEUE_TYPE_COUNT,
   };
 
   VulkanDeviceQueue();
   ~VulkanDeviceQueue();
 
+  // Priorities are in [0, 1] and only matter between queues of one device.
+  // Must be called before Initialize().
+  void SetQueuePriority(QueueType type, float priority);
+
+  // Pins the physical device instead of ranking them. |selector| is an
+  // enumeration index ("1"), a vendor ID ("0x10de"), a vendor:device ID pair
+  // in hex ("10de:2684") or a case-insensitive substring of the device name
+  // ("radeon"). Empty restores ranking. A selector matching no suitable
+  // device is reported and ignored. Must be called before Initialize().
+  void SetDeviceSelector(const std::string& selector);
+
   bool Initialize(uint32_t options);
   void Destroy();
 
@@ -42,13 +69,61 @@ public:
   }
 
   uint32_t GetVulkanQueueIndex() const { return vk_queue_index_; }
+
+  // Without a dedicated family for |type| (or without the matching option)
+  // these return the graphics queue and family.
+  VkQueue GetVulkanQueue(QueueType type) const {
+    DCHECK_NE(static_cast<VkQueue>(VK_NULL_HANDLE), vk_queues_[type]);
+    return vk_queues_[type];
+  }
+
+  uint32_t GetVulkanQueueIndex(QueueType type) const {
+    return vk_queue_indices_[type];
+  }
+
+  bool HasDedicatedQueue(QueueType type) const {
+    return type != GRAPHICS_QUEUE &&
+           vk_queue_indices_[type] != vk_queue_index_;
+  }
+
+  // Whether DESCRIPTOR_INDEXING_FLAG was asked for and could be honoured:
+  // update-after-bind, partially bound and runtime-sized arrays of sampled
+  // images, samplers and storage buffers.
+  bool descriptor_indexing_enabled() const {
+    return descriptor_indexing_enabled_;
+  }
+  // The update-after-bind limits; only valid if descriptor indexing is
+  // enabled.
+  const VkPhysicalDeviceDescriptorIndexingPropertiesEXT&
+  descriptor_indexing_properties() const {
+    return descriptor_indexing_properties_;
+  }
+
 private:
   bool SelectPhysicalDevice(uint32_t options);
+  // Higher is better: device type first, then device-local memory, features,
+  // limits and queue topology.
+  static uint64_t ScorePhysicalDevice(VkPhysicalDevice device);
+  void SelectDedicatedQueueFamilies(uint32_t options);
+  // Fills |features| with the descriptor indexing features to enable, or
+  // returns false if the device lacks any of them.
+  bool QueryDescriptorIndexing(
+      VkPhysicalDeviceDescriptorIndexingFeaturesEXT* features);
 
   VkPhysicalDevice vk_physical_device_ = VK_NULL_HANDLE;
   VkDevice vk_device_ = VK_NULL_HANDLE;
   VkQueue vk_queue_ = VK_NULL_HANDLE;
   uint32_t vk_queue_index_ = 0;
+
+  VkQueue vk_queues_[QUEUE_TYPE_COUNT] = {};
+  uint32_t vk_queue_indices_[QUEUE_TYPE_COUNT] = {};
+  float queue_priorities_[QUEUE_TYPE_COUNT] = { 1.0f, 0.5f, 0.5f };
+
+  std::string device_selector_;
+
+  bool descriptor_indexing_enabled_ = false;
+  VkPhysicalDeviceDescriptorIndexingPropertiesEXT
+      descriptor_indexing_properties_ = {};
 };
 
 #endif /* VULKAN_DEVICE_QUEUE_H_ */
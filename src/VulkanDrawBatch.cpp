@@ -0,0 +1,148 @@
+
+#include "VulkanDrawBatch.h"
+#include "VulkanInstance.h"
+#include "VulkanMemoryAllocator.h"
+#include "VulkanMesh.h"
+
+#include <cstring>
+
+
+VulkanDrawBatch::VulkanDrawBatch() {}
+
+VulkanDrawBatch::~VulkanDrawBatch() {}
+
+void VulkanDrawBatch::Reset() {
+  for (Group& group : groups_)
+    group.instances.clear();
+  instance_count_ = 0;
+}
+
+VulkanDrawBatch::Group* VulkanDrawBatch::GetGroup(const VulkanMesh* mesh) {
+  auto it = group_indices_.find(mesh);
+  if (it != group_indices_.end())
+    return &groups_[it->second];
+
+  group_indices_[mesh] = groups_.size();
+  groups_.push_back(Group());
+  groups_.back().mesh = mesh;
+  return &groups_.back();
+}
+
+void VulkanDrawBatch::Add(const VulkanMesh* mesh,
+                          const InstanceData& instance) {
+  GetGroup(mesh)->instances.push_back(instance);
+  ++instance_count_;
+}
+
+void VulkanDrawBatch::Add(const VulkanMesh* mesh,
+                          const InstanceData* instances, uint32_t count) {
+  std::vector<InstanceData>& group = GetGroup(mesh)->instances;
+  group.insert(group.end(), instances, instances + count);
+  instance_count_ += count;
+}
+
+bool VulkanDrawBatch::Prepare(VulkanLinearArena* arena) {
+  draws_.clear();
+  argument_buffer_ = arena->buffer();
+  if (instance_count_ == 0)
+    return true;
+
+  // The shader indexes the whole arena buffer, so the instance data must
+  // start on an InstanceData boundary.
+  VkDeviceSize instance_offset = 0;
+  void* instance_data = nullptr;
+  if (!arena->Allocate(instance_count_ * sizeof(InstanceData),
+                       sizeof(InstanceData), &instance_offset,
+                       &instance_data)) {
+    DLOG(ERROR) << "Transient arena too small for " << instance_count_
+                << " instances";
+    return false;
+  }
+
+  uint32_t group_count = 0;
+  for (const Group& group : groups_) {
+    if (!group.instances.empty())
+      ++group_count;
+  }
+
+  const VkDeviceSize command_stride = sizeof(VkDrawIndexedIndirectCommand);
+  VkDeviceSize command_offset = 0;
+  void* command_data = nullptr;
+  if (!arena->Allocate(group_count * command_stride, 4, &command_offset,
+                       &command_data)) {
+    DLOG(ERROR) << "Transient arena too small for the draw arguments";
+    return false;
+  }
+
+  InstanceData* instances = static_cast<InstanceData*>(instance_data);
+  char* commands = static_cast<char*>(command_data);
+  uint32_t instance_base =
+      static_cast<uint32_t>(instance_offset / sizeof(InstanceData));
+
+  draws_.reserve(group_count);
+  for (const Group& group : groups_) {
+    if (group.instances.empty())
+      continue;
+
+    const uint32_t count = static_cast<uint32_t>(group.instances.size());
+    memcpy(instances, group.instances.data(), count * sizeof(InstanceData));
+    instances += count;
+
+    if (VK_NULL_HANDLE != group.mesh->index_buffer()) {
+      VkDrawIndexedIndirectCommand command = {};
+      command.indexCount = group.mesh->index_count();
+      command.instanceCount = count;
+      memcpy(commands, &command, sizeof(command));
+    } else {
+      VkDrawIndirectCommand command = {};
+      command.vertexCount = group.mesh->vertex_count();
+      command.instanceCount = count;
+      memcpy(commands, &command, sizeof(command));
+    }
+
+    Draw draw;
+    draw.mesh = group.mesh;
+    draw.instance_base = instance_base;
+    draw.command_offset = command_offset;
+    draws_.push_back(draw);
+
+    commands += command_stride;
+    command_offset += command_stride;
+    instance_base += count;
+  }
+  return true;
+}
+
+void VulkanDrawBatch::RecordDraws(VkCommandBuffer command_buffer,
+                                  VkPipelineLayout layout, uint32_t first,
+                                  uint32_t count) const {
+  const VkDeviceSize command_stride = sizeof(VkDrawIndexedIndirectCommand);
+  for (uint32_t i = first; i < first + count && i < draws_.size(); ++i) {
+    const Draw& draw = draws_[i];
+
+    // firstInstance stays 0 (drawIndirectFirstInstance is optional); the
+    // shader offsets gl_InstanceIndex by the pushed base instead.
+    DrawConstants constants;
+    constants.instance_base = draw.instance_base;
+    vkCmdPushConstants(command_buffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                       sizeof(constants), &constants);
+
+    draw.mesh->Bind(command_buffer);
+    if (VK_NULL_HANDLE != draw.mesh->index_buffer()) {
+      vkCmdDrawIndexedIndirect(command_buffer, argument_buffer_,
+                               draw.command_offset, 1, command_stride);
+    } else {
+      vkCmdDrawIndirect(command_buffer, argument_buffer_, draw.command_offset,
+                        1, command_stride);
+    }
+  }
+}
+
+bool VulkanDrawBatch::Record(VkCommandBuffer command_buffer,
+                             VulkanLinearArena* arena,
+                             VkPipelineLayout layout) {
+  if (!Prepare(arena))
+    return false;
+  RecordDraws(command_buffer, layout, 0, draw_count());
+  return true;
+}
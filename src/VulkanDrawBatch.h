@@ -0,0 +1,89 @@
+#ifndef VULKAN_DRAW_BATCH_H_
+#define VULKAN_DRAW_BATCH_H_
+
+#include <vulkan/vulkan.h>
+
+#include <unordered_map>
+#include <vector>
+
+class VulkanLinearArena;
+class VulkanMesh;
+
+// Per-object data, laid out like the std430 InstanceData in shader.vert.
+struct InstanceData {
+  // Column-major object-to-clip transform.
+  float transform[16];
+  float color[4];
+  uint32_t material_index;
+  // Bindless handles, VulkanBindlessTable::kInvalidHandle when untextured.
+  // Only read by textured.vert.
+  uint32_t texture_index;
+  uint32_t sampler_index;
+  uint32_t padding[1];
+};
+
+// Push constants of pipelines drawing a batch.
+struct DrawConstants {
+  // Index of the draw's first InstanceData in the instance buffer.
+  uint32_t instance_base;
+};
+
+// Collects the instances of a frame and draws them with one indirect draw
+// per mesh, however many objects there are.
+//
+// Prepare() writes the instance data and the VkDrawIndexedIndirectCommand
+// arguments into a per-frame VulkanLinearArena; RecordDraws() then records
+// any range of the resulting draws and may run on several threads at once.
+// The arena's buffer must be bound as the instance storage buffer, and the
+// pipeline layout must carry DrawConstants as a vertex stage push constant
+// range.
+class VulkanDrawBatch
+{
+public:
+  VulkanDrawBatch();
+  ~VulkanDrawBatch();
+
+  // Drops the instances of the previous frame, keeping their storage.
+  void Reset();
+
+  void Add(const VulkanMesh* mesh, const InstanceData& instance);
+  void Add(const VulkanMesh* mesh, const InstanceData* instances,
+           uint32_t count);
+
+  // Returns false if |arena| is too small for the batch.
+  bool Prepare(VulkanLinearArena* arena);
+  // Records draws [first, first + count) of the last Prepare().
+  void RecordDraws(VkCommandBuffer command_buffer, VkPipelineLayout layout,
+                   uint32_t first, uint32_t count) const;
+  // Prepare() followed by RecordDraws() of every draw.
+  bool Record(VkCommandBuffer command_buffer, VulkanLinearArena* arena,
+              VkPipelineLayout layout);
+
+  uint32_t instance_count() const { return instance_count_; }
+  // Indirect draw calls produced by the last Prepare().
+  uint32_t draw_count() const { return static_cast<uint32_t>(draws_.size()); }
+
+private:
+  struct Group {
+    const VulkanMesh* mesh;
+    std::vector<InstanceData> instances;
+  };
+
+  struct Draw {
+    const VulkanMesh* mesh;
+    uint32_t instance_base;
+    VkDeviceSize command_offset;
+  };
+
+  Group* GetGroup(const VulkanMesh* mesh);
+
+  std::vector<Group> groups_;
+  std::unordered_map<const VulkanMesh*, size_t> group_indices_;
+  uint32_t instance_count_ = 0;
+
+  std::vector<Draw> draws_;
+  // Buffer holding the indirect arguments, i.e. the arena's.
+  VkBuffer argument_buffer_ = VK_NULL_HANDLE;
+};
+
+#endif /* VULKAN_DRAW_BATCH_H_ */
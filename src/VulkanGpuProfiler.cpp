@@ -0,0 +1,234 @@
+
+#include "VulkanGpuProfiler.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+#include <fstream>
+
+
+VulkanGpuProfiler::VulkanGpuProfiler() {}
+
+VulkanGpuProfiler::~VulkanGpuProfiler() {
+  DCHECK(frames_.empty());
+}
+
+bool VulkanGpuProfiler::Initialize(VkPhysicalDevice physical_device,
+                                   VkDevice device,
+                                   uint32_t queue_family_index,
+                                   uint32_t frame_count,
+                                   uint32_t max_scopes_per_frame) {
+  DCHECK(frames_.empty());
+  device_ = device;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                           families.data());
+  if (queue_family_index >= family_count)
+    return false;
+
+  uint32_t valid_bits = families[queue_family_index].timestampValidBits;
+  if (valid_bits == 0 || properties.limits.timestampPeriod == 0.0f) {
+    DLOG(WARNING) << "GPU profiler disabled: no timestamp support";
+    return false;
+  }
+
+  ns_per_tick_ = properties.limits.timestampPeriod;
+  timestamp_mask_ = valid_bits >= 64 ? ~0ULL : ((1ULL << valid_bits) - 1);
+  queries_per_frame_ = max_scopes_per_frame * 2;
+  results_.resize(queries_per_frame_);
+
+  VkQueryPoolCreateInfo pool_create_info = {};
+  pool_create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  pool_create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  pool_create_info.queryCount = queries_per_frame_;
+
+  frames_.resize(frame_count);
+  for (FrameQueries& frame : frames_) {
+    VkResult result = vkCreateQueryPool(device_, &pool_create_info, nullptr,
+                                        &frame.pool);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << "vkCreateQueryPool() failed: " << result;
+      Destroy();
+      return false;
+    }
+  }
+
+  enabled_ = true;
+  return true;
+}
+
+void VulkanGpuProfiler::Destroy() {
+  for (FrameQueries& frame : frames_) {
+    if (VK_NULL_HANDLE != frame.pool)
+      vkDestroyQueryPool(device_, frame.pool, nullptr);
+  }
+  frames_.clear();
+  current_ = nullptr;
+  enabled_ = false;
+  device_ = VK_NULL_HANDLE;
+}
+
+void VulkanGpuProfiler::BeginFrame(VkCommandBuffer command_buffer,
+                                   uint32_t frame_index) {
+  if (!enabled_)
+    return;
+  DCHECK(frame_index < frames_.size());
+
+  current_ = &frames_[frame_index];
+  CollectResults(*current_);
+
+  vkCmdResetQueryPool(command_buffer, current_->pool, 0, queries_per_frame_);
+  current_->next_query = 0;
+  current_->scopes.clear();
+}
+
+void VulkanGpuProfiler::ReplayFrame(uint32_t frame_index) {
+  if (!enabled_)
+    return;
+  DCHECK(frame_index < frames_.size());
+
+  // The replayed buffer resets and rewrites the very same queries.
+  CollectResults(frames_[frame_index]);
+  current_ = nullptr;
+}
+
+void VulkanGpuProfiler::Flush() {
+  for (FrameQueries& frame : frames_) {
+    CollectResults(frame);
+    frame.next_query = 0;
+    frame.scopes.clear();
+  }
+}
+
+uint32_t VulkanGpuProfiler::BeginScope(VkCommandBuffer command_buffer,
+                                       const char* name) {
+  if (!enabled_ || !current_ ||
+      current_->next_query + 2 > queries_per_frame_) {
+    return kInvalidScope;
+  }
+
+  auto it = name_ids_.find(name);
+  uint32_t name_id;
+  if (it == name_ids_.end()) {
+    name_id = static_cast<uint32_t>(histories_.size());
+    name_ids_[name] = name_id;
+    histories_.push_back(ScopeHistory());
+    histories_.back().name = name;
+    histories_.back().samples.reserve(kHistorySize);
+  } else {
+    name_id = it->second;
+  }
+
+  PendingScope scope;
+  scope.name_id = name_id;
+  scope.begin_query = current_->next_query++;
+  scope.end_query = current_->next_query++;
+  current_->scopes.push_back(scope);
+
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                      current_->pool, scope.begin_query);
+  return static_cast<uint32_t>(current_->scopes.size() - 1);
+}
+
+void VulkanGpuProfiler::EndScope(VkCommandBuffer command_buffer,
+                                 uint32_t scope) {
+  if (kInvalidScope == scope || !current_)
+    return;
+  DCHECK(scope < current_->scopes.size());
+
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      current_->pool, current_->scopes[scope].end_query);
+}
+
+void VulkanGpuProfiler::CollectResults(FrameQueries& frame) {
+  if (frame.next_query == 0)
+    return;
+
+  // The slot's fence has signaled, so every query is available and this
+  // does not block.
+  VkResult result = vkGetQueryPoolResults(
+      device_, frame.pool, 0, frame.next_query,
+      frame.next_query * sizeof(uint64_t), results_.data(), sizeof(uint64_t),
+      VK_QUERY_RESULT_64_BIT);
+  if (VK_SUCCESS != result) {
+    DLOG(WARNING) << "vkGetQueryPoolResults() failed: " << result;
+    return;
+  }
+
+  for (const PendingScope& scope : frame.scopes) {
+    uint64_t begin = results_[scope.begin_query] & timestamp_mask_;
+    uint64_t end = results_[scope.end_query] & timestamp_mask_;
+    uint64_t ticks = (end - begin) & timestamp_mask_;
+    double ms = ticks * ns_per_tick_ / 1e6;
+
+    ScopeHistory& history = histories_[scope.name_id];
+    if (history.samples.size() < kHistorySize) {
+      history.samples.push_back(ms);
+    } else {
+      history.samples[history.next] = ms;
+    }
+    history.next = (history.next + 1) % kHistorySize;
+    history.last_ms = ms;
+    ++history.total;
+  }
+}
+
+VulkanGpuProfiler::ScopeStats VulkanGpuProfiler::ComputeStats(
+    const ScopeHistory& history) const {
+  ScopeStats stats;
+  stats.name = history.name;
+  stats.samples = history.total;
+  stats.last_ms = history.last_ms;
+  if (history.samples.empty())
+    return stats;
+
+  std::vector<double> sorted(history.samples);
+  std::sort(sorted.begin(), sorted.end());
+
+  double sum = 0.0;
+  for (double sample : sorted)
+    sum += sample;
+
+  stats.min_ms = sorted.front();
+  stats.avg_ms = sum / sorted.size();
+  stats.p99_ms = sorted[(sorted.size() - 1) * 99 / 100];
+  return stats;
+}
+
+std::vector<VulkanGpuProfiler::ScopeStats> VulkanGpuProfiler::GetStats() const {
+  std::vector<ScopeStats> stats;
+  stats.reserve(histories_.size());
+  for (const ScopeHistory& history : histories_)
+    stats.push_back(ComputeStats(history));
+  return stats;
+}
+
+bool VulkanGpuProfiler::GetStats(const std::string& name,
+                                 ScopeStats* stats) const {
+  auto it = name_ids_.find(name);
+  if (it == name_ids_.end())
+    return false;
+  *stats = ComputeStats(histories_[it->second]);
+  return true;
+}
+
+bool VulkanGpuProfiler::WriteCsv(const std::string& path) const {
+  std::ofstream ofs(path.c_str());
+  if (!ofs.is_open()) {
+    LOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+
+  ofs << "scope,samples,last_ms,min_ms,avg_ms,p99_ms\n";
+  for (const ScopeStats& stats : GetStats()) {
+    ofs << stats.name << ',' << stats.samples << ',' << stats.last_ms << ','
+        << stats.min_ms << ',' << stats.avg_ms << ',' << stats.p99_ms << '\n';
+  }
+  return ofs.good();
+}
@@ -0,0 +1,122 @@
+#ifndef VULKAN_GPU_PROFILER_H_
+#define VULKAN_GPU_PROFILER_H_
+
+#include <vulkan/vulkan.h>
+
+#include "VulkanDebugUtils.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Times named command-buffer regions with timestamp queries.
+//
+// Every frame slot owns its own VkQueryPool. Results of a slot are read back
+// in BeginFrame(), which callers invoke only after the slot's fence has
+// signaled, so reading never waits on the GPU.
+class VulkanGpuProfiler
+{
+public:
+  static const uint32_t kInvalidScope = UINT32_MAX;
+  // Number of samples the rolling statistics are computed over.
+  static const size_t kHistorySize = 256;
+
+  struct ScopeStats {
+    std::string name;
+    uint64_t samples = 0;
+    double last_ms = 0.0;
+    double min_ms = 0.0;
+    double avg_ms = 0.0;
+    double p99_ms = 0.0;
+  };
+
+  VulkanGpuProfiler();
+  ~VulkanGpuProfiler();
+
+  // Returns false and leaves the profiler disabled if the queue family has no
+  // timestamp support. All other calls are no-ops while disabled.
+  bool Initialize(VkPhysicalDevice physical_device, VkDevice device,
+                  uint32_t queue_family_index, uint32_t frame_count,
+                  uint32_t max_scopes_per_frame = 64);
+  void Destroy();
+
+  bool enabled() const { return enabled_; }
+
+  // Collects the results |frame_index| produced last time around and resets
+  // its queries. Must be recorded outside of a render pass.
+  void BeginFrame(VkCommandBuffer command_buffer, uint32_t frame_index);
+
+  // Same as BeginFrame() for a command buffer recorded earlier and submitted
+  // again: collects the results and expects the same scopes once more.
+  void ReplayFrame(uint32_t frame_index);
+
+  // Collects every outstanding result. Only valid once the device is idle.
+  void Flush();
+
+  uint32_t BeginScope(VkCommandBuffer command_buffer, const char* name);
+  void EndScope(VkCommandBuffer command_buffer, uint32_t scope);
+
+  std::vector<ScopeStats> GetStats() const;
+  bool GetStats(const std::string& name, ScopeStats* stats) const;
+
+  bool WriteCsv(const std::string& path) const;
+
+private:
+  struct PendingScope {
+    uint32_t name_id;
+    uint32_t begin_query;
+    uint32_t end_query;
+  };
+
+  struct FrameQueries {
+    VkQueryPool pool = VK_NULL_HANDLE;
+    uint32_t next_query = 0;
+    std::vector<PendingScope> scopes;
+  };
+
+  struct ScopeHistory {
+    std::string name;
+    std::vector<double> samples;
+    size_t next = 0;
+    uint64_t total = 0;
+    double last_ms = 0.0;
+  };
+
+  void CollectResults(FrameQueries& frame);
+  ScopeStats ComputeStats(const ScopeHistory& history) const;
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  bool enabled_ = false;
+  double ns_per_tick_ = 1.0;
+  uint64_t timestamp_mask_ = ~0ULL;
+  uint32_t queries_per_frame_ = 0;
+
+  std::vector<FrameQueries> frames_;
+  FrameQueries* current_ = nullptr;
+  std::vector<uint64_t> results_;
+
+  std::unordered_map<std::string, uint32_t> name_ids_;
+  std::vector<ScopeHistory> histories_;
+};
+
+// Times the lifetime of the object as one profiler scope.
+class GpuProfileScope
+{
+public:
+  GpuProfileScope(VulkanGpuProfiler& profiler, VkCommandBuffer command_buffer,
+                  const char* name)
+      : label_(command_buffer, name), profiler_(profiler),
+        command_buffer_(command_buffer),
+        scope_(profiler.BeginScope(command_buffer, name)) {}
+  ~GpuProfileScope() { profiler_.EndScope(command_buffer_, scope_); }
+
+private:
+  // Also shows the scope in debugger captures. Declared first so the label
+  // region encloses the timestamps.
+  VulkanDebugLabel label_;
+  VulkanGpuProfiler& profiler_;
+  VkCommandBuffer command_buffer_;
+  uint32_t scope_;
+};
+
+#endif /* VULKAN_GPU_PROFILER_H_ */
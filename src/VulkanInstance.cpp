@@ -1,5 +1,7 @@
 
 #include "VulkanInstance.h"
+#include "AsyncLogger.h"
+#include "VulkanDebugUtils.h"
 
 #include <vector>
 #include <unordered_set>
@@ -8,6 +10,64 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+namespace {
+
+// Identity of a validation message for rate limiting: the message code plus
+// a FNV-1a hash of the text, which names the objects involved.
+uint64_t ValidationMessageKey(int32_t message_code, const char* message) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char* c = message; *c; ++c) {
+    hash ^= static_cast<unsigned char>(*c);
+    hash *= 1099511628211ull;
+  }
+  return hash ^ static_cast<uint32_t>(message_code);
+}
+
+}  // namespace
+
+#if VULKAN_DEBUG_UTILS_ENABLED
+VkBool32 VulkanDebugUtilsCallback(
+    VkDebugUtilsMessageSeverityFlagBitsEXT      messageSeverity,
+    VkDebugUtilsMessageTypeFlagsEXT             messageTypes,
+    const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
+    void*                                       pUserData) {
+  uint32_t suppressed = 0;
+  if (!AsyncLogger::Get()->Allow(
+          ValidationMessageKey(pCallbackData->messageIdNumber,
+                               pCallbackData->pMessage),
+          &suppressed))
+    return VK_FALSE;
+
+  // Unlike debug_report, the messenger hands us the names we gave the
+  // objects involved; list them so the message reads without a capture.
+  std::ostringstream objects;
+  for (uint32_t i = 0; i < pCallbackData->objectCount; ++i) {
+    const char* name = pCallbackData->pObjects[i].pObjectName;
+    if (name)
+      objects << (objects.tellp() ? ", " : " [") << name;
+  }
+  if (objects.tellp())
+    objects << "]";
+
+  const char* id_name = pCallbackData->pMessageIdName
+      ? pCallbackData->pMessageIdName : "";
+  if (messageSeverity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) {
+    LOG(ERROR) << id_name << " " << pCallbackData->pMessage << objects.str();
+    if (suppressed)
+      LOG(ERROR) << "(" << suppressed << " repeats suppressed)";
+  } else if (messageSeverity &
+             VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) {
+    LOG(WARNING) << id_name << " " << pCallbackData->pMessage
+                 << objects.str();
+    if (suppressed)
+      LOG(WARNING) << "(" << suppressed << " repeats suppressed)";
+  } else {
+    LOG(INFO) << id_name << " " << pCallbackData->pMessage << objects.str();
+  }
+  // Returning VK_TRUE is reserved for layer development.
+  return VK_FALSE;
+}
+#endif
 
 VkBool32 VulkanErrorCallback(
     VkDebugReportFlagsEXT       flags,
@@ -18,7 +78,14 @@ VkBool32 VulkanErrorCallback(
     const char*                 pLayerPrefix,
     const char*                 pMessage,
     void*                       pUserData) {
-  LOG(ERROR) <<pMessage;
+  // Layers repeat the same complaint every frame; keep the first few.
+  uint32_t suppressed = 0;
+  if (!AsyncLogger::Get()->Allow(ValidationMessageKey(messageCode, pMessage),
+                                 &suppressed))
+    return VK_TRUE;
+  LOG(ERROR) << pMessage;
+  if (suppressed)
+    LOG(ERROR) << "(" << suppressed << " repeats suppressed)";
   return VK_TRUE;
 }
 
@@ -31,7 +98,13 @@ VkBool32 VulkanWarningCallback(
     const char*                 pLayerPrefix,
     const char*                 pMessage,
     void*                       pUserData) {
-  LOG(ERROR) <<pMessage;
+  uint32_t suppressed = 0;
+  if (!AsyncLogger::Get()->Allow(ValidationMessageKey(messageCode, pMessage),
+                                 &suppressed))
+    return VK_TRUE;
+  LOG(WARNING) << pMessage;
+  if (suppressed)
+    LOG(WARNING) << "(" << suppressed << " repeats suppressed)";
   return VK_TRUE;
 }
 
@@ -39,13 +112,25 @@ class VulkanInstance {
 public:
   VulkanInstance() {}
   ~VulkanInstance() {
+#if VULKAN_DEBUG_UTILS_ENABLED
+    if (messenger != VK_NULL_HANDLE) {
+      PFN_vkDestroyDebugUtilsMessengerEXT vkDestroyDebugUtilsMessengerEXT =
+          reinterpret_cast<PFN_vkDestroyDebugUtilsMessengerEXT>
+      (vkGetInstanceProcAddr(vk_instance,
+          "vkDestroyDebugUtilsMessengerEXT"));
+      if (vkDestroyDebugUtilsMessengerEXT)
+        vkDestroyDebugUtilsMessengerEXT(vk_instance, messenger, nullptr);
+      messenger = VK_NULL_HANDLE;
+    }
+#endif
     if (vk_instance != VK_NULL_HANDLE) {
       vkDestroyInstance(vk_instance, nullptr);
       vk_instance = VK_NULL_HANDLE;
     }
   }
 
-  void Initialize() {
+  void Initialize(bool headless) {
+    this->headless = headless;
     InitializeExtensions();
     valid = InitializeVulkanInstance();
   }
@@ -53,16 +138,18 @@ public:
   bool InitializeExtensions() {
     VkResult result = VK_SUCCESS;
 
+    if (!headless) {
 #ifdef WD_USE_GLFW
-    uint32_t count = 0;
-    const char** extensions = glfwGetRequiredInstanceExtensions(&count);
-    for (uint32_t i = 0; i < count; ++i) {
-      enabled_ext_names.push_back(extensions[i]);
-    }
+      uint32_t count = 0;
+      const char** extensions = glfwGetRequiredInstanceExtensions(&count);
+      for (uint32_t i = 0; i < count; ++i) {
+        enabled_ext_names.push_back(extensions[i]);
+      }
 #elif defined(VK_USE_PLATFORM_XLIB_KHR)
-    enabled_ext_names.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
-    enabled_ext_names.push_back(VK_KHR_XLIB_SURFACE_EXTENSION_NAME);
+      enabled_ext_names.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+      enabled_ext_names.push_back(VK_KHR_XLIB_SURFACE_EXTENSION_NAME);
 #endif
+    }
 
     uint32_t num_instance_exts = 0;
     result = vkEnumerateInstanceExtensionProperties(nullptr, &num_instance_exts,
@@ -88,6 +175,20 @@ public:
         debug_report_enabled = true;
         enabled_ext_names.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
       }
+      // Needed to query and enable device features added by extensions.
+      if (strcmp(ext_property.extensionName,
+          VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0) {
+        properties2_enabled = true;
+        enabled_ext_names.push_back(
+            VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+      }
+#if VULKAN_DEBUG_UTILS_ENABLED
+      if (strcmp(ext_property.extensionName,
+          VK_EXT_DEBUG_UTILS_EXTENSION_NAME) == 0) {
+        debug_utils_enabled = true;
+        enabled_ext_names.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+      }
+#endif
     }
 
     return true;
@@ -143,9 +244,40 @@ public:
       return false;
     }
 
+#if VULKAN_DEBUG_UTILS_ENABLED
+    if (debug_utils_enabled) {
+      InitializeVulkanDebugUtils(vk_instance);
+
+      PFN_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT =
+          reinterpret_cast<PFN_vkCreateDebugUtilsMessengerEXT>
+      (vkGetInstanceProcAddr(vk_instance,
+          "vkCreateDebugUtilsMessengerEXT"));
+      DCHECK(vkCreateDebugUtilsMessengerEXT);
+
+      VkDebugUtilsMessengerCreateInfoEXT messenger_create_info = {};
+      messenger_create_info.sType =
+          VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+      messenger_create_info.messageSeverity =
+          VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT |
+          VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+      messenger_create_info.messageType =
+          VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+          VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+          VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+      messenger_create_info.pfnUserCallback = &VulkanDebugUtilsCallback;
+      result = vkCreateDebugUtilsMessengerEXT(vk_instance,
+          &messenger_create_info, nullptr, &messenger);
+      if (VK_SUCCESS != result) {
+        DLOG(ERROR) << "vkCreateDebugUtilsMessengerEXT() failed: " << result;
+        return false;
+      }
+    }
+#endif
+
 #if DCHECK_IS_ON()
-    // Register our error logging function.
-    if (debug_report_enabled) {
+    // Register our error logging function, unless the messenger above
+    // already reports the same messages.
+    if (debug_report_enabled && !debug_utils_enabled) {
       PFN_vkCreateDebugReportCallbackEXT vkCreateDebugReportCallbackEXT =
           reinterpret_cast<PFN_vkCreateDebugReportCallbackEXT>
       (vkGetInstanceProcAddr(vk_instance,
@@ -182,9 +314,15 @@ public:
   }
 
   bool valid = false;
+  bool headless = false;
   VkInstance vk_instance = VK_NULL_HANDLE;
   std::vector<const char*> enabled_ext_names;
   bool debug_report_enabled = false;
+  bool debug_utils_enabled = false;
+  bool properties2_enabled = false;
+#if VULKAN_DEBUG_UTILS_ENABLED
+  VkDebugUtilsMessengerEXT messenger = VK_NULL_HANDLE;
+#endif
 #if DCHECK_IS_ON()
   VkDebugReportCallbackEXT error_callback = VK_NULL_HANDLE;
   VkDebugReportCallbackEXT warning_callback = VK_NULL_HANDLE;
@@ -193,10 +331,10 @@ public:
 
 static VulkanInstance* vulkan_instance = nullptr;
 
-bool InitializeVulkan() {
+bool InitializeVulkan(bool headless) {
   DCHECK(!vulkan_instance);
   vulkan_instance = new VulkanInstance;
-  vulkan_instance->Initialize();
+  vulkan_instance->Initialize(headless);
   return vulkan_instance->valid;
 }
 
@@ -210,3 +348,8 @@ VkInstance GetVulkanInstance() {
   DCHECK(vulkan_instance->valid);
   return vulkan_instance->vk_instance;
 }
+
+bool VulkanPhysicalDeviceProperties2Supported() {
+  DCHECK(vulkan_instance);
+  return vulkan_instance->valid && vulkan_instance->properties2_enabled;
+}
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <iostream>
 #include <sstream>
+#include <string>
 
 #define WD_USE_GLFW 1
 
@@ -16,23 +17,39 @@
 #define DCHECK_IS_ON() 1
 #endif
 
+#define LOG_SEVERITY_INFO 0
+#define LOG_SEVERITY_WARNING 1
+#define LOG_SEVERITY_ERROR 2
+#define LOG_SEVERITY_FATAL 3
+
+// Records below this severity compile to nothing; e.g. build with
+// -DMIN_LOG_SEVERITY=LOG_SEVERITY_WARNING to strip LOG(INFO).
+#if !defined(MIN_LOG_SEVERITY)
+#define MIN_LOG_SEVERITY LOG_SEVERITY_INFO
+#endif
+
+#define LOG_IS_ON(severity) (LOG_SEVERITY_##severity >= MIN_LOG_SEVERITY)
+
 class LogMessageVoidify {
 public:
   LogMessageVoidify() { }
   void operator&(std::ostream&) { }
 };
 
+#define LOG_STREAM(severity) \
+  LogMessage(__FILE__, __LINE__, #severity, LOG_SEVERITY_##severity).stream()
+
 #define LOG(severity) \
-  LogMessage(__FILE__, __LINE__, #severity).stream()
+  !LOG_IS_ON(severity) ? (void) 0 : LogMessageVoidify() & LOG_STREAM(severity)
 
 #define EAT_STREAM_PARAMETERS \
-  true ? (void) 0 : LogMessageVoidify() & LOG(FATAL)
+  true ? (void) 0 : LogMessageVoidify() & LOG_STREAM(FATAL)
 
 #if DCHECK_IS_ON()
 #define DCHECK(condition) assert(condition)
 #define DCHECK_NE(val1, val2) assert(val1 != val2)
 #define DCHECK_EQ(val1, val2) assert(val1 == val2)
-#define DLOG(severity) LogMessage(__FILE__, __LINE__, #severity).stream()
+#define DLOG(severity) LOG(severity)
 #else
 #define DCHECK_NE(val1, val2)
 #define DCHECK_EQ(val1, val2)
@@ -40,26 +57,37 @@ public:
 #define DLOG(severity) EAT_STREAM_PARAMETERS
 #endif
 
+// Hands a finished record to the asynchronous writer (see AsyncLogger).
+void WriteLogMessage(int severity, const std::string& message);
+
 class LogMessage {
 public:
-  LogMessage(const char* file, int line, const char* severity) {
+  LogMessage(const char* file, int line, const char* severity,
+             int severity_level)
+      : severity_level_(severity_level) {
     stream_ << '[' << severity << "][" << file << "(" << line << ")] ";
   }
   ~LogMessage() {
-    std::cout << stream_.str() << std::endl;
+    WriteLogMessage(severity_level_, stream_.str());
   }
   std::ostream& stream() { return stream_; }
 
 private:
+  int severity_level_;
   std::ostringstream stream_;
 };
 
 template <typename T, size_t N> char (&ArraySizeHelper(T (&array)[N]))[N];
 #define arraysize(array) (sizeof(ArraySizeHelper(array)))
 
-bool InitializeVulkan();
+// |headless| skips the window-system instance extensions so Vulkan can be
+// brought up on machines without a display server.
+bool InitializeVulkan(bool headless = false);
 bool VulkanSupported();
 
 VkInstance GetVulkanInstance();
+// Whether VK_KHR_get_physical_device_properties2 is enabled, without which
+// extension features such as descriptor indexing cannot be turned on.
+bool VulkanPhysicalDeviceProperties2Supported();
 
 #endif /* VULKAN_INSTANCE_H_ */
@@ -0,0 +1,505 @@
+
+#include "VulkanMemoryAllocator.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+
+namespace {
+
+VkDeviceSize RoundUpToPowerOfTwo(VkDeviceSize value) {
+  VkDeviceSize result = 1;
+  while (result < value)
+    result <<= 1;
+  return result;
+}
+
+VkDeviceSize RoundDownToPowerOfTwo(VkDeviceSize value) {
+  VkDeviceSize result = 1;
+  while ((result << 1) <= value)
+    result <<= 1;
+  return result;
+}
+
+uint32_t Log2(VkDeviceSize value) {
+  uint32_t log = 0;
+  while (value > 1) {
+    value >>= 1;
+    ++log;
+  }
+  return log;
+}
+
+void UsageToMemoryFlags(VulkanMemoryAllocator::Usage usage,
+                        VkMemoryPropertyFlags* required,
+                        VkMemoryPropertyFlags* preferred) {
+  switch (usage) {
+    case VulkanMemoryAllocator::kGpuOnly:
+      *required = 0;
+      *preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+      break;
+    case VulkanMemoryAllocator::kCpuToGpu:
+      *required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+      *preferred = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+      break;
+    case VulkanMemoryAllocator::kGpuToCpu:
+      *required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+      *preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+      break;
+    case VulkanMemoryAllocator::kGpuLazilyAllocated:
+      *required = 0;
+      *preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                   VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+      break;
+  }
+}
+
+}  // namespace
+
+
+const VkDeviceSize VulkanMemoryAllocator::kDefaultBlockSize;
+const VkDeviceSize VulkanMemoryAllocator::kMinChunk;
+
+VulkanMemoryAllocator::VulkanMemoryAllocator() {}
+
+VulkanMemoryAllocator::~VulkanMemoryAllocator() {
+  DCHECK_EQ(static_cast<VkDevice>(VK_NULL_HANDLE), device_);
+}
+
+bool VulkanMemoryAllocator::Initialize(VkPhysicalDevice physical_device,
+                                       VkDevice device,
+                                       VkDeviceSize block_size) {
+  device_ = device;
+  block_size_ = RoundUpToPowerOfTwo(std::max(block_size, kMinChunk));
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties_);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  non_coherent_atom_size_ =
+      std::max<VkDeviceSize>(1, properties.limits.nonCoherentAtomSize);
+  return true;
+}
+
+void VulkanMemoryAllocator::Destroy() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (uint32_t type = 0; type < VK_MAX_MEMORY_TYPES; ++type) {
+    for (uint32_t kind = 0; kind < 2; ++kind) {
+      for (std::unique_ptr<Block>& block : pools_[type][kind]) {
+        if (block->allocation_count) {
+          DLOG(WARNING) << block->allocation_count
+                        << " allocations leaked in memory type " << type;
+        }
+        DestroyBlockLocked(block.get());
+      }
+      pools_[type][kind].clear();
+    }
+  }
+  for (std::unique_ptr<Block>& block : dedicated_)
+    DestroyBlockLocked(block.get());
+  dedicated_.clear();
+  device_ = VK_NULL_HANDLE;
+}
+
+int32_t VulkanMemoryAllocator::FindMemoryType(
+    uint32_t type_bits, VkMemoryPropertyFlags required,
+    VkMemoryPropertyFlags preferred) const {
+  VkMemoryPropertyFlags wanted = required | preferred;
+  for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; ++i) {
+    if ((type_bits & (1u << i)) &&
+        (memory_properties_.memoryTypes[i].propertyFlags & wanted) == wanted)
+      return static_cast<int32_t>(i);
+  }
+  for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; ++i) {
+    if ((type_bits & (1u << i)) &&
+        (memory_properties_.memoryTypes[i].propertyFlags & required) ==
+            required)
+      return static_cast<int32_t>(i);
+  }
+  return -1;
+}
+
+VkDeviceSize VulkanMemoryAllocator::BlockSizeForType(
+    uint32_t memory_type) const {
+  // Small heaps (e.g. a 256MB host-visible BAR window) must not be eaten by
+  // a handful of blocks.
+  uint32_t heap = memory_properties_.memoryTypes[memory_type].heapIndex;
+  VkDeviceSize heap_size = memory_properties_.memoryHeaps[heap].size;
+  VkDeviceSize limit = RoundDownToPowerOfTwo(std::max(heap_size / 8,
+                                                      kMinChunk));
+  return std::min(block_size_, limit);
+}
+
+bool VulkanMemoryAllocator::Allocate(const VkMemoryRequirements& requirements,
+                                     Usage usage, ResourceKind kind,
+                                     VulkanAllocation* allocation) {
+  VkMemoryPropertyFlags required = 0;
+  VkMemoryPropertyFlags preferred = 0;
+  UsageToMemoryFlags(usage, &required, &preferred);
+
+  int32_t memory_type =
+      FindMemoryType(requirements.memoryTypeBits, required, preferred);
+  if (memory_type < 0) {
+    DLOG(ERROR) << "No memory type for usage " << usage;
+    return false;
+  }
+
+  const bool lazy =
+      (memory_properties_.memoryTypes[memory_type].propertyFlags &
+       VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0;
+  const VkDeviceSize block_size = BlockSizeForType(memory_type);
+  // A buddy chunk of size 2^n is aligned to 2^n, which satisfies any
+  // alignment up to that size.
+  const VkDeviceSize chunk = RoundUpToPowerOfTwo(
+      std::max(std::max(requirements.size, requirements.alignment),
+               kMinChunk));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (lazy || chunk > block_size / 2) {
+    Block* block = CreateBlockLocked(memory_type, kind, requirements.size,
+                                     false);
+    if (!block)
+      return false;
+    block->allocation_count = 1;
+    block->used = requirements.size;
+
+    allocation->memory = block->memory;
+    allocation->offset = 0;
+    allocation->size = requirements.size;
+    allocation->mapped = block->mapped;
+    allocation->memory_type = memory_type;
+    allocation->block_ = block;
+    allocation->level_ = 0;
+    return true;
+  }
+
+  const uint32_t level = Log2(chunk / kMinChunk);
+  std::vector<std::unique_ptr<Block>>& pool = pools_[memory_type][kind];
+
+  Block* block = nullptr;
+  VkDeviceSize offset = 0;
+  for (std::unique_ptr<Block>& candidate : pool) {
+    if (AllocateFromBlock(candidate.get(), level, &offset)) {
+      block = candidate.get();
+      break;
+    }
+  }
+  if (!block) {
+    block = CreateBlockLocked(memory_type, kind, block_size, true);
+    if (!block || !AllocateFromBlock(block, level, &offset))
+      return false;
+  }
+
+  ++block->allocation_count;
+  block->used += chunk;
+
+  allocation->memory = block->memory;
+  allocation->offset = offset;
+  allocation->size = requirements.size;
+  allocation->mapped =
+      block->mapped ? static_cast<char*>(block->mapped) + offset : nullptr;
+  allocation->memory_type = memory_type;
+  allocation->block_ = block;
+  allocation->level_ = level;
+  return true;
+}
+
+void VulkanMemoryAllocator::Free(VulkanAllocation* allocation) {
+  if (!allocation->block_)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Block* block = static_cast<Block*>(allocation->block_);
+
+  if (block->level_count == 0) {
+    for (auto it = dedicated_.begin(); it != dedicated_.end(); ++it) {
+      if (it->get() == block) {
+        DestroyBlockLocked(block);
+        dedicated_.erase(it);
+        break;
+      }
+    }
+  } else {
+    FreeToBlock(block, allocation->level_, allocation->offset);
+    --block->allocation_count;
+    block->used -= kMinChunk << allocation->level_;
+
+    // Give empty blocks back to the driver, but keep one per pool around so
+    // alloc/free churn does not hit vkAllocateMemory every time.
+    std::vector<std::unique_ptr<Block>>& pool =
+        pools_[block->memory_type][block->kind];
+    if (block->allocation_count == 0 && pool.size() > 1) {
+      for (auto it = pool.begin(); it != pool.end(); ++it) {
+        if (it->get() == block) {
+          DestroyBlockLocked(block);
+          pool.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  *allocation = VulkanAllocation();
+}
+
+bool VulkanMemoryAllocator::CreateBuffer(const VkBufferCreateInfo& create_info,
+                                         Usage usage, VkBuffer* buffer,
+                                         VulkanAllocation* allocation) {
+  VkResult result = vkCreateBuffer(device_, &create_info, nullptr, buffer);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateBuffer() failed: " << result;
+    return false;
+  }
+
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(device_, *buffer, &requirements);
+  if (!Allocate(requirements, usage, kLinearResource, allocation)) {
+    vkDestroyBuffer(device_, *buffer, nullptr);
+    *buffer = VK_NULL_HANDLE;
+    return false;
+  }
+
+  vkBindBufferMemory(device_, *buffer, allocation->memory, allocation->offset);
+  return true;
+}
+
+bool VulkanMemoryAllocator::CreateImage(const VkImageCreateInfo& create_info,
+                                        Usage usage, VkImage* image,
+                                        VulkanAllocation* allocation) {
+  VkResult result = vkCreateImage(device_, &create_info, nullptr, image);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateImage() failed: " << result;
+    return false;
+  }
+
+  VkMemoryRequirements requirements;
+  vkGetImageMemoryRequirements(device_, *image, &requirements);
+  ResourceKind kind = create_info.tiling == VK_IMAGE_TILING_OPTIMAL
+                          ? kOptimalImage
+                          : kLinearResource;
+  if (!Allocate(requirements, usage, kind, allocation)) {
+    vkDestroyImage(device_, *image, nullptr);
+    *image = VK_NULL_HANDLE;
+    return false;
+  }
+
+  vkBindImageMemory(device_, *image, allocation->memory, allocation->offset);
+  return true;
+}
+
+void VulkanMemoryAllocator::DestroyBuffer(VkBuffer buffer,
+                                          VulkanAllocation* allocation) {
+  if (VK_NULL_HANDLE != buffer)
+    vkDestroyBuffer(device_, buffer, nullptr);
+  Free(allocation);
+}
+
+void VulkanMemoryAllocator::DestroyImage(VkImage image,
+                                         VulkanAllocation* allocation) {
+  if (VK_NULL_HANDLE != image)
+    vkDestroyImage(device_, image, nullptr);
+  Free(allocation);
+}
+
+bool VulkanMemoryAllocator::IsHostCoherent(uint32_t memory_type) const {
+  return (memory_properties_.memoryTypes[memory_type].propertyFlags &
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+}
+
+void VulkanMemoryAllocator::Flush(const VulkanAllocation& allocation,
+                                  VkDeviceSize offset, VkDeviceSize size) {
+  if (!allocation.mapped || IsHostCoherent(allocation.memory_type) ||
+      size == 0) {
+    return;
+  }
+
+  // Flushed ranges must be multiples of nonCoherentAtomSize.
+  VkDeviceSize begin = allocation.offset + offset;
+  VkDeviceSize end = begin + size;
+  begin -= begin % non_coherent_atom_size_;
+  end = (end + non_coherent_atom_size_ - 1) / non_coherent_atom_size_ *
+        non_coherent_atom_size_;
+  const Block* block = static_cast<const Block*>(allocation.block_);
+  end = std::min(end, block->size);
+
+  VkMappedMemoryRange range = {};
+  range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+  range.memory = allocation.memory;
+  range.offset = begin;
+  range.size = end - begin;
+  vkFlushMappedMemoryRanges(device_, 1, &range);
+}
+
+VulkanMemoryAllocator::Stats VulkanMemoryAllocator::GetStats(
+    uint32_t memory_type) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  for (uint32_t kind = 0; kind < 2; ++kind) {
+    for (const std::unique_ptr<Block>& block : pools_[memory_type][kind]) {
+      ++stats.block_count;
+      stats.allocation_count += block->allocation_count;
+      stats.reserved_bytes += block->size;
+      stats.used_bytes += block->used;
+    }
+  }
+  for (const std::unique_ptr<Block>& block : dedicated_) {
+    if (block->memory_type != memory_type)
+      continue;
+    ++stats.dedicated_count;
+    ++stats.allocation_count;
+    stats.reserved_bytes += block->size;
+    stats.used_bytes += block->used;
+  }
+  return stats;
+}
+
+VulkanMemoryAllocator::Stats VulkanMemoryAllocator::GetStats() const {
+  Stats total;
+  for (uint32_t type = 0; type < memory_properties_.memoryTypeCount; ++type) {
+    Stats stats = GetStats(type);
+    total.block_count += stats.block_count;
+    total.dedicated_count += stats.dedicated_count;
+    total.allocation_count += stats.allocation_count;
+    total.reserved_bytes += stats.reserved_bytes;
+    total.used_bytes += stats.used_bytes;
+  }
+  return total;
+}
+
+VulkanMemoryAllocator::Block* VulkanMemoryAllocator::CreateBlockLocked(
+    uint32_t memory_type, uint32_t kind, VkDeviceSize size, bool buddy) {
+  VkMemoryAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.allocationSize = size;
+  alloc_info.memoryTypeIndex = memory_type;
+
+  std::unique_ptr<Block> block(new Block);
+  VkResult result =
+      vkAllocateMemory(device_, &alloc_info, nullptr, &block->memory);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkAllocateMemory(" << size << ") failed: " << result;
+    return nullptr;
+  }
+
+  block->size = size;
+  block->memory_type = memory_type;
+  block->kind = kind;
+
+  if (memory_properties_.memoryTypes[memory_type].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    vkMapMemory(device_, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+  }
+
+  Block* raw = block.get();
+  if (buddy) {
+    block->level_count = Log2(size / kMinChunk) + 1;
+    block->free_lists.resize(block->level_count);
+    block->free_lists[block->level_count - 1].insert(0);
+    pools_[memory_type][kind].push_back(std::move(block));
+  } else {
+    dedicated_.push_back(std::move(block));
+  }
+  return raw;
+}
+
+void VulkanMemoryAllocator::DestroyBlockLocked(Block* block) {
+  if (block->mapped)
+    vkUnmapMemory(device_, block->memory);
+  vkFreeMemory(device_, block->memory, nullptr);
+  block->memory = VK_NULL_HANDLE;
+  block->mapped = nullptr;
+}
+
+bool VulkanMemoryAllocator::AllocateFromBlock(Block* block, uint32_t level,
+                                              VkDeviceSize* offset) {
+  if (level >= block->level_count)
+    return false;
+
+  uint32_t found = level;
+  while (found < block->level_count && block->free_lists[found].empty())
+    ++found;
+  if (found == block->level_count)
+    return false;
+
+  VkDeviceSize chunk_offset = *block->free_lists[found].begin();
+  block->free_lists[found].erase(block->free_lists[found].begin());
+
+  // Split down to the requested size, keeping the upper halves free.
+  while (found > level) {
+    --found;
+    block->free_lists[found].insert(chunk_offset + (kMinChunk << found));
+  }
+
+  *offset = chunk_offset;
+  return true;
+}
+
+void VulkanMemoryAllocator::FreeToBlock(Block* block, uint32_t level,
+                                        VkDeviceSize offset) {
+  // Merge with the buddy for as long as it is free as well.
+  while (level + 1 < block->level_count) {
+    VkDeviceSize buddy = offset ^ (kMinChunk << level);
+    std::set<VkDeviceSize>& free_list = block->free_lists[level];
+    auto it = free_list.find(buddy);
+    if (it == free_list.end())
+      break;
+    free_list.erase(it);
+    offset = std::min(offset, buddy);
+    ++level;
+  }
+  block->free_lists[level].insert(offset);
+}
+
+
+VulkanLinearArena::VulkanLinearArena() {}
+
+VulkanLinearArena::~VulkanLinearArena() {
+  DCHECK_EQ(static_cast<VkBuffer>(VK_NULL_HANDLE), buffer_);
+}
+
+bool VulkanLinearArena::Initialize(VulkanMemoryAllocator* allocator,
+                                   VkDeviceSize size,
+                                   VkBufferUsageFlags usage) {
+  allocator_ = allocator;
+  head_ = 0;
+
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = size;
+  buffer_info.usage = usage;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!allocator_->CreateBuffer(buffer_info, VulkanMemoryAllocator::kCpuToGpu,
+                                &buffer_, &allocation_)) {
+    return false;
+  }
+  DCHECK(allocation_.mapped);
+  return true;
+}
+
+void VulkanLinearArena::Destroy() {
+  if (allocator_)
+    allocator_->DestroyBuffer(buffer_, &allocation_);
+  buffer_ = VK_NULL_HANDLE;
+  allocator_ = nullptr;
+  head_ = 0;
+}
+
+bool VulkanLinearArena::Allocate(VkDeviceSize size, VkDeviceSize alignment,
+                                 VkDeviceSize* offset, void** mapped) {
+  if (alignment == 0)
+    alignment = 1;
+  VkDeviceSize begin = (head_ + alignment - 1) / alignment * alignment;
+  if (begin + size > allocation_.size)
+    return false;
+
+  head_ = begin + size;
+  *offset = begin;
+  if (mapped)
+    *mapped = static_cast<char*>(allocation_.mapped) + begin;
+  return true;
+}
+
+void VulkanLinearArena::Flush() {
+  if (allocator_)
+    allocator_->Flush(allocation_, 0, head_);
+}
@@ -0,0 +1,172 @@
+#ifndef VULKAN_MEMORY_ALLOCATOR_H_
+#define VULKAN_MEMORY_ALLOCATOR_H_
+
+#include <vulkan/vulkan.h>
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+class VulkanMemoryAllocator;
+
+// A range of VkDeviceMemory handed out by VulkanMemoryAllocator.
+struct VulkanAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  // Host pointer to |offset| for host-visible memory, else nullptr.
+  void* mapped = nullptr;
+  uint32_t memory_type = 0;
+
+private:
+  friend class VulkanMemoryAllocator;
+  void* block_ = nullptr;
+  uint32_t level_ = 0;
+};
+
+// Sub-allocates buffers and images out of large VkDeviceMemory blocks so a
+// resource does not cost a driver allocation (and a slot of
+// maxMemoryAllocationCount) of its own.
+//
+// Every memory type has two pools of power-of-two blocks managed by a buddy
+// allocator: one for linear resources (buffers, linear images) and one for
+// optimally tiled images. Keeping them apart means bufferImageGranularity
+// can never be violated. Requests larger than half a block get a dedicated
+// allocation. Host-visible blocks stay persistently mapped.
+class VulkanMemoryAllocator
+{
+public:
+  enum Usage {
+    // Device-local, never touched by the CPU.
+    kGpuOnly,
+    // Host-visible (preferably coherent), written by the CPU every frame or
+    // used as a staging source.
+    kCpuToGpu,
+    // Host-visible (preferably cached), read back by the CPU.
+    kGpuToCpu,
+    // Lazily allocated when the device offers it, for transient attachments
+    // that may never be backed by real memory on tiled GPUs.
+    kGpuLazilyAllocated,
+  };
+
+  enum ResourceKind {
+    kLinearResource,
+    kOptimalImage,
+  };
+
+  struct Stats {
+    uint32_t block_count = 0;
+    uint32_t dedicated_count = 0;
+    uint32_t allocation_count = 0;
+    // Bytes obtained from the driver.
+    VkDeviceSize reserved_bytes = 0;
+    // Bytes handed out to resources, including buddy rounding.
+    VkDeviceSize used_bytes = 0;
+  };
+
+  static const VkDeviceSize kDefaultBlockSize = 64ull * 1024 * 1024;
+
+  VulkanMemoryAllocator();
+  ~VulkanMemoryAllocator();
+
+  bool Initialize(VkPhysicalDevice physical_device, VkDevice device,
+                  VkDeviceSize block_size = kDefaultBlockSize);
+  void Destroy();
+
+  // Returns -1 when no memory type in |type_bits| has |required|.
+  int32_t FindMemoryType(uint32_t type_bits, VkMemoryPropertyFlags required,
+                         VkMemoryPropertyFlags preferred) const;
+
+  bool Allocate(const VkMemoryRequirements& requirements, Usage usage,
+                ResourceKind kind, VulkanAllocation* allocation);
+  void Free(VulkanAllocation* allocation);
+
+  // Creates the resource and binds freshly allocated memory to it.
+  bool CreateBuffer(const VkBufferCreateInfo& create_info, Usage usage,
+                    VkBuffer* buffer, VulkanAllocation* allocation);
+  bool CreateImage(const VkImageCreateInfo& create_info, Usage usage,
+                   VkImage* image, VulkanAllocation* allocation);
+  void DestroyBuffer(VkBuffer buffer, VulkanAllocation* allocation);
+  void DestroyImage(VkImage image, VulkanAllocation* allocation);
+
+  // Makes CPU writes visible to the device; a no-op on coherent memory.
+  void Flush(const VulkanAllocation& allocation, VkDeviceSize offset,
+             VkDeviceSize size);
+
+  bool IsHostCoherent(uint32_t memory_type) const;
+
+  Stats GetStats() const;
+  Stats GetStats(uint32_t memory_type) const;
+
+  const VkPhysicalDeviceMemoryProperties& memory_properties() const {
+    return memory_properties_;
+  }
+
+private:
+  struct Block {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr;
+    uint32_t memory_type = 0;
+    uint32_t kind = 0;
+    // 0 for dedicated allocations, else the number of buddy levels.
+    uint32_t level_count = 0;
+    // free_lists[level] holds offsets of free chunks of kMinChunk << level.
+    std::vector<std::set<VkDeviceSize>> free_lists;
+    uint32_t allocation_count = 0;
+    VkDeviceSize used = 0;
+  };
+
+  static const VkDeviceSize kMinChunk = 256;
+
+  Block* CreateBlockLocked(uint32_t memory_type, uint32_t kind,
+                           VkDeviceSize size, bool buddy);
+  void DestroyBlockLocked(Block* block);
+  bool AllocateFromBlock(Block* block, uint32_t level, VkDeviceSize* offset);
+  void FreeToBlock(Block* block, uint32_t level, VkDeviceSize offset);
+  VkDeviceSize BlockSizeForType(uint32_t memory_type) const;
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memory_properties_;
+  VkDeviceSize block_size_ = kDefaultBlockSize;
+  VkDeviceSize non_coherent_atom_size_ = 1;
+
+  mutable std::mutex mutex_;
+  // Buddy blocks per memory type and ResourceKind.
+  std::vector<std::unique_ptr<Block>> pools_[VK_MAX_MEMORY_TYPES][2];
+  std::vector<std::unique_ptr<Block>> dedicated_;
+};
+
+// Bump allocator over one persistently mapped buffer, for data that lives
+// for a single frame. Reset() releases everything at once; callers reset a
+// frame slot's arena only after that slot's fence has signaled.
+class VulkanLinearArena
+{
+public:
+  VulkanLinearArena();
+  ~VulkanLinearArena();
+
+  bool Initialize(VulkanMemoryAllocator* allocator, VkDeviceSize size,
+                  VkBufferUsageFlags usage);
+  void Destroy();
+
+  // Returns false when the arena is full.
+  bool Allocate(VkDeviceSize size, VkDeviceSize alignment,
+                VkDeviceSize* offset, void** mapped);
+  // Flushes everything written since the last Reset().
+  void Flush();
+  void Reset() { head_ = 0; }
+
+  VkBuffer buffer() const { return buffer_; }
+  VkDeviceSize capacity() const { return allocation_.size; }
+  VkDeviceSize used() const { return head_; }
+
+private:
+  VulkanMemoryAllocator* allocator_ = nullptr;
+  VkBuffer buffer_ = VK_NULL_HANDLE;
+  VulkanAllocation allocation_;
+  VkDeviceSize head_ = 0;
+};
+
+#endif /* VULKAN_MEMORY_ALLOCATOR_H_ */
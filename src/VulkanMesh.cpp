@@ -0,0 +1,170 @@
+
+#include "VulkanMesh.h"
+#include "VulkanInstance.h"
+#include "VulkanPipelineBuilder.h"
+#include "VulkanUploader.h"
+
+#include <algorithm>
+
+namespace {
+
+uint32_t IndexSize(VkIndexType index_type) {
+  return index_type == VK_INDEX_TYPE_UINT32 ? 4 : 2;
+}
+
+}  // namespace
+
+
+VertexLayout& VertexLayout::AddBinding(uint32_t binding, uint32_t stride,
+                                       VkVertexInputRate input_rate) {
+  VkVertexInputBindingDescription description = {};
+  description.binding = binding;
+  description.stride = stride;
+  description.inputRate = input_rate;
+  bindings.push_back(description);
+  return *this;
+}
+
+VertexLayout& VertexLayout::AddAttribute(uint32_t location, uint32_t binding,
+                                         VkFormat format, uint32_t offset) {
+  VkVertexInputAttributeDescription description = {};
+  description.location = location;
+  description.binding = binding;
+  description.format = format;
+  description.offset = offset;
+  attributes.push_back(description);
+  return *this;
+}
+
+uint32_t VertexLayout::GetStride(uint32_t binding) const {
+  for (const VkVertexInputBindingDescription& description : bindings) {
+    if (description.binding == binding)
+      return description.stride;
+  }
+  return 0;
+}
+
+void VertexLayout::ApplyTo(GraphicsPipelineDesc* desc) const {
+  desc->vertex_bindings = bindings;
+  desc->vertex_attributes = attributes;
+}
+
+
+VulkanMesh::VulkanMesh() {}
+
+VulkanMesh::~VulkanMesh() {
+  DCHECK_EQ(static_cast<VkBuffer>(VK_NULL_HANDLE), vertex_buffer_);
+}
+
+bool VulkanMesh::Initialize(VulkanMemoryAllocator* allocator,
+                            VulkanUploader* uploader, uint32_t vertex_stride,
+                            const void* vertices, uint32_t vertex_count,
+                            const void* indices, uint32_t index_count,
+                            VkIndexType index_type, uint32_t vertex_capacity,
+                            uint32_t index_capacity) {
+  allocator_ = allocator;
+  uploader_ = uploader;
+  vertex_stride_ = vertex_stride;
+  vertex_capacity_ = std::max(vertex_capacity, vertex_count);
+  index_capacity_ = std::max(index_capacity, index_count);
+  index_type_ = index_type;
+
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = static_cast<VkDeviceSize>(vertex_capacity_) * vertex_stride;
+  buffer_info.usage =
+      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (!allocator_->CreateBuffer(buffer_info, VulkanMemoryAllocator::kGpuOnly,
+                                &vertex_buffer_, &vertex_memory_)) {
+    return false;
+  }
+
+  if (index_capacity_ > 0) {
+    buffer_info.size =
+        static_cast<VkDeviceSize>(index_capacity_) * IndexSize(index_type_);
+    buffer_info.usage =
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (!allocator_->CreateBuffer(buffer_info,
+                                  VulkanMemoryAllocator::kGpuOnly,
+                                  &index_buffer_, &index_memory_)) {
+      Destroy();
+      return false;
+    }
+  }
+
+  // The buffers are brand new, so the initial data may take the transfer
+  // queue.
+  if (vertices &&
+      !uploader_->Upload(vertex_buffer_, 0, vertices,
+                         static_cast<VkDeviceSize>(vertex_count) *
+                             vertex_stride_,
+                         true)) {
+    Destroy();
+    return false;
+  }
+  if (indices &&
+      !uploader_->Upload(index_buffer_, 0, indices,
+                         static_cast<VkDeviceSize>(index_count) *
+                             IndexSize(index_type_),
+                         true)) {
+    Destroy();
+    return false;
+  }
+  vertex_count_ = vertex_count;
+  index_count_ = index_count;
+  return true;
+}
+
+void VulkanMesh::Destroy() {
+  if (allocator_) {
+    allocator_->DestroyBuffer(index_buffer_, &index_memory_);
+    allocator_->DestroyBuffer(vertex_buffer_, &vertex_memory_);
+  }
+  index_buffer_ = VK_NULL_HANDLE;
+  vertex_buffer_ = VK_NULL_HANDLE;
+  vertex_count_ = index_count_ = 0;
+  vertex_capacity_ = index_capacity_ = 0;
+  allocator_ = nullptr;
+  uploader_ = nullptr;
+}
+
+bool VulkanMesh::UpdateVertices(uint32_t first_vertex, const void* vertices,
+                                uint32_t vertex_count) {
+  if (first_vertex + vertex_count > vertex_capacity_) {
+    DLOG(ERROR) << "Vertex update exceeds the mesh capacity";
+    return false;
+  }
+  vertex_count_ = std::max(vertex_count_, first_vertex + vertex_count);
+  return uploader_->Upload(
+      vertex_buffer_, static_cast<VkDeviceSize>(first_vertex) * vertex_stride_,
+      vertices, static_cast<VkDeviceSize>(vertex_count) * vertex_stride_);
+}
+
+bool VulkanMesh::UpdateIndices(uint32_t first_index, const void* indices,
+                               uint32_t index_count) {
+  if (first_index + index_count > index_capacity_) {
+    DLOG(ERROR) << "Index update exceeds the mesh capacity";
+    return false;
+  }
+  const uint32_t index_size = IndexSize(index_type_);
+  index_count_ = std::max(index_count_, first_index + index_count);
+  return uploader_->Upload(
+      index_buffer_, static_cast<VkDeviceSize>(first_index) * index_size,
+      indices, static_cast<VkDeviceSize>(index_count) * index_size);
+}
+
+void VulkanMesh::Bind(VkCommandBuffer command_buffer) const {
+  VkDeviceSize offset = 0;
+  vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer_, &offset);
+  if (VK_NULL_HANDLE != index_buffer_)
+    vkCmdBindIndexBuffer(command_buffer, index_buffer_, 0, index_type_);
+}
+
+void VulkanMesh::Draw(VkCommandBuffer command_buffer,
+                      uint32_t instance_count) const {
+  if (VK_NULL_HANDLE != index_buffer_)
+    vkCmdDrawIndexed(command_buffer, index_count_, instance_count, 0, 0, 0);
+  else
+    vkCmdDraw(command_buffer, vertex_count_, instance_count, 0, 0);
+}
@@ -0,0 +1,82 @@
+#ifndef VULKAN_MESH_H_
+#define VULKAN_MESH_H_
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+#include "VulkanMemoryAllocator.h"
+
+struct GraphicsPipelineDesc;
+class VulkanUploader;
+
+// Vertex buffer bindings and attributes of a mesh format; drives the vertex
+// input state of the pipelines drawing it.
+struct VertexLayout {
+  std::vector<VkVertexInputBindingDescription> bindings;
+  std::vector<VkVertexInputAttributeDescription> attributes;
+
+  VertexLayout& AddBinding(
+      uint32_t binding, uint32_t stride,
+      VkVertexInputRate input_rate = VK_VERTEX_INPUT_RATE_VERTEX);
+  VertexLayout& AddAttribute(uint32_t location, uint32_t binding,
+                             VkFormat format, uint32_t offset);
+
+  // Stride of |binding|, or 0 if it is not part of the layout.
+  uint32_t GetStride(uint32_t binding) const;
+
+  void ApplyTo(GraphicsPipelineDesc* desc) const;
+};
+
+// Device-local vertex and (optional) index buffer of one mesh, filled
+// through a VulkanUploader.
+class VulkanMesh
+{
+public:
+  VulkanMesh();
+  ~VulkanMesh();
+
+  // |vertex_capacity| / |index_capacity| may exceed the initial data so the
+  // mesh can be streamed into with Update*(). |indices| may be null.
+  bool Initialize(VulkanMemoryAllocator* allocator, VulkanUploader* uploader,
+                  uint32_t vertex_stride, const void* vertices,
+                  uint32_t vertex_count, const void* indices = nullptr,
+                  uint32_t index_count = 0,
+                  VkIndexType index_type = VK_INDEX_TYPE_UINT16,
+                  uint32_t vertex_capacity = 0, uint32_t index_capacity = 0);
+  // The caller guarantees the GPU no longer reads the buffers.
+  void Destroy();
+
+  // Queue uploads; they reach the GPU with the uploader's next Submit().
+  bool UpdateVertices(uint32_t first_vertex, const void* vertices,
+                      uint32_t vertex_count);
+  bool UpdateIndices(uint32_t first_index, const void* indices,
+                     uint32_t index_count);
+
+  void Bind(VkCommandBuffer command_buffer) const;
+  void Draw(VkCommandBuffer command_buffer, uint32_t instance_count = 1) const;
+
+  VkBuffer vertex_buffer() const { return vertex_buffer_; }
+  VkBuffer index_buffer() const { return index_buffer_; }
+  uint32_t vertex_count() const { return vertex_count_; }
+  uint32_t index_count() const { return index_count_; }
+  VkIndexType index_type() const { return index_type_; }
+
+private:
+  VulkanMemoryAllocator* allocator_ = nullptr;
+  VulkanUploader* uploader_ = nullptr;
+
+  VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
+  VulkanAllocation vertex_memory_;
+  VkBuffer index_buffer_ = VK_NULL_HANDLE;
+  VulkanAllocation index_memory_;
+
+  uint32_t vertex_stride_ = 0;
+  uint32_t vertex_count_ = 0;
+  uint32_t vertex_capacity_ = 0;
+  uint32_t index_count_ = 0;
+  uint32_t index_capacity_ = 0;
+  VkIndexType index_type_ = VK_INDEX_TYPE_UINT16;
+};
+
+#endif /* VULKAN_MESH_H_ */
@@ -0,0 +1,186 @@
+
+#include "VulkanParallelRecorder.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+
+
+VulkanParallelRecorder::VulkanParallelRecorder() : next_task_(0) {}
+
+VulkanParallelRecorder::~VulkanParallelRecorder() {
+  DCHECK(workers_.empty());
+}
+
+bool VulkanParallelRecorder::Initialize(VkDevice device,
+                                        uint32_t queue_family_index,
+                                        uint32_t frame_count,
+                                        uint32_t worker_count) {
+  DCHECK(workers_.empty());
+  device_ = device;
+
+  if (worker_count == 0) {
+    unsigned int hardware_threads = std::thread::hardware_concurrency();
+    worker_count = hardware_threads > 1 ? hardware_threads - 1 : 0;
+  }
+
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = queue_family_index;
+
+  pools_.resize(frame_count * (worker_count + 1));
+  for (ThreadPool& pool : pools_) {
+    VkResult result =
+        vkCreateCommandPool(device_, &pool_info, nullptr, &pool.pool);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << "vkCreateCommandPool() failed: " << result;
+      Destroy();
+      return false;
+    }
+  }
+
+  stopping_ = false;
+  for (uint32_t i = 0; i < worker_count; ++i)
+    workers_.push_back(
+        std::thread(&VulkanParallelRecorder::WorkerLoop, this, i + 1));
+  return true;
+}
+
+void VulkanParallelRecorder::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (std::thread& worker : workers_)
+    worker.join();
+  workers_.clear();
+
+  for (ThreadPool& pool : pools_) {
+    if (VK_NULL_HANDLE != pool.pool)
+      vkDestroyCommandPool(device_, pool.pool, nullptr);
+  }
+  pools_.clear();
+  results_.clear();
+  device_ = VK_NULL_HANDLE;
+}
+
+void VulkanParallelRecorder::BeginFrame(uint32_t frame_index) {
+  frame_index_ = frame_index;
+  for (uint32_t thread = 0; thread < thread_count(); ++thread) {
+    ThreadPool& pool = pools_[frame_index_ * thread_count() + thread];
+    if (pool.used == 0)
+      continue;
+    vkResetCommandPool(device_, pool.pool, 0);
+    pool.used = 0;
+  }
+}
+
+const std::vector<VkCommandBuffer>& VulkanParallelRecorder::Record(
+    uint32_t task_count, const VkCommandBufferInheritanceInfo& inheritance,
+    const RecordTask& task, bool one_time_submit) {
+  results_.assign(task_count, VK_NULL_HANDLE);
+  if (task_count == 0)
+    return results_;
+
+  task_count_ = task_count;
+  task_ = &task;
+  inheritance_ = &inheritance;
+  one_time_submit_ = one_time_submit;
+  next_task_ = 0;
+
+  // A single task is not worth waking anybody up for.
+  const bool parallel = task_count > 1 && !workers_.empty();
+  if (parallel) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy_workers_ = static_cast<uint32_t>(workers_.size());
+      ++generation_;
+    }
+    work_cv_.notify_all();
+  }
+
+  RunTasks(0);
+
+  if (parallel) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return busy_workers_ == 0; });
+  }
+
+  task_ = nullptr;
+  inheritance_ = nullptr;
+  // Failed tasks left no buffer behind.
+  results_.erase(std::remove(results_.begin(), results_.end(),
+                             static_cast<VkCommandBuffer>(VK_NULL_HANDLE)),
+                 results_.end());
+  return results_;
+}
+
+void VulkanParallelRecorder::WorkerLoop(uint32_t thread_index) {
+  uint64_t seen_generation = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this, seen_generation] {
+        return stopping_ || generation_ != seen_generation;
+      });
+      if (stopping_)
+        return;
+      seen_generation = generation_;
+    }
+
+    RunTasks(thread_index);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--busy_workers_ == 0)
+      done_cv_.notify_one();
+  }
+}
+
+void VulkanParallelRecorder::RunTasks(uint32_t thread_index) {
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  if (one_time_submit_)
+    begin_info.flags |= VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  begin_info.pInheritanceInfo = inheritance_;
+
+  for (;;) {
+    uint32_t task = next_task_.fetch_add(1);
+    if (task >= task_count_)
+      break;
+
+    VkCommandBuffer command_buffer = AcquireBuffer(thread_index);
+    if (VK_NULL_HANDLE == command_buffer)
+      continue;
+    vkBeginCommandBuffer(command_buffer, &begin_info);
+    (*task_)(command_buffer, task);
+    vkEndCommandBuffer(command_buffer);
+    results_[task] = command_buffer;
+  }
+}
+
+VkCommandBuffer VulkanParallelRecorder::AcquireBuffer(uint32_t thread_index) {
+  ThreadPool& pool = pools_[frame_index_ * thread_count() + thread_index];
+  if (pool.used == pool.buffers.size()) {
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = pool.pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    alloc_info.commandBufferCount = 1;
+
+    VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+    VkResult result =
+        vkAllocateCommandBuffers(device_, &alloc_info, &command_buffer);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << "vkAllocateCommandBuffers() failed: " << result;
+      return VK_NULL_HANDLE;
+    }
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_COMMAND_BUFFER, command_buffer,
+                  "frame %u thread %u secondary %zu", frame_index_,
+                  thread_index, pool.buffers.size());
+    pool.buffers.push_back(command_buffer);
+  }
+  return pool.buffers[pool.used++];
+}
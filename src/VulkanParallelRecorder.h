@@ -0,0 +1,90 @@
+#ifndef VULKAN_PARALLEL_RECORDER_H_
+#define VULKAN_PARALLEL_RECORDER_H_
+
+#include <vulkan/vulkan.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Records secondary command buffers on a pool of worker threads.
+//
+// Every thread (the caller of Record() included) owns one transient
+// VkCommandPool per frame slot, so recording needs no locking and a slot's
+// pools are reset in one go by BeginFrame(). Tasks are handed out
+// dynamically, but the buffers come back in task order, so executing them
+// with vkCmdExecuteCommands() is deterministic however the work was split.
+class VulkanParallelRecorder
+{
+public:
+  // Records task |task| into |command_buffer|, which is already begun.
+  typedef std::function<void(VkCommandBuffer command_buffer, uint32_t task)>
+      RecordTask;
+
+  VulkanParallelRecorder();
+  ~VulkanParallelRecorder();
+
+  // |worker_count| 0 uses one worker per spare hardware thread.
+  bool Initialize(VkDevice device, uint32_t queue_family_index,
+                  uint32_t frame_count, uint32_t worker_count = 0);
+  void Destroy();
+
+  // Resets the pools of |frame_index|. The slot's fence must have signaled.
+  void BeginFrame(uint32_t frame_index);
+  // Selects the slot to record into without resetting it, keeping what was
+  // recorded there before valid.
+  void ContinueFrame(uint32_t frame_index) { frame_index_ = frame_index; }
+
+  // Records |task_count| secondary command buffers in parallel. Each one is
+  // begun with RENDER_PASS_CONTINUE and |inheritance|, so it runs inside the
+  // caller's render pass. Returns the buffers in task order; they stay valid
+  // until the slot's next BeginFrame(). A task whose buffer cannot be
+  // allocated is skipped and left out. Without |one_time_submit| they may
+  // be executed by a primary that is submitted more than once.
+  const std::vector<VkCommandBuffer>& Record(
+      uint32_t task_count, const VkCommandBufferInheritanceInfo& inheritance,
+      const RecordTask& task, bool one_time_submit = true);
+
+  // Recording threads, the caller included.
+  uint32_t thread_count() const {
+    return static_cast<uint32_t>(workers_.size()) + 1;
+  }
+
+private:
+  struct ThreadPool {
+    VkCommandPool pool = VK_NULL_HANDLE;
+    std::vector<VkCommandBuffer> buffers;
+    uint32_t used = 0;
+  };
+
+  void WorkerLoop(uint32_t thread_index);
+  void RunTasks(uint32_t thread_index);
+  // Returns VK_NULL_HANDLE if no buffer can be allocated.
+  VkCommandBuffer AcquireBuffer(uint32_t thread_index);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  // pools_[frame * thread_count() + thread].
+  std::vector<ThreadPool> pools_;
+  uint32_t frame_index_ = 0;
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  uint64_t generation_ = 0;
+  uint32_t busy_workers_ = 0;
+  bool stopping_ = false;
+
+  // The job being recorded; only valid inside Record().
+  uint32_t task_count_ = 0;
+  const RecordTask* task_ = nullptr;
+  const VkCommandBufferInheritanceInfo* inheritance_ = nullptr;
+  bool one_time_submit_ = true;
+  std::atomic<uint32_t> next_task_;
+  std::vector<VkCommandBuffer> results_;
+};
+
+#endif /* VULKAN_PARALLEL_RECORDER_H_ */
@@ -0,0 +1,322 @@
+
+#include "VulkanParticleSystem.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanInstance.h"
+#include "VulkanMesh.h"
+#include "VulkanShaderLibrary.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+namespace {
+
+// Largest dispatch along x every device supports.
+const uint32_t kMaxWorkgroups = 65535;
+
+VkDeviceSize RoundUp(VkDeviceSize value, VkDeviceSize alignment) {
+  return alignment > 1 ? (value + alignment - 1) / alignment * alignment
+                       : value;
+}
+
+}  // namespace
+
+
+const uint32_t VulkanParticleSystem::kWorkgroupSize;
+
+VulkanParticleSystem::VulkanParticleSystem() {}
+
+VulkanParticleSystem::~VulkanParticleSystem() {
+  DCHECK_EQ(static_cast<VkBuffer>(VK_NULL_HANDLE), particle_buffer_);
+}
+
+bool VulkanParticleSystem::Initialize(VkPhysicalDevice physical_device,
+                                      VkDevice device,
+                                      VulkanMemoryAllocator* allocator,
+                                      VulkanShaderLibrary* shader_library,
+                                      VulkanPipelineBuilder* pipeline_builder,
+                                      uint32_t particle_count,
+                                      uint32_t frame_slots) {
+  device_ = device;
+  allocator_ = allocator;
+  shader_library_ = shader_library;
+  pipeline_builder_ = pipeline_builder;
+  particle_count_ = std::min(particle_count, kMaxWorkgroups * kWorkgroupSize);
+  frame_slots_ = frame_slots;
+  reset_pending_ = true;
+  time_ = 0.0;
+
+  // Written by the simulation and fetched as per-instance vertex data. Its
+  // initial content is garbage until the first dispatch scatters the
+  // particles.
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = static_cast<VkDeviceSize>(particle_count_) * sizeof(Particle);
+  buffer_info.usage =
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (!allocator_->CreateBuffer(buffer_info, VulkanMemoryAllocator::kGpuOnly,
+                                &particle_buffer_, &particle_memory_)) {
+    DLOG(ERROR) << "Failed to allocate " << particle_count_ << " particles";
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_BUFFER, particle_buffer_,
+                "particles");
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  params_stride_ = RoundUp(sizeof(Params),
+                           properties.limits.minUniformBufferOffsetAlignment);
+  buffer_info.size = params_stride_ * frame_slots_;
+  buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  if (!allocator_->CreateBuffer(buffer_info, VulkanMemoryAllocator::kCpuToGpu,
+                                &params_buffer_, &params_memory_)) {
+    Destroy();
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_BUFFER, params_buffer_,
+                "particle params");
+
+  if (VK_SUCCESS != CreateDescriptors()) {
+    Destroy();
+    return false;
+  }
+
+  ComputePipelineDesc desc;
+  desc.shader = shader_library_->GetModule("particles.comp");
+  desc.layout = compute_layout_;
+  if (VK_NULL_HANDLE == desc.shader) {
+    Destroy();
+    return false;
+  }
+  compute_pipeline_ = pipeline_builder_->RequestComputePipeline(desc);
+  return VulkanPipelineBuilder::kInvalidHandle != compute_pipeline_;
+}
+
+VkResult VulkanParticleSystem::CreateDescriptors() {
+  VkDescriptorSetLayoutBinding bindings[2] = {};
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  // The frame slot's parameters are picked with a dynamic offset.
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkDescriptorSetLayoutCreateInfo layout_info = {};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = arraysize(bindings);
+  layout_info.pBindings = bindings;
+  VkResult result = vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                                &set_layout_);
+  if (VK_SUCCESS != result)
+    return result;
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, set_layout_,
+                "particle set layout");
+
+  VkDescriptorPoolSize pool_sizes[2] = {};
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_sizes[0].descriptorCount = 1;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_sizes[1].descriptorCount = 1;
+
+  VkDescriptorPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = arraysize(pool_sizes);
+  pool_info.pPoolSizes = pool_sizes;
+  result = vkCreateDescriptorPool(device_, &pool_info, nullptr,
+                                  &descriptor_pool_);
+  if (VK_SUCCESS != result)
+    return result;
+
+  VkDescriptorSetAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = descriptor_pool_;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &set_layout_;
+  result = vkAllocateDescriptorSets(device_, &alloc_info, &descriptor_set_);
+  if (VK_SUCCESS != result)
+    return result;
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_DESCRIPTOR_SET, descriptor_set_,
+                "particle set");
+
+  VkDescriptorBufferInfo buffer_infos[2] = {};
+  buffer_infos[0].buffer = particle_buffer_;
+  buffer_infos[0].range = VK_WHOLE_SIZE;
+  buffer_infos[1].buffer = params_buffer_;
+  buffer_infos[1].range = sizeof(Params);
+
+  VkWriteDescriptorSet writes[2] = {};
+  for (uint32_t i = 0; i < 2; ++i) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = descriptor_set_;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = bindings[i].descriptorType;
+    writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(device_, arraysize(writes), writes, 0, nullptr);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &set_layout_;
+  result = vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                                  &compute_layout_);
+  if (VK_SUCCESS != result)
+    return result;
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_PIPELINE_LAYOUT, compute_layout_,
+                "particle compute layout");
+
+  // The draw takes everything from vertex input.
+  pipeline_layout_info.setLayoutCount = 0;
+  pipeline_layout_info.pSetLayouts = nullptr;
+  result = vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                                  &draw_layout_);
+  if (VK_SUCCESS == result) {
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_PIPELINE_LAYOUT, draw_layout_,
+                  "particle draw layout");
+  }
+  return result;
+}
+
+void VulkanParticleSystem::Destroy() {
+  DestroyDrawPipeline();
+  if (pipeline_builder_)
+    pipeline_builder_->Release(compute_pipeline_);
+  compute_pipeline_ = VulkanPipelineBuilder::kInvalidHandle;
+  recorded_compute_pipeline_ = VK_NULL_HANDLE;
+
+  vkDestroyPipelineLayout(device_, draw_layout_, nullptr);
+  vkDestroyPipelineLayout(device_, compute_layout_, nullptr);
+  vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, set_layout_, nullptr);
+  draw_layout_ = compute_layout_ = VK_NULL_HANDLE;
+  descriptor_pool_ = VK_NULL_HANDLE;
+  descriptor_set_ = VK_NULL_HANDLE;
+  set_layout_ = VK_NULL_HANDLE;
+
+  if (VK_NULL_HANDLE != params_buffer_)
+    allocator_->DestroyBuffer(params_buffer_, &params_memory_);
+  if (VK_NULL_HANDLE != particle_buffer_)
+    allocator_->DestroyBuffer(particle_buffer_, &particle_memory_);
+  params_buffer_ = VK_NULL_HANDLE;
+  particle_buffer_ = VK_NULL_HANDLE;
+}
+
+bool VulkanParticleSystem::CreateDrawPipeline(VkRenderPass render_pass,
+                                              uint32_t subpass,
+                                              VkSampleCountFlagBits samples) {
+  DCHECK_EQ(VulkanPipelineBuilder::kInvalidHandle, draw_pipeline_);
+  VertexLayout vertex_layout;
+  vertex_layout
+      .AddBinding(0, sizeof(Particle), VK_VERTEX_INPUT_RATE_INSTANCE)
+      .AddAttribute(0, 0, VK_FORMAT_R32G32B32A32_SFLOAT,
+                    offsetof(Particle, position))
+      .AddAttribute(1, 0, VK_FORMAT_R32G32B32A32_SFLOAT,
+                    offsetof(Particle, velocity));
+
+  GraphicsPipelineDesc desc;
+  desc.vertex_shader = shader_library_->GetModule("particles.vert");
+  desc.fragment_shader = shader_library_->GetModule("shader.frag");
+  if (VK_NULL_HANDLE == desc.vertex_shader ||
+      VK_NULL_HANDLE == desc.fragment_shader)
+    return false;
+  desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  desc.cull_mode = VK_CULL_MODE_NONE;
+  desc.samples = samples;
+  desc.depth_test = true;
+  desc.depth_write = true;
+  vertex_layout.ApplyTo(&desc);
+  desc.layout = draw_layout_;
+  desc.render_pass = render_pass;
+  desc.subpass = subpass;
+
+  draw_pipeline_ = pipeline_builder_->RequestGraphicsPipeline(desc);
+  return VulkanPipelineBuilder::kInvalidHandle != draw_pipeline_;
+}
+
+void VulkanParticleSystem::DestroyDrawPipeline() {
+  if (pipeline_builder_)
+    pipeline_builder_->Release(draw_pipeline_);
+  draw_pipeline_ = VulkanPipelineBuilder::kInvalidHandle;
+  recorded_draw_pipeline_ = VK_NULL_HANDLE;
+  ready_ = false;
+}
+
+void VulkanParticleSystem::WaitForPipelines() const {
+  if (!pipeline_builder_)
+    return;
+  pipeline_builder_->WaitForPipeline(compute_pipeline_);
+  pipeline_builder_->WaitForPipeline(draw_pipeline_);
+}
+
+bool VulkanParticleSystem::UpdatePipelines() {
+  VkPipeline compute = pipeline_builder_->GetPipeline(compute_pipeline_);
+  VkPipeline draw = pipeline_builder_->GetPipeline(draw_pipeline_);
+  const bool ready = VK_NULL_HANDLE != compute && VK_NULL_HANDLE != draw;
+  if (ready == ready_ && compute == recorded_compute_pipeline_ &&
+      draw == recorded_draw_pipeline_)
+    return false;
+
+  // Compiled on a worker thread, so they are named once they show up.
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_PIPELINE, compute,
+                "particle simulation");
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_PIPELINE, draw, "particle draw");
+  recorded_compute_pipeline_ = compute;
+  recorded_draw_pipeline_ = draw;
+  const bool changed = ready || ready_;
+  ready_ = ready;
+  return changed;
+}
+
+void VulkanParticleSystem::Update(uint32_t frame_slot, float delta_seconds) {
+  DCHECK(frame_slot < frame_slots_);
+  // Large steps (a stall, a debugger) would fling the particles apart.
+  delta_seconds = std::min(delta_seconds, 0.1f);
+  time_ += delta_seconds;
+
+  Params params;
+  params.delta_time = delta_seconds;
+  params.time = static_cast<float>(time_);
+  params.count = particle_count_;
+  // Only a frame that actually dispatches may consume the reset.
+  params.reset = reset_pending_ && ready_ ? 1 : 0;
+  if (params.reset)
+    reset_pending_ = false;
+
+  const VkDeviceSize offset = params_stride_ * frame_slot;
+  memcpy(static_cast<char*>(params_memory_.mapped) + offset, &params,
+         sizeof(params));
+  allocator_->Flush(params_memory_, offset, sizeof(params));
+}
+
+void VulkanParticleSystem::RecordSimulate(VkCommandBuffer command_buffer,
+                                          uint32_t frame_slot) const {
+  if (!ready_)
+    return;
+  const uint32_t dynamic_offset =
+      static_cast<uint32_t>(params_stride_ * frame_slot);
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    recorded_compute_pipeline_);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          compute_layout_, 0, 1, &descriptor_set_, 1,
+                          &dynamic_offset);
+  vkCmdDispatch(command_buffer,
+                (particle_count_ + kWorkgroupSize - 1) / kWorkgroupSize, 1, 1);
+}
+
+void VulkanParticleSystem::RecordDraw(VkCommandBuffer command_buffer,
+                                      VkExtent2D extent) const {
+  if (!ready_)
+    return;
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    recorded_draw_pipeline_);
+  VulkanPipelineBuilder::SetViewportAndScissor(command_buffer, extent);
+  const VkDeviceSize offset = 0;
+  vkCmdBindVertexBuffers(command_buffer, 0, 1, &particle_buffer_, &offset);
+  vkCmdDraw(command_buffer, 3, particle_count_, 0, 0);
+}
@@ -0,0 +1,125 @@
+#ifndef VULKAN_PARTICLE_SYSTEM_H_
+#define VULKAN_PARTICLE_SYSTEM_H_
+
+#include <vulkan/vulkan.h>
+
+#include "VulkanMemoryAllocator.h"
+#include "VulkanPipelineBuilder.h"
+
+class VulkanShaderLibrary;
+
+// Particles simulated by a compute shader (shader/particles.comp) and drawn
+// as one instanced draw straight from the simulation's buffer, one tiny
+// triangle per instance. Nothing is read back; the CPU only writes the
+// simulation parameters. Doubles as a GPU throughput stress test.
+//
+// The buffer is simulated in place, so a frame's simulation has to wait for
+// the previous frame's draw and the draw for the simulation; the render
+// graph derives both barriers from the passes' declared buffer uses.
+//
+// The dispatch is recorded on the graphics queue ahead of the draw rather
+// than submitted to an async compute queue: it feeds the same frame's draw
+// and must wait for the previous one, so a compute queue would only trade
+// the graph's barriers for semaphores both ways.
+//
+// The parameters are per frame slot, written by Update() every frame, so
+// recorded command buffers replay unchanged.
+class VulkanParticleSystem
+{
+public:
+  // Laid out like the std430 Particle in particles.comp.
+  struct Particle {
+    float position[4];
+    float velocity[4];
+  };
+
+  // local_size_x of particles.comp.
+  static const uint32_t kWorkgroupSize = 256;
+
+  VulkanParticleSystem();
+  ~VulkanParticleSystem();
+
+  // Requests the compute pipeline; the draw pipeline follows the render
+  // pass through CreateDrawPipeline().
+  bool Initialize(VkPhysicalDevice physical_device, VkDevice device,
+                  VulkanMemoryAllocator* allocator,
+                  VulkanShaderLibrary* shader_library,
+                  VulkanPipelineBuilder* pipeline_builder,
+                  uint32_t particle_count, uint32_t frame_slots);
+  // The caller guarantees the GPU no longer uses anything.
+  void Destroy();
+
+  bool CreateDrawPipeline(VkRenderPass render_pass, uint32_t subpass,
+                          VkSampleCountFlagBits samples);
+  void DestroyDrawPipeline();
+  // Blocks until both pipelines are compiled, e.g. before destroying the
+  // render pass a compile may still reference.
+  void WaitForPipelines() const;
+
+  // Polls the pipeline builder. True when both pipelines became ready since
+  // the last call, which changes what gets recorded.
+  bool UpdatePipelines();
+  // Simulation and draw are recorded only once both pipelines are ready.
+  bool ready() const { return ready_; }
+
+  // Writes |frame_slot|'s simulation parameters. Call every frame once the
+  // slot's fence has signaled. The first call after the pipelines became
+  // ready also scatters the particles.
+  void Update(uint32_t frame_slot, float delta_seconds);
+
+  // Outside of a render pass.
+  void RecordSimulate(VkCommandBuffer command_buffer,
+                      uint32_t frame_slot) const;
+  // Inside the render pass given to CreateDrawPipeline(). Sets viewport and
+  // scissor itself.
+  void RecordDraw(VkCommandBuffer command_buffer, VkExtent2D extent) const;
+
+  uint32_t particle_count() const { return particle_count_; }
+  VkBuffer particle_buffer() const { return particle_buffer_; }
+
+private:
+  // Laid out like the std140 Params in particles.comp.
+  struct Params {
+    float delta_time;
+    float time;
+    uint32_t count;
+    uint32_t reset;
+  };
+
+  VkResult CreateDescriptors();
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VulkanMemoryAllocator* allocator_ = nullptr;
+  VulkanShaderLibrary* shader_library_ = nullptr;
+  VulkanPipelineBuilder* pipeline_builder_ = nullptr;
+
+  uint32_t particle_count_ = 0;
+  VkBuffer particle_buffer_ = VK_NULL_HANDLE;
+  VulkanAllocation particle_memory_;
+
+  // One Params per frame slot, |params_stride_| apart.
+  VkBuffer params_buffer_ = VK_NULL_HANDLE;
+  VulkanAllocation params_memory_;
+  VkDeviceSize params_stride_ = 0;
+  uint32_t frame_slots_ = 0;
+
+  VkDescriptorSetLayout set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool descriptor_pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet descriptor_set_ = VK_NULL_HANDLE;
+  VkPipelineLayout compute_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout draw_layout_ = VK_NULL_HANDLE;
+
+  VulkanPipelineBuilder::Handle compute_pipeline_ =
+      VulkanPipelineBuilder::kInvalidHandle;
+  VulkanPipelineBuilder::Handle draw_pipeline_ =
+      VulkanPipelineBuilder::kInvalidHandle;
+  // Snapshots taken by UpdatePipelines(), used for recording.
+  VkPipeline recorded_compute_pipeline_ = VK_NULL_HANDLE;
+  VkPipeline recorded_draw_pipeline_ = VK_NULL_HANDLE;
+  bool ready_ = false;
+
+  bool reset_pending_ = true;
+  double time_ = 0.0;
+};
+
+#endif /* VULKAN_PARTICLE_SYSTEM_H_ */
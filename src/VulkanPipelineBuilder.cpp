@@ -0,0 +1,435 @@
+
+#include "VulkanPipelineBuilder.h"
+#include "VulkanInstance.h"
+
+#include <cstring>
+
+namespace {
+
+template <typename T>
+void HashCombine(size_t* seed, const T& value) {
+  // FNV-1a over the raw bytes; every T here is a plain Vulkan value type.
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+  size_t hash = *seed;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  *seed = hash;
+}
+
+}  // namespace
+
+
+size_t GraphicsPipelineDesc::Hash() const {
+  size_t seed = 14695981039346656037ULL;
+  HashCombine(&seed, vertex_shader);
+  HashCombine(&seed, fragment_shader);
+  for (const VkVertexInputBindingDescription& binding : vertex_bindings) {
+    HashCombine(&seed, binding.binding);
+    HashCombine(&seed, binding.stride);
+    HashCombine(&seed, binding.inputRate);
+  }
+  for (const VkVertexInputAttributeDescription& attribute : vertex_attributes) {
+    HashCombine(&seed, attribute.location);
+    HashCombine(&seed, attribute.binding);
+    HashCombine(&seed, attribute.format);
+    HashCombine(&seed, attribute.offset);
+  }
+  HashCombine(&seed, topology);
+  HashCombine(&seed, polygon_mode);
+  HashCombine(&seed, cull_mode);
+  HashCombine(&seed, front_face);
+  HashCombine(&seed, samples);
+  HashCombine(&seed, blend_enable);
+  HashCombine(&seed, depth_test);
+  HashCombine(&seed, depth_write);
+  HashCombine(&seed, depth_compare);
+  HashCombine(&seed, layout);
+  HashCombine(&seed, render_pass);
+  HashCombine(&seed, subpass);
+  return seed;
+}
+
+bool GraphicsPipelineDesc::operator==(const GraphicsPipelineDesc& other) const {
+  if (vertex_bindings.size() != other.vertex_bindings.size() ||
+      vertex_attributes.size() != other.vertex_attributes.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < vertex_bindings.size(); ++i) {
+    const VkVertexInputBindingDescription& a = vertex_bindings[i];
+    const VkVertexInputBindingDescription& b = other.vertex_bindings[i];
+    if (a.binding != b.binding || a.stride != b.stride ||
+        a.inputRate != b.inputRate) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < vertex_attributes.size(); ++i) {
+    const VkVertexInputAttributeDescription& a = vertex_attributes[i];
+    const VkVertexInputAttributeDescription& b = other.vertex_attributes[i];
+    if (a.location != b.location || a.binding != b.binding ||
+        a.format != b.format || a.offset != b.offset) {
+      return false;
+    }
+  }
+  return vertex_shader == other.vertex_shader &&
+         fragment_shader == other.fragment_shader &&
+         topology == other.topology && polygon_mode == other.polygon_mode &&
+         cull_mode == other.cull_mode && front_face == other.front_face &&
+         samples == other.samples && blend_enable == other.blend_enable &&
+         depth_test == other.depth_test && depth_write == other.depth_write &&
+         depth_compare == other.depth_compare &&
+         layout == other.layout &&
+         render_pass == other.render_pass && subpass == other.subpass;
+}
+
+size_t ComputePipelineDesc::Hash() const {
+  size_t seed = 0;
+  HashCombine(&seed, shader);
+  HashCombine(&seed, layout);
+  return seed;
+}
+
+bool ComputePipelineDesc::operator==(const ComputePipelineDesc& other) const {
+  return shader == other.shader && layout == other.layout;
+}
+
+
+VulkanPipelineBuilder::VulkanPipelineBuilder() {}
+
+VulkanPipelineBuilder::~VulkanPipelineBuilder() {
+  DCHECK(workers_.empty());
+  DCHECK(entries_.empty());
+}
+
+bool VulkanPipelineBuilder::Initialize(VkDevice device,
+                                       VkPipelineCache pipeline_cache,
+                                       uint32_t thread_count) {
+  DCHECK(workers_.empty());
+  device_ = device;
+  pipeline_cache_ = pipeline_cache;
+  stopping_ = false;
+
+  if (thread_count == 0) {
+    unsigned hardware_threads = std::thread::hardware_concurrency();
+    thread_count = hardware_threads > 1 ? hardware_threads - 1 : 1;
+  }
+
+  for (uint32_t i = 0; i < thread_count; ++i)
+    workers_.push_back(std::thread(&VulkanPipelineBuilder::WorkerLoop, this));
+  return true;
+}
+
+void VulkanPipelineBuilder::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queue_cv_.notify_all();
+  for (std::thread& worker : workers_)
+    worker.join();
+  workers_.clear();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Anything never picked up by a worker is dropped without compiling.
+  for (const std::shared_ptr<Entry>& entry : queue_)
+    entry->promise.set_value(VK_NULL_HANDLE);
+  queue_.clear();
+
+  for (auto& it : entries_)
+    DestroyEntryLocked(it.second.get());
+  entries_.clear();
+  handles_by_hash_.clear();
+  device_ = VK_NULL_HANDLE;
+  pipeline_cache_ = VK_NULL_HANDLE;
+}
+
+VulkanPipelineBuilder::Handle VulkanPipelineBuilder::RequestGraphicsPipeline(
+    const GraphicsPipelineDesc& desc) {
+  std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+  entry->desc = desc;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  return RequestLocked(desc.Hash(), [&desc](const Entry& other) {
+    return !other.compute && other.desc == desc;
+  }, entry);
+}
+
+VulkanPipelineBuilder::Handle VulkanPipelineBuilder::RequestComputePipeline(
+    const ComputePipelineDesc& desc) {
+  std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+  entry->compute = true;
+  entry->compute_desc = desc;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  return RequestLocked(desc.Hash(), [&desc](const Entry& other) {
+    return other.compute && other.compute_desc == desc;
+  }, entry);
+}
+
+VulkanPipelineBuilder::Handle VulkanPipelineBuilder::RequestLocked(
+    size_t hash, const std::function<bool(const Entry&)>& matches,
+    std::shared_ptr<Entry> entry) {
+  auto range = handles_by_hash_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    Entry* existing = entries_[it->second].get();
+    if (matches(*existing)) {
+      ++existing->refs;
+      return existing->handle;
+    }
+  }
+
+  entry->handle = next_handle_++;
+  entry->hash = hash;
+  entry->refs = 1;
+  entry->pipeline = VK_NULL_HANDLE;
+  entry->future = entry->promise.get_future().share();
+
+  entries_[entry->handle] = entry;
+  handles_by_hash_.insert(std::make_pair(hash, entry->handle));
+  queue_.push_back(entry);
+  queue_cv_.notify_one();
+  return entry->handle;
+}
+
+void VulkanPipelineBuilder::Release(Handle handle) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(handle);
+  if (it == entries_.end())
+    return;
+
+  Entry* entry = it->second.get();
+  DCHECK(entry->refs > 0);
+  if (--entry->refs > 0)
+    return;
+
+  auto range = handles_by_hash_.equal_range(entry->hash);
+  for (auto hash_it = range.first; hash_it != range.second; ++hash_it) {
+    if (hash_it->second == handle) {
+      handles_by_hash_.erase(hash_it);
+      break;
+    }
+  }
+
+  // A worker still compiling it will destroy the result when it finishes.
+  entry->released = true;
+  if (entry->done)
+    DestroyEntryLocked(entry);
+  entries_.erase(it);
+}
+
+VkPipeline VulkanPipelineBuilder::GetPipeline(Handle handle,
+                                              VkPipeline fallback) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(handle);
+  if (it == entries_.end())
+    return fallback;
+  VkPipeline pipeline = it->second->pipeline.load(std::memory_order_acquire);
+  return VK_NULL_HANDLE != pipeline ? pipeline : fallback;
+}
+
+std::shared_future<VkPipeline> VulkanPipelineBuilder::GetFuture(
+    Handle handle) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(handle);
+  if (it == entries_.end())
+    return std::shared_future<VkPipeline>();
+  return it->second->future;
+}
+
+VkPipeline VulkanPipelineBuilder::WaitForPipeline(Handle handle) const {
+  std::shared_future<VkPipeline> future = GetFuture(handle);
+  return future.valid() ? future.get() : VK_NULL_HANDLE;
+}
+
+void VulkanPipelineBuilder::WorkerLoop() {
+  for (;;) {
+    std::shared_ptr<Entry> entry;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+      entry = queue_.front();
+      queue_.pop_front();
+      if (entry->released) {
+        entry->promise.set_value(VK_NULL_HANDLE);
+        continue;
+      }
+    }
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult result =
+        entry->compute
+            ? CreateComputePipeline(device_, pipeline_cache_,
+                                    entry->compute_desc, &pipeline)
+            : CreateGraphicsPipeline(device_, pipeline_cache_, entry->desc,
+                                     &pipeline);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << (entry->compute ? "vkCreateComputePipelines()"
+                                     : "vkCreateGraphicsPipelines()")
+                  << " failed: " << result;
+      pipeline = VK_NULL_HANDLE;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry->pipeline.store(pipeline, std::memory_order_release);
+    entry->done = true;
+    entry->promise.set_value(pipeline);
+    if (entry->released)
+      DestroyEntryLocked(entry.get());
+  }
+}
+
+void VulkanPipelineBuilder::DestroyEntryLocked(Entry* entry) {
+  VkPipeline pipeline = entry->pipeline.exchange(VK_NULL_HANDLE);
+  if (VK_NULL_HANDLE != pipeline)
+    vkDestroyPipeline(device_, pipeline, nullptr);
+}
+
+// static
+void VulkanPipelineBuilder::SetViewportAndScissor(
+    VkCommandBuffer command_buffer, VkExtent2D extent) {
+  VkViewport viewport = {};
+  viewport.width = static_cast<float>(extent.width);
+  viewport.height = static_cast<float>(extent.height);
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+  VkRect2D scissor = {};
+  scissor.extent = extent;
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+}
+
+// static
+VkResult VulkanPipelineBuilder::CreateGraphicsPipeline(
+    VkDevice device, VkPipelineCache pipeline_cache,
+    const GraphicsPipelineDesc& desc, VkPipeline* pipeline) {
+  VkPipelineShaderStageCreateInfo shader_stages[2] = {};
+  shader_stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shader_stages[0].module = desc.vertex_shader;
+  shader_stages[0].pName = "main";
+  shader_stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shader_stages[1].module = desc.fragment_shader;
+  shader_stages[1].pName = "main";
+
+  VkPipelineVertexInputStateCreateInfo vertex_input_info = {};
+  vertex_input_info.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertex_input_info.vertexBindingDescriptionCount = desc.vertex_bindings.size();
+  vertex_input_info.pVertexBindingDescriptions = desc.vertex_bindings.data();
+  vertex_input_info.vertexAttributeDescriptionCount =
+      desc.vertex_attributes.size();
+  vertex_input_info.pVertexAttributeDescriptions =
+      desc.vertex_attributes.data();
+
+  VkPipelineInputAssemblyStateCreateInfo input_assembly = {};
+  input_assembly.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  input_assembly.topology = desc.topology;
+  input_assembly.primitiveRestartEnable = VK_FALSE;
+
+  // Only the counts; the rectangles are dynamic.
+  VkPipelineViewportStateCreateInfo viewport_state = {};
+  viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewport_state.viewportCount = 1;
+  viewport_state.scissorCount = 1;
+
+  const VkDynamicState dynamic_states[] = {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR,
+  };
+  VkPipelineDynamicStateCreateInfo dynamic_state = {};
+  dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic_state.dynamicStateCount = arraysize(dynamic_states);
+  dynamic_state.pDynamicStates = dynamic_states;
+
+  VkPipelineRasterizationStateCreateInfo rasterizer = {};
+  rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.depthClampEnable = VK_FALSE;
+  rasterizer.rasterizerDiscardEnable = VK_FALSE;
+  rasterizer.polygonMode = desc.polygon_mode;
+  rasterizer.lineWidth = 1.0f;
+  rasterizer.cullMode = desc.cull_mode;
+  rasterizer.frontFace = desc.front_face;
+  rasterizer.depthBiasEnable = VK_FALSE;
+
+  VkPipelineMultisampleStateCreateInfo multisampling = {};
+  multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.sampleShadingEnable = VK_FALSE;
+  multisampling.rasterizationSamples = desc.samples;
+  multisampling.minSampleShading = 1.0f;
+
+  VkPipelineDepthStencilStateCreateInfo depth_stencil = {};
+  depth_stencil.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depth_stencil.depthTestEnable = desc.depth_test ? VK_TRUE : VK_FALSE;
+  depth_stencil.depthWriteEnable = desc.depth_write ? VK_TRUE : VK_FALSE;
+  depth_stencil.depthCompareOp = desc.depth_compare;
+  depth_stencil.depthBoundsTestEnable = VK_FALSE;
+  depth_stencil.stencilTestEnable = VK_FALSE;
+
+  VkPipelineColorBlendAttachmentState color_blend_attachment = {};
+  color_blend_attachment.colorWriteMask =
+      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+  color_blend_attachment.blendEnable = desc.blend_enable ? VK_TRUE : VK_FALSE;
+  color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+  color_blend_attachment.dstColorBlendFactor =
+      VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+  color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
+  color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+  color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+  color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+  VkPipelineColorBlendStateCreateInfo color_blending = {};
+  color_blending.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  color_blending.logicOpEnable = VK_FALSE;
+  color_blending.logicOp = VK_LOGIC_OP_COPY;
+  color_blending.attachmentCount = 1;
+  color_blending.pAttachments = &color_blend_attachment;
+
+  VkGraphicsPipelineCreateInfo pipeline_info = {};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipeline_info.stageCount = 2;
+  pipeline_info.pStages = shader_stages;
+  pipeline_info.pVertexInputState = &vertex_input_info;
+  pipeline_info.pInputAssemblyState = &input_assembly;
+  pipeline_info.pViewportState = &viewport_state;
+  pipeline_info.pRasterizationState = &rasterizer;
+  pipeline_info.pMultisampleState = &multisampling;
+  pipeline_info.pDepthStencilState = &depth_stencil;
+  pipeline_info.pColorBlendState = &color_blending;
+  pipeline_info.pDynamicState = &dynamic_state;
+  pipeline_info.layout = desc.layout;
+  pipeline_info.renderPass = desc.render_pass;
+  pipeline_info.subpass = desc.subpass;
+  pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+  pipeline_info.basePipelineIndex = -1;
+
+  return vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_info,
+                                   nullptr, pipeline);
+}
+
+// static
+VkResult VulkanPipelineBuilder::CreateComputePipeline(
+    VkDevice device, VkPipelineCache pipeline_cache,
+    const ComputePipelineDesc& desc, VkPipeline* pipeline) {
+  VkComputePipelineCreateInfo pipeline_info = {};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = desc.shader;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.layout = desc.layout;
+  pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+  pipeline_info.basePipelineIndex = -1;
+
+  return vkCreateComputePipelines(device, pipeline_cache, 1, &pipeline_info,
+                                  nullptr, pipeline);
+}
@@ -0,0 +1,144 @@
+#ifndef VULKAN_PIPELINE_BUILDER_H_
+#define VULKAN_PIPELINE_BUILDER_H_
+
+#include <vulkan/vulkan.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Everything that goes into a graphics pipeline, as plain values so that
+// identical requests can be hashed and compared.
+struct GraphicsPipelineDesc {
+  VkShaderModule vertex_shader = VK_NULL_HANDLE;
+  VkShaderModule fragment_shader = VK_NULL_HANDLE;
+
+  std::vector<VkVertexInputBindingDescription> vertex_bindings;
+  std::vector<VkVertexInputAttributeDescription> vertex_attributes;
+
+  VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  VkPolygonMode polygon_mode = VK_POLYGON_MODE_FILL;
+  VkCullModeFlags cull_mode = VK_CULL_MODE_BACK_BIT;
+  VkFrontFace front_face = VK_FRONT_FACE_CLOCKWISE;
+  // Must match the render pass's attachments.
+  VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+  bool blend_enable = false;
+  // Against the subpass's depth attachment.
+  bool depth_test = false;
+  bool depth_write = false;
+  VkCompareOp depth_compare = VK_COMPARE_OP_LESS;
+
+  VkPipelineLayout layout = VK_NULL_HANDLE;
+  VkRenderPass render_pass = VK_NULL_HANDLE;
+  uint32_t subpass = 0;
+
+  size_t Hash() const;
+  bool operator==(const GraphicsPipelineDesc& other) const;
+};
+
+struct ComputePipelineDesc {
+  VkShaderModule shader = VK_NULL_HANDLE;
+  VkPipelineLayout layout = VK_NULL_HANDLE;
+
+  size_t Hash() const;
+  bool operator==(const ComputePipelineDesc& other) const;
+};
+
+// Compiles graphics and compute pipelines on a pool of worker threads.
+//
+// Viewport and scissor are dynamic state, so one pipeline serves render
+// targets of any size and a resize never waits for a compile. Command buffers
+// set both with SetViewportAndScissor() before their first draw.
+//
+// Requests return immediately with a handle; the renderer keeps drawing
+// with a fallback (or skips the draw) until GetPipeline() reports the real
+// pipeline. Identical descriptions share one pipeline, reference counted
+// through Request/Release.
+class VulkanPipelineBuilder
+{
+public:
+  typedef uint32_t Handle;
+  static const Handle kInvalidHandle = 0;
+
+  VulkanPipelineBuilder();
+  ~VulkanPipelineBuilder();
+
+  // |thread_count| 0 uses one worker per spare hardware thread.
+  bool Initialize(VkDevice device, VkPipelineCache pipeline_cache,
+                  uint32_t thread_count = 0);
+  // Waits for outstanding compiles and destroys every pipeline.
+  void Destroy();
+
+  Handle RequestGraphicsPipeline(const GraphicsPipelineDesc& desc);
+  Handle RequestComputePipeline(const ComputePipelineDesc& desc);
+  // Drops one reference. The caller guarantees the GPU no longer uses the
+  // pipeline; a compile still in progress is destroyed once it finishes.
+  void Release(Handle handle);
+
+  // Never blocks: returns |fallback| until the pipeline is compiled.
+  VkPipeline GetPipeline(Handle handle,
+                         VkPipeline fallback = VK_NULL_HANDLE) const;
+  std::shared_future<VkPipeline> GetFuture(Handle handle) const;
+  // Blocks until the pipeline is compiled.
+  VkPipeline WaitForPipeline(Handle handle) const;
+
+  // Covers all of |extent|. Secondary command buffers inherit no dynamic
+  // state and need their own call.
+  static void SetViewportAndScissor(VkCommandBuffer command_buffer,
+                                    VkExtent2D extent);
+
+  static VkResult CreateGraphicsPipeline(VkDevice device,
+                                         VkPipelineCache pipeline_cache,
+                                         const GraphicsPipelineDesc& desc,
+                                         VkPipeline* pipeline);
+  static VkResult CreateComputePipeline(VkDevice device,
+                                        VkPipelineCache pipeline_cache,
+                                        const ComputePipelineDesc& desc,
+                                        VkPipeline* pipeline);
+
+private:
+  struct Entry {
+    Handle handle = kInvalidHandle;
+    // Either |desc| or |compute_desc| is used.
+    bool compute = false;
+    GraphicsPipelineDesc desc;
+    ComputePipelineDesc compute_desc;
+    size_t hash = 0;
+    uint32_t refs = 0;
+    bool done = false;
+    bool released = false;
+    std::atomic<VkPipeline> pipeline;
+    std::promise<VkPipeline> promise;
+    std::shared_future<VkPipeline> future;
+  };
+
+  // Returns the handle of an existing entry matching |matches|, with one
+  // more reference, or queues |entry| under |hash|.
+  Handle RequestLocked(size_t hash,
+                       const std::function<bool(const Entry&)>& matches,
+                       std::shared_ptr<Entry> entry);
+  void WorkerLoop();
+  void DestroyEntryLocked(Entry* entry);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queue_cv_;
+  std::deque<std::shared_ptr<Entry>> queue_;
+  std::vector<std::thread> workers_;
+  bool stopping_ = false;
+
+  Handle next_handle_ = 1;
+  std::unordered_map<Handle, std::shared_ptr<Entry>> entries_;
+  std::unordered_multimap<size_t, Handle> handles_by_hash_;
+};
+
+#endif /* VULKAN_PIPELINE_BUILDER_H_ */
@@ -0,0 +1,150 @@
+
+#include "VulkanPipelineCache.h"
+#include "VulkanInstance.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+
+namespace {
+
+// Layout of VK_PIPELINE_CACHE_HEADER_VERSION_ONE.
+const size_t kHeaderSize = 16 + VK_UUID_SIZE;
+
+uint32_t ReadUint32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+
+VulkanPipelineCache::VulkanPipelineCache() {}
+
+VulkanPipelineCache::~VulkanPipelineCache() {
+  DCHECK_EQ(static_cast<VkPipelineCache>(VK_NULL_HANDLE), vk_pipeline_cache_);
+}
+
+bool VulkanPipelineCache::Initialize(VkPhysicalDevice physical_device,
+                                     VkDevice device,
+                                     const std::string& path) {
+  vk_device_ = device;
+  path_ = path;
+  vkGetPhysicalDeviceProperties(physical_device, &device_properties_);
+
+  std::vector<char> data;
+  if (!path_.empty() && ReadFile(&data)) {
+    if (ValidateHeader(data)) {
+      loaded_from_disk_ = true;
+    } else {
+      DLOG(WARNING) << "Discarding stale pipeline cache " << path_;
+      data.clear();
+    }
+  }
+
+  VkPipelineCacheCreateInfo create_info = {};
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  create_info.initialDataSize = data.size();
+  create_info.pInitialData = data.empty() ? nullptr : data.data();
+
+  VkResult result = vkCreatePipelineCache(vk_device_, &create_info, nullptr,
+                                          &vk_pipeline_cache_);
+  if (VK_SUCCESS != result && loaded_from_disk_) {
+    // The header matched but the driver still rejected the blob.
+    DLOG(WARNING) << "vkCreatePipelineCache() rejected " << path_ << ": "
+                  << result;
+    loaded_from_disk_ = false;
+    create_info.initialDataSize = 0;
+    create_info.pInitialData = nullptr;
+    result = vkCreatePipelineCache(vk_device_, &create_info, nullptr,
+                                   &vk_pipeline_cache_);
+  }
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreatePipelineCache() failed: " << result;
+    vk_pipeline_cache_ = VK_NULL_HANDLE;
+    return false;
+  }
+  return true;
+}
+
+void VulkanPipelineCache::Destroy() {
+  if (VK_NULL_HANDLE == vk_pipeline_cache_)
+    return;
+
+  if (!path_.empty())
+    Save();
+
+  vkDestroyPipelineCache(vk_device_, vk_pipeline_cache_, nullptr);
+  vk_pipeline_cache_ = VK_NULL_HANDLE;
+  vk_device_ = VK_NULL_HANDLE;
+  loaded_from_disk_ = false;
+}
+
+bool VulkanPipelineCache::Save() {
+  if (VK_NULL_HANDLE == vk_pipeline_cache_ || path_.empty())
+    return false;
+
+  size_t size = 0;
+  VkResult result = vkGetPipelineCacheData(vk_device_, vk_pipeline_cache_,
+                                           &size, nullptr);
+  if (VK_SUCCESS != result || size == 0)
+    return false;
+
+  std::vector<char> data(size);
+  result = vkGetPipelineCacheData(vk_device_, vk_pipeline_cache_, &size,
+                                  data.data());
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkGetPipelineCacheData() failed: " << result;
+    return false;
+  }
+
+  std::string temp_path = path_ + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    DLOG(ERROR) << "Failed to open " << temp_path;
+    return false;
+  }
+  bool written = fwrite(data.data(), 1, size, file) == size &&
+                 fflush(file) == 0 && fsync(fileno(file)) == 0;
+  fclose(file);
+
+  if (!written || rename(temp_path.c_str(), path_.c_str()) != 0) {
+    DLOG(ERROR) << "Failed to write pipeline cache " << path_;
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool VulkanPipelineCache::ReadFile(std::vector<char>* data) const {
+  std::ifstream ifs(path_.c_str(), std::ios::binary | std::ios::ate);
+  if (!ifs.is_open())
+    return false;
+
+  std::streamoff size = ifs.tellg();
+  if (size <= 0)
+    return false;
+
+  data->resize(static_cast<size_t>(size));
+  ifs.seekg(0, std::ios::beg);
+  return static_cast<bool>(ifs.read(data->data(), size));
+}
+
+bool VulkanPipelineCache::ValidateHeader(const std::vector<char>& data) const {
+  if (data.size() < kHeaderSize)
+    return false;
+
+  uint32_t header_size = ReadUint32(&data[0]);
+  uint32_t header_version = ReadUint32(&data[4]);
+  uint32_t vendor_id = ReadUint32(&data[8]);
+  uint32_t device_id = ReadUint32(&data[12]);
+
+  return header_size >= kHeaderSize && header_size <= data.size() &&
+         header_version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         vendor_id == device_properties_.vendorID &&
+         device_id == device_properties_.deviceID &&
+         memcmp(&data[16], device_properties_.pipelineCacheUUID,
+                VK_UUID_SIZE) == 0;
+}
@@ -0,0 +1,44 @@
+#ifndef VULKAN_PIPELINE_CACHE_H_
+#define VULKAN_PIPELINE_CACHE_H_
+
+#include <vulkan/vulkan.h>
+
+#include <string>
+#include <vector>
+
+// A VkPipelineCache persisted across runs.
+//
+// The file is only trusted if its header matches the current device's
+// vendorID, deviceID and pipelineCacheUUID; anything else (other GPU, driver
+// update, truncated or corrupt file) is discarded and the cache starts
+// empty. Saving writes a temporary file and renames it over the old one so a
+// crash never leaves a half-written cache behind.
+class VulkanPipelineCache
+{
+public:
+  VulkanPipelineCache();
+  ~VulkanPipelineCache();
+
+  // An empty |path| keeps the cache in memory only.
+  bool Initialize(VkPhysicalDevice physical_device, VkDevice device,
+                  const std::string& path);
+  // Saves the cache (if it has a path) and destroys it.
+  void Destroy();
+
+  bool Save();
+
+  VkPipelineCache GetVulkanPipelineCache() const { return vk_pipeline_cache_; }
+  bool loaded_from_disk() const { return loaded_from_disk_; }
+
+private:
+  bool ReadFile(std::vector<char>* data) const;
+  bool ValidateHeader(const std::vector<char>& data) const;
+
+  VkDevice vk_device_ = VK_NULL_HANDLE;
+  VkPipelineCache vk_pipeline_cache_ = VK_NULL_HANDLE;
+  VkPhysicalDeviceProperties device_properties_;
+  std::string path_;
+  bool loaded_from_disk_ = false;
+};
+
+#endif /* VULKAN_PIPELINE_CACHE_H_ */
@@ -0,0 +1,1092 @@
+
+#include "VulkanRenderGraph.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanGpuProfiler.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+
+namespace {
+
+const VkAccessFlags kWriteAccess =
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+// Stand-ins for empty stage masks, which Vulkan does not accept.
+const VkPipelineStageFlags kTopOfPipe = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+const VkPipelineStageFlags kBottomOfPipe = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+bool IsDepthFormat(VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_D16_UNORM:
+    case VK_FORMAT_X8_D24_UNORM_PACK32:
+    case VK_FORMAT_D32_SFLOAT:
+    case VK_FORMAT_D16_UNORM_S8_UINT:
+    case VK_FORMAT_D24_UNORM_S8_UINT:
+    case VK_FORMAT_D32_SFLOAT_S8_UINT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool HasStencil(VkFormat format) {
+  return format == VK_FORMAT_D16_UNORM_S8_UINT ||
+         format == VK_FORMAT_D24_UNORM_S8_UINT ||
+         format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+VkImageAspectFlags AspectMask(VkFormat format) {
+  if (!IsDepthFormat(format))
+    return VK_IMAGE_ASPECT_COLOR_BIT;
+  VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+  if (HasStencil(format))
+    aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+  return aspect;
+}
+
+// Bytes per pixel, only to rank transient images by size before their
+// memory requirements are known.
+uint32_t FormatBytes(VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_R8_UNORM:
+    case VK_FORMAT_S8_UINT:
+      return 1;
+    case VK_FORMAT_D16_UNORM:
+      return 2;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+    case VK_FORMAT_R32G32_SFLOAT:
+    case VK_FORMAT_D32_SFLOAT_S8_UINT:
+      return 8;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+      return 16;
+    default:
+      return 4;
+  }
+}
+
+}  // namespace
+
+
+const uint32_t VulkanRenderGraph::kInvalidId;
+
+VulkanRenderGraph::VulkanRenderGraph() {}
+
+VulkanRenderGraph::~VulkanRenderGraph() {
+  DCHECK(!compiled_);
+  DCHECK(!has_resources_);
+}
+
+VulkanRenderGraph::ResourceId VulkanRenderGraph::ImportImage(
+    const std::string& name, const ImportedImage& image) {
+  InvalidateCompile();
+  Resource resource;
+  resource.name = name;
+  resource.imported = true;
+  resource.import = image;
+  resource.format = image.format;
+  resources_.push_back(resource);
+  return static_cast<ResourceId>(resources_.size() - 1);
+}
+
+VulkanRenderGraph::ResourceId VulkanRenderGraph::CreateImage(
+    const std::string& name, VkFormat format, VkSampleCountFlagBits samples) {
+  InvalidateCompile();
+  Resource resource;
+  resource.name = name;
+  resource.format = format;
+  resource.samples = samples;
+  resources_.push_back(resource);
+  return static_cast<ResourceId>(resources_.size() - 1);
+}
+
+VulkanRenderGraph::ResourceId VulkanRenderGraph::ImportBuffer(
+    const std::string& name) {
+  InvalidateCompile();
+  Resource resource;
+  resource.name = name;
+  resource.imported = true;
+  resource.buffer = true;
+  resources_.push_back(resource);
+  return static_cast<ResourceId>(resources_.size() - 1);
+}
+
+VulkanRenderGraph::PassId VulkanRenderGraph::AddPass(
+    const std::string& name, PassType type, const RecordFunction& record) {
+  InvalidateCompile();
+  Pass pass;
+  pass.name = name;
+  pass.type = type;
+  pass.record = record;
+  passes_.push_back(pass);
+  return static_cast<PassId>(passes_.size() - 1);
+}
+
+void VulkanRenderGraph::AddUse(PassId pass, const Use& use) {
+  DCHECK(pass < passes_.size());
+  DCHECK(use.resource < resources_.size());
+  InvalidateCompile();
+  // One use per image and pass; an image cannot be an attachment and be
+  // sampled in the same render pass.
+#if DCHECK_IS_ON()
+  for (const Use& other : passes_[pass].uses)
+    DCHECK_NE(other.resource, use.resource);
+#endif
+  passes_[pass].uses.push_back(use);
+}
+
+void VulkanRenderGraph::AddColorOutput(PassId pass, ResourceId image,
+                                       VkAttachmentLoadOp load_op,
+                                       VkClearColorValue clear) {
+  DCHECK_EQ(kGraphicsPass, passes_[pass].type);
+  Use use;
+  use.resource = image;
+  use.kind = kColorAttachment;
+  use.write = true;
+  use.load_op = load_op;
+  use.clear.color = clear;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::SetDepthStencilOutput(PassId pass, ResourceId image,
+                                              VkAttachmentLoadOp load_op,
+                                              VkClearDepthStencilValue clear) {
+  DCHECK_EQ(kGraphicsPass, passes_[pass].type);
+  DCHECK(IsDepthFormat(resources_[image].format));
+  Use use;
+  use.resource = image;
+  use.kind = kDepthStencilAttachment;
+  use.write = true;
+  use.load_op = load_op;
+  use.clear.depthStencil = clear;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::AddResolveOutput(PassId pass, ResourceId color,
+                                         ResourceId resolve) {
+  DCHECK_EQ(kGraphicsPass, passes_[pass].type);
+  DCHECK_NE(VK_SAMPLE_COUNT_1_BIT, resources_[color].samples);
+  DCHECK_EQ(VK_SAMPLE_COUNT_1_BIT, resources_[resolve].samples);
+  DCHECK_EQ(resources_[color].format, resources_[resolve].format);
+  Use use;
+  use.resource = resolve;
+  use.kind = kResolveAttachment;
+  use.write = true;
+  use.source = color;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::AddTextureInput(PassId pass, ResourceId image) {
+  Use use;
+  use.resource = image;
+  use.kind = kTexture;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::AddStorageImage(PassId pass, ResourceId image,
+                                        bool write) {
+  Use use;
+  use.resource = image;
+  use.kind = kStorage;
+  use.write = write;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::AddStorageBuffer(PassId pass, ResourceId buffer,
+                                         bool write) {
+  DCHECK(resources_[buffer].buffer);
+  Use use;
+  use.resource = buffer;
+  use.kind = kStorageBuffer;
+  use.write = write;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::AddVertexBuffer(PassId pass, ResourceId buffer) {
+  DCHECK_EQ(kGraphicsPass, passes_[pass].type);
+  DCHECK(resources_[buffer].buffer);
+  Use use;
+  use.resource = buffer;
+  use.kind = kVertexBuffer;
+  AddUse(pass, use);
+}
+
+void VulkanRenderGraph::SetSideEffects(PassId pass) {
+  InvalidateCompile();
+  passes_[pass].side_effects = true;
+}
+
+void VulkanRenderGraph::Reset() {
+  InvalidateCompile();
+  resources_.clear();
+  passes_.clear();
+  stats_ = Stats();
+}
+
+VkResult VulkanRenderGraph::Compile(VkDevice device) {
+  InvalidateCompile();
+  device_ = device;
+
+  CullPasses();
+  DeriveUses();
+  ComputeLifetimes();
+  AssignMemorySlots();
+  ComputeSynchronization();
+
+  compiled_ = true;
+  for (Pass& pass : passes_) {
+    if (pass.culled || kGraphicsPass != pass.type)
+      continue;
+    VkResult result = CreateRenderPass(&pass);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << "vkCreateRenderPass(" << pass.name
+                  << ") failed: " << result;
+      return result;
+    }
+  }
+  return VK_SUCCESS;
+}
+
+void VulkanRenderGraph::CullPasses() {
+  // Walking backwards, a pass survives if it writes something a later
+  // surviving pass (or the world outside the graph) reads. Imported images
+  // are always read afterwards.
+  std::vector<bool> needed(resources_.size(), false);
+  for (size_t i = 0; i < resources_.size(); ++i)
+    needed[i] = resources_[i].imported;
+
+  stats_.pass_count = static_cast<uint32_t>(passes_.size());
+  stats_.culled_pass_count = 0;
+  for (size_t i = passes_.size(); i-- > 0;) {
+    Pass& pass = passes_[i];
+    bool alive = pass.side_effects;
+    for (const Use& use : pass.uses) {
+      if (use.write && needed[use.resource])
+        alive = true;
+    }
+    pass.culled = !alive;
+    if (!alive) {
+      ++stats_.culled_pass_count;
+      DLOG(INFO) << "Render graph culls pass " << pass.name;
+      continue;
+    }
+    for (const Use& use : pass.uses) {
+      // An attachment that is not loaded is overwritten entirely, so
+      // whatever earlier passes wrote to it is dead unless someone in
+      // between reads it.
+      needed[use.resource] =
+          !use.attachment() || VK_ATTACHMENT_LOAD_OP_LOAD == use.load_op;
+    }
+  }
+}
+
+void VulkanRenderGraph::DeriveUses() {
+  for (Resource& resource : resources_)
+    resource.usage = 0;
+
+  for (Pass& pass : passes_) {
+    const VkPipelineStageFlags shader_stage =
+        kComputePass == pass.type ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                  : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    // Graphics passes may read buffers from the vertex shader as well.
+    const VkPipelineStageFlags buffer_stages =
+        kComputePass == pass.type ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                  : VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    for (Use& use : pass.uses) {
+      Resource& resource = resources_[use.resource];
+      switch (use.kind) {
+        case kColorAttachment:
+          use.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+          use.stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+          use.access = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+          if (VK_ATTACHMENT_LOAD_OP_LOAD == use.load_op)
+            use.access |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+          resource.usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+          break;
+        case kDepthStencilAttachment:
+          // The depth test reads whether or not the old content was loaded.
+          use.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+          use.stages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+          use.access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+          resource.usage |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+          break;
+        case kResolveAttachment:
+          // Resolves count as color attachment writes.
+          use.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+          use.stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+          use.access = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+          resource.usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+          break;
+        case kTexture:
+          use.layout = IsDepthFormat(resource.format)
+                           ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+                           : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+          use.stages = shader_stage;
+          use.access = VK_ACCESS_SHADER_READ_BIT;
+          resource.usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+          break;
+        case kStorage:
+          use.layout = VK_IMAGE_LAYOUT_GENERAL;
+          use.stages = shader_stage;
+          use.access = VK_ACCESS_SHADER_READ_BIT;
+          if (use.write)
+            use.access |= VK_ACCESS_SHADER_WRITE_BIT;
+          resource.usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+          break;
+        case kStorageBuffer:
+          use.stages = buffer_stages;
+          use.access = VK_ACCESS_SHADER_READ_BIT;
+          if (use.write)
+            use.access |= VK_ACCESS_SHADER_WRITE_BIT;
+          break;
+        case kVertexBuffer:
+          use.stages = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+          use.access = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+          break;
+      }
+      use.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+      use.final_layout = use.layout;
+    }
+  }
+}
+
+void VulkanRenderGraph::ComputeLifetimes() {
+  for (Resource& resource : resources_) {
+    resource.first_use = kInvalidId;
+    resource.last_use = kInvalidId;
+  }
+  for (uint32_t i = 0; i < passes_.size(); ++i) {
+    if (passes_[i].culled)
+      continue;
+    for (const Use& use : passes_[i].uses) {
+      Resource& resource = resources_[use.resource];
+      if (kInvalidId == resource.first_use)
+        resource.first_use = i;
+      resource.last_use = i;
+    }
+  }
+}
+
+void VulkanRenderGraph::AssignMemorySlots() {
+  // An attachment of a single pass that is not stored never has to leave
+  // tile memory, so it gets lazily allocated memory rather than a slot.
+  // TRANSIENT_ATTACHMENT usage rules out anything but attachment use.
+  std::vector<ResourceId> transients;
+  stats_.lazy_image_count = 0;
+  for (ResourceId id = 0; id < resources_.size(); ++id) {
+    Resource& resource = resources_[id];
+    resource.memory_slot = kInvalidId;
+    resource.lazy = false;
+    if (resource.imported || kInvalidId == resource.first_use)
+      continue;
+    if (resource.first_use == resource.last_use) {
+      resource.lazy = true;
+      for (const Use& use : passes_[resource.first_use].uses) {
+        if (use.resource == id && !use.attachment())
+          resource.lazy = false;
+      }
+    }
+    if (resource.lazy) {
+      resource.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+      ++stats_.lazy_image_count;
+      continue;
+    }
+    transients.push_back(id);
+  }
+
+  // Every transient image covers the whole extent, so bytes per pixel rank
+  // them by size. Greedy, largest first: an image joins the first slot none
+  // of whose images is alive at the same time.
+  std::stable_sort(transients.begin(), transients.end(),
+                   [this](ResourceId a, ResourceId b) {
+                     const Resource& ra = resources_[a];
+                     const Resource& rb = resources_[b];
+                     return FormatBytes(ra.format) * ra.samples >
+                            FormatBytes(rb.format) * rb.samples;
+                   });
+
+  std::vector<std::vector<ResourceId>> slots;
+  for (ResourceId id : transients) {
+    Resource& resource = resources_[id];
+    uint32_t slot = 0;
+    for (; slot < slots.size(); ++slot) {
+      bool overlaps = false;
+      for (ResourceId other_id : slots[slot]) {
+        const Resource& other = resources_[other_id];
+        if (resource.first_use <= other.last_use &&
+            other.first_use <= resource.last_use) {
+          overlaps = true;
+          break;
+        }
+      }
+      if (!overlaps)
+        break;
+    }
+    if (slot == slots.size())
+      slots.push_back(std::vector<ResourceId>());
+    slots[slot].push_back(id);
+    resource.memory_slot = slot;
+  }
+  memory_slots_.assign(slots.size(), VulkanAllocation());
+  stats_.transient_image_count = static_cast<uint32_t>(transients.size());
+}
+
+void VulkanRenderGraph::ComputeSynchronization() {
+  // Everything that touches a transient image's memory during a frame,
+  // per memory slot. The first use of an image waits for all of it: that
+  // covers both the previous image in the slot and the previous frame's use
+  // of the same memory. Lazy images and buffers are tracked on their own,
+  // in |frame|.
+  std::vector<VkPipelineStageFlags> slot_stages(memory_slots_.size(), 0);
+  std::vector<VkAccessFlags> slot_writes(memory_slots_.size(), 0);
+  std::vector<State> frame(resources_.size());
+  for (const Pass& pass : passes_) {
+    if (pass.culled)
+      continue;
+    for (const Use& use : pass.uses) {
+      const Resource& resource = resources_[use.resource];
+      if (use.write) {
+        frame[use.resource].write_stages |= use.stages;
+        frame[use.resource].write_access |= use.access & kWriteAccess;
+      } else {
+        frame[use.resource].read_stages |= use.stages;
+      }
+      if (kInvalidId != resource.memory_slot) {
+        slot_stages[resource.memory_slot] |= use.stages;
+        slot_writes[resource.memory_slot] |= use.access & kWriteAccess;
+      }
+    }
+  }
+
+  std::vector<State> states(resources_.size());
+  for (size_t i = 0; i < resources_.size(); ++i) {
+    const Resource& resource = resources_[i];
+    State& state = states[i];
+    if (resource.buffer) {
+      // The previous frame's accesses.
+      state = frame[i];
+    } else if (resource.imported) {
+      state.layout = resource.import.initial_layout;
+      // Whatever used the image before the frame is treated as a read: the
+      // first use still has to wait for it, but nothing needs to be made
+      // visible.
+      state.read_stages = resource.import.initial_stages;
+    } else if (resource.lazy) {
+      state.write_stages = frame[i].write_stages | frame[i].read_stages;
+      state.write_access = frame[i].write_access;
+    } else if (kInvalidId != resource.memory_slot) {
+      state.write_stages = slot_stages[resource.memory_slot];
+      state.write_access = slot_writes[resource.memory_slot];
+    }
+  }
+
+  for (uint32_t i = 0; i < passes_.size(); ++i) {
+    Pass& pass = passes_[i];
+    pass.barriers.clear();
+    pass.wait_src_stages = pass.wait_src_access = 0;
+    pass.wait_dst_stages = pass.wait_dst_access = 0;
+    pass.signal_src_stages = pass.signal_src_access = 0;
+    pass.signal_dst_stages = pass.signal_dst_access = 0;
+    if (pass.culled)
+      continue;
+
+    for (Use& use : pass.uses) {
+      const Resource& resource = resources_[use.resource];
+      State& state = states[use.resource];
+      const bool attachment = use.attachment();
+
+      const bool layout_change = state.layout != use.layout;
+      const bool read_after_write =
+          state.write_access && (use.stages & ~state.visible_stages);
+      const bool write_after_access =
+          use.write && (state.write_stages || state.read_stages);
+      const VkPipelineStageFlags src_stages =
+          state.write_stages | state.read_stages;
+
+      if (attachment) {
+        // The render pass performs the transition. Unless the old content
+        // is loaded it can be discarded, which is cheaper.
+        use.initial_layout = VK_ATTACHMENT_LOAD_OP_LOAD == use.load_op
+                                 ? state.layout
+                                 : VK_IMAGE_LAYOUT_UNDEFINED;
+      }
+
+      if (!layout_change && !read_after_write && !write_after_access) {
+        // Read after read in the same layout.
+      } else if (layout_change && !attachment) {
+        Barrier barrier;
+        barrier.resource = use.resource;
+        barrier.old_layout = state.layout;
+        barrier.new_layout = use.layout;
+        barrier.src_stages = src_stages;
+        barrier.src_access = state.write_access;
+        barrier.dst_stages = use.stages;
+        barrier.dst_access = use.access;
+        pass.barriers.push_back(barrier);
+      } else {
+        pass.wait_src_stages |= src_stages;
+        pass.wait_src_access |= state.write_access;
+        pass.wait_dst_stages |= use.stages;
+        pass.wait_dst_access |= use.access;
+      }
+
+      state.layout = use.layout;
+      if (use.write) {
+        state.write_stages = use.stages;
+        state.write_access = use.access & kWriteAccess;
+        state.visible_stages = 0;
+        state.read_stages = 0;
+      } else {
+        state.read_stages |= use.stages;
+        state.visible_stages |= use.stages;
+      }
+
+      // An imported attachment used for the last time leaves the render
+      // pass in its final layout, handed over by the pass itself.
+      if (attachment && resource.imported && resource.last_use == i) {
+        use.final_layout = resource.import.final_layout;
+        pass.signal_src_stages |= use.stages;
+        pass.signal_src_access |= use.access & kWriteAccess;
+        pass.signal_dst_stages |= resource.import.final_stages;
+        pass.signal_dst_access |= resource.import.final_access;
+        state.layout = use.final_layout;
+        state.write_stages = state.write_access = 0;
+        state.read_stages = 0;
+      }
+    }
+  }
+
+  final_barriers_.clear();
+  for (ResourceId id = 0; id < resources_.size(); ++id) {
+    const Resource& resource = resources_[id];
+    const State& state = states[id];
+    // Buffers are left to the next frame's first use.
+    if (!resource.imported || resource.buffer ||
+        (state.layout == resource.import.final_layout && !state.write_access))
+      continue;
+    Barrier barrier;
+    barrier.resource = id;
+    barrier.old_layout = state.layout;
+    barrier.new_layout = resource.import.final_layout;
+    barrier.src_stages = state.write_stages | state.read_stages;
+    barrier.src_access = state.write_access;
+    barrier.dst_stages = resource.import.final_stages;
+    barrier.dst_access = resource.import.final_access;
+    final_barriers_.push_back(barrier);
+  }
+
+  stats_.barrier_count = static_cast<uint32_t>(final_barriers_.size());
+  for (const Pass& pass : passes_) {
+    stats_.barrier_count += static_cast<uint32_t>(pass.barriers.size());
+    if (kComputePass == pass.type && pass.wait_dst_stages)
+      ++stats_.barrier_count;
+  }
+}
+
+std::vector<const VulkanRenderGraph::Use*> VulkanRenderGraph::AttachmentUses(
+    const Pass& pass) const {
+  std::vector<const Use*> uses;
+  const UseKind order[] = { kColorAttachment, kResolveAttachment,
+                            kDepthStencilAttachment };
+  for (UseKind kind : order) {
+    for (const Use& use : pass.uses) {
+      if (kind == use.kind)
+        uses.push_back(&use);
+    }
+  }
+  return uses;
+}
+
+VkResult VulkanRenderGraph::CreateRenderPass(Pass* pass) {
+  const uint32_t index = static_cast<uint32_t>(pass - passes_.data());
+  const std::vector<const Use*> uses = AttachmentUses(*pass);
+  std::vector<VkAttachmentDescription> attachments;
+  std::vector<VkAttachmentReference> color_refs;
+  std::vector<VkAttachmentReference> resolve_refs;
+  VkAttachmentReference depth_ref = {};
+  bool has_depth = false;
+  bool has_resolve = false;
+  pass->clear_values.clear();
+
+  for (const Use* use : uses) {
+    const Resource& resource = resources_[use->resource];
+    // Content nobody reads afterwards never has to leave the tile.
+    const bool keep = resource.imported || resource.last_use > index;
+
+    VkAttachmentDescription attachment = {};
+    attachment.format = resource.format;
+    attachment.samples = resource.samples;
+    attachment.loadOp = use->load_op;
+    attachment.storeOp = keep ? VK_ATTACHMENT_STORE_OP_STORE
+                              : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    if (HasStencil(resource.format)) {
+      attachment.stencilLoadOp = use->load_op;
+      attachment.stencilStoreOp = attachment.storeOp;
+    } else {
+      attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    }
+    attachment.initialLayout = use->initial_layout;
+    attachment.finalLayout = use->final_layout;
+
+    VkAttachmentReference ref = {};
+    ref.attachment = static_cast<uint32_t>(attachments.size());
+    ref.layout = use->layout;
+    switch (use->kind) {
+      case kColorAttachment:
+        color_refs.push_back(ref);
+        break;
+      case kResolveAttachment: {
+        // pResolveAttachments parallels pColorAttachments.
+        if (resolve_refs.empty()) {
+          VkAttachmentReference unused = {};
+          unused.attachment = VK_ATTACHMENT_UNUSED;
+          resolve_refs.assign(color_refs.size(), unused);
+        }
+        size_t color = 0;
+        while (color < color_refs.size() &&
+               uses[color]->resource != use->source)
+          ++color;
+        DCHECK(color < color_refs.size());
+        if (color < color_refs.size())
+          resolve_refs[color] = ref;
+        has_resolve = true;
+        break;
+      }
+      case kDepthStencilAttachment:
+        depth_ref = ref;
+        has_depth = true;
+        break;
+      default:
+        break;
+    }
+    attachments.push_back(attachment);
+    pass->clear_values.push_back(use->clear);
+  }
+
+  VkSubpassDescription subpass = {};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = static_cast<uint32_t>(color_refs.size());
+  subpass.pColorAttachments = color_refs.data();
+  subpass.pResolveAttachments = has_resolve ? resolve_refs.data() : nullptr;
+  subpass.pDepthStencilAttachment = has_depth ? &depth_ref : nullptr;
+
+  std::vector<VkSubpassDependency> dependencies;
+  if (pass->wait_dst_stages) {
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask =
+        pass->wait_src_stages ? pass->wait_src_stages : kTopOfPipe;
+    dependency.srcAccessMask = pass->wait_src_access;
+    dependency.dstStageMask = pass->wait_dst_stages;
+    dependency.dstAccessMask = pass->wait_dst_access;
+    dependencies.push_back(dependency);
+  }
+  if (pass->signal_src_stages) {
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = 0;
+    dependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.srcStageMask = pass->signal_src_stages;
+    dependency.srcAccessMask = pass->signal_src_access;
+    dependency.dstStageMask = pass->signal_dst_stages;
+    dependency.dstAccessMask = pass->signal_dst_access;
+    dependencies.push_back(dependency);
+  }
+
+  VkRenderPassCreateInfo create_info = {};
+  create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  create_info.attachmentCount = static_cast<uint32_t>(attachments.size());
+  create_info.pAttachments = attachments.data();
+  create_info.subpassCount = 1;
+  create_info.pSubpasses = &subpass;
+  create_info.dependencyCount = static_cast<uint32_t>(dependencies.size());
+  create_info.pDependencies = dependencies.data();
+
+  VkResult result =
+      vkCreateRenderPass(device_, &create_info, nullptr, &pass->render_pass);
+  if (VK_SUCCESS == result) {
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_RENDER_PASS, pass->render_pass,
+                  "%s", pass->name.c_str());
+  }
+  return result;
+}
+
+void VulkanRenderGraph::SetImportedImages(ResourceId image,
+                                          const std::vector<VkImage>& images,
+                                          const std::vector<VkImageView>& views) {
+  DCHECK(resources_[image].imported);
+  DCHECK_EQ(images.size(), views.size());
+  resources_[image].images = images;
+  resources_[image].views = views;
+}
+
+VkResult VulkanRenderGraph::CreateResources(VulkanMemoryAllocator* allocator,
+                                            VkExtent2D extent) {
+  DCHECK(compiled_);
+  DestroyResources();
+  allocator_ = allocator;
+  extent_ = extent;
+  has_resources_ = true;
+
+  VkResult result = VK_SUCCESS;
+  for (Resource& resource : resources_) {
+    if (resource.imported ||
+        (kInvalidId == resource.memory_slot && !resource.lazy))
+      continue;
+    result = CreateTransientImage(&resource);
+    if (VK_SUCCESS != result)
+      return result;
+  }
+
+  // One allocation per slot, large enough for its largest image. An image
+  // whose memory types rule out sharing gets memory of its own.
+  stats_.transient_bytes = stats_.unaliased_bytes = 0;
+  for (uint32_t slot = 0; slot < memory_slots_.size(); ++slot) {
+    VkMemoryRequirements slot_requirements = {};
+    slot_requirements.memoryTypeBits = ~0u;
+    std::vector<Resource*> members;
+    for (Resource& resource : resources_) {
+      if (resource.imported || resource.memory_slot != slot)
+        continue;
+      VkMemoryRequirements requirements;
+      vkGetImageMemoryRequirements(device_, resource.images[0], &requirements);
+      stats_.unaliased_bytes += requirements.size;
+      if (!(slot_requirements.memoryTypeBits & requirements.memoryTypeBits)) {
+        if (!allocator_->Allocate(requirements,
+                                  VulkanMemoryAllocator::kGpuOnly,
+                                  VulkanMemoryAllocator::kOptimalImage,
+                                  &resource.allocation))
+          return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        vkBindImageMemory(device_, resource.images[0],
+                          resource.allocation.memory,
+                          resource.allocation.offset);
+        stats_.transient_bytes += requirements.size;
+        continue;
+      }
+      slot_requirements.size = std::max(slot_requirements.size,
+                                         requirements.size);
+      slot_requirements.alignment = std::max(slot_requirements.alignment,
+                                              requirements.alignment);
+      slot_requirements.memoryTypeBits &= requirements.memoryTypeBits;
+      members.push_back(&resource);
+    }
+    if (members.empty())
+      continue;
+
+    VulkanAllocation& allocation = memory_slots_[slot];
+    if (!allocator_->Allocate(slot_requirements,
+                              VulkanMemoryAllocator::kGpuOnly,
+                              VulkanMemoryAllocator::kOptimalImage,
+                              &allocation))
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    stats_.transient_bytes += slot_requirements.size;
+    for (Resource* resource : members) {
+      vkBindImageMemory(device_, resource->images[0], allocation.memory,
+                        allocation.offset);
+    }
+  }
+
+  // Without a lazily allocated memory type this falls back to plain device
+  // memory, still one allocation per image.
+  for (Resource& resource : resources_) {
+    if (!resource.lazy)
+      continue;
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device_, resource.images[0], &requirements);
+    if (!allocator_->Allocate(requirements,
+                              VulkanMemoryAllocator::kGpuLazilyAllocated,
+                              VulkanMemoryAllocator::kOptimalImage,
+                              &resource.allocation))
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    vkBindImageMemory(device_, resource.images[0], resource.allocation.memory,
+                      resource.allocation.offset);
+  }
+
+  for (Resource& resource : resources_) {
+    if (resource.imported || resource.images.empty())
+      continue;
+    VkImageViewCreateInfo view_info = {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = resource.images[0];
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = resource.format;
+    view_info.subresourceRange.aspectMask = AspectMask(resource.format);
+    view_info.subresourceRange.levelCount = 1;
+    view_info.subresourceRange.layerCount = 1;
+    resource.views.resize(1);
+    result = vkCreateImageView(device_, &view_info, nullptr,
+                               &resource.views[0]);
+    if (VK_SUCCESS != result) {
+      resource.views.clear();
+      DLOG(ERROR) << "vkCreateImageView(" << resource.name
+                  << ") failed: " << result;
+      return result;
+    }
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_IMAGE_VIEW, resource.views[0], "%s",
+                  resource.name.c_str());
+  }
+
+  for (Pass& pass : passes_) {
+    if (pass.culled || kGraphicsPass != pass.type)
+      continue;
+    result = CreateFramebuffers(&pass);
+    if (VK_SUCCESS != result)
+      return result;
+  }
+
+  DLOG(INFO) << "Render graph: " << stats_.pass_count << " passes ("
+             << stats_.culled_pass_count << " culled), "
+             << stats_.barrier_count << " barriers, "
+             << stats_.transient_image_count << " transient images in "
+             << stats_.transient_bytes << " bytes (" << stats_.unaliased_bytes
+             << " unaliased), " << stats_.lazy_image_count << " lazy images";
+  return VK_SUCCESS;
+}
+
+VkResult VulkanRenderGraph::CreateTransientImage(Resource* resource) {
+  VkImageCreateInfo image_info = {};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = resource->format;
+  image_info.extent = { extent_.width, extent_.height, 1 };
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = resource->samples;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = resource->usage;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  resource->images.resize(1);
+  VkResult result =
+      vkCreateImage(device_, &image_info, nullptr, &resource->images[0]);
+  if (VK_SUCCESS != result) {
+    resource->images.clear();
+    DLOG(ERROR) << "vkCreateImage(" << resource->name << ") failed: "
+                << result;
+    return result;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_IMAGE, resource->images[0], "%s",
+                resource->name.c_str());
+  return VK_SUCCESS;
+}
+
+VkResult VulkanRenderGraph::CreateFramebuffers(Pass* pass) {
+  // A pass drawing into an imported image needs a framebuffer per image.
+  size_t count = 1;
+  for (const Use& use : pass->uses) {
+    const Resource& resource = resources_[use.resource];
+    if (use.attachment() && resource.imported)
+      count = std::max(count, resource.views.size());
+  }
+
+  pass->framebuffers.assign(count, VK_NULL_HANDLE);
+  for (size_t i = 0; i < count; ++i) {
+    std::vector<VkImageView> views;
+    for (const Use* use : AttachmentUses(*pass)) {
+      const Resource& resource = resources_[use->resource];
+      DCHECK(!resource.views.empty());
+      views.push_back(resource.views[std::min(i, resource.views.size() - 1)]);
+    }
+
+    VkFramebufferCreateInfo framebuffer_info = {};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = pass->render_pass;
+    framebuffer_info.attachmentCount = static_cast<uint32_t>(views.size());
+    framebuffer_info.pAttachments = views.data();
+    framebuffer_info.width = extent_.width;
+    framebuffer_info.height = extent_.height;
+    framebuffer_info.layers = 1;
+
+    VkResult result = vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
+                                          &pass->framebuffers[i]);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << "vkCreateFramebuffer(" << pass->name
+                  << ") failed: " << result;
+      return result;
+    }
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_FRAMEBUFFER, pass->framebuffers[i],
+                  "%s %zu", pass->name.c_str(), i);
+  }
+  return VK_SUCCESS;
+}
+
+void VulkanRenderGraph::DestroyResources() {
+  if (!has_resources_)
+    return;
+  for (Pass& pass : passes_) {
+    for (VkFramebuffer framebuffer : pass.framebuffers)
+      vkDestroyFramebuffer(device_, framebuffer, nullptr);
+    pass.framebuffers.clear();
+  }
+  for (Resource& resource : resources_) {
+    // Imported images and views belong to the caller.
+    if (resource.imported)
+      continue;
+    for (VkImageView view : resource.views)
+      vkDestroyImageView(device_, view, nullptr);
+    for (VkImage image : resource.images)
+      vkDestroyImage(device_, image, nullptr);
+    resource.views.clear();
+    resource.images.clear();
+    if (VK_NULL_HANDLE != resource.allocation.memory)
+      allocator_->Free(&resource.allocation);
+  }
+  for (VulkanAllocation& allocation : memory_slots_) {
+    if (VK_NULL_HANDLE != allocation.memory)
+      allocator_->Free(&allocation);
+    allocation = VulkanAllocation();
+  }
+  has_resources_ = false;
+}
+
+void VulkanRenderGraph::DestroyRenderPasses() {
+  for (Pass& pass : passes_) {
+    if (VK_NULL_HANDLE != pass.render_pass)
+      vkDestroyRenderPass(device_, pass.render_pass, nullptr);
+    pass.render_pass = VK_NULL_HANDLE;
+  }
+}
+
+void VulkanRenderGraph::InvalidateCompile() {
+  DestroyResources();
+  DestroyRenderPasses();
+  compiled_ = false;
+}
+
+void VulkanRenderGraph::SetSubpassContents(PassId pass,
+                                           VkSubpassContents contents) {
+  passes_[pass].contents = contents;
+}
+
+void VulkanRenderGraph::Execute(VkCommandBuffer command_buffer,
+                                uint32_t image_index,
+                                VulkanGpuProfiler* profiler) {
+  DCHECK(compiled_);
+  DCHECK(has_resources_);
+  for (const Pass& pass : passes_) {
+    if (pass.culled)
+      continue;
+    // Profiler scopes double as debug labels.
+    if (profiler) {
+      GpuProfileScope scope(*profiler, command_buffer, pass.name.c_str());
+      RecordPass(command_buffer, image_index, pass);
+    } else {
+      VulkanDebugLabel label(command_buffer, pass.name.c_str());
+      RecordPass(command_buffer, image_index, pass);
+    }
+  }
+  RecordBarriers(command_buffer, image_index, final_barriers_, 0, 0, 0, 0);
+}
+
+void VulkanRenderGraph::RecordPass(VkCommandBuffer command_buffer,
+                                   uint32_t image_index,
+                                   const Pass& pass) const {
+  PassContext context;
+  context.command_buffer = command_buffer;
+  context.image_index = image_index;
+  context.extent = extent_;
+  context.contents = pass.contents;
+
+  if (kComputePass == pass.type) {
+    RecordBarriers(command_buffer, image_index, pass.barriers,
+                   pass.wait_src_stages, pass.wait_src_access,
+                   pass.wait_dst_stages, pass.wait_dst_access);
+    pass.record(context);
+    return;
+  }
+
+  // Everything else is in the render pass's dependencies.
+  RecordBarriers(command_buffer, image_index, pass.barriers, 0, 0, 0, 0);
+
+  context.render_pass = pass.render_pass;
+  context.framebuffer = framebuffer(
+      static_cast<PassId>(&pass - passes_.data()), image_index);
+
+  VkRenderPassBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  begin_info.renderPass = context.render_pass;
+  begin_info.framebuffer = context.framebuffer;
+  begin_info.renderArea.offset = { 0, 0 };
+  begin_info.renderArea.extent = extent_;
+  begin_info.clearValueCount = static_cast<uint32_t>(pass.clear_values.size());
+  begin_info.pClearValues = pass.clear_values.data();
+
+  vkCmdBeginRenderPass(command_buffer, &begin_info, pass.contents);
+  pass.record(context);
+  vkCmdEndRenderPass(command_buffer);
+}
+
+void VulkanRenderGraph::RecordBarriers(
+    VkCommandBuffer command_buffer, uint32_t image_index,
+    const std::vector<Barrier>& barriers,
+    VkPipelineStageFlags memory_src_stages, VkAccessFlags memory_src_access,
+    VkPipelineStageFlags memory_dst_stages,
+    VkAccessFlags memory_dst_access) const {
+  if (barriers.empty() && !memory_dst_stages)
+    return;
+
+  // One call for the whole batch.
+  VkPipelineStageFlags src_stages = memory_src_stages;
+  VkPipelineStageFlags dst_stages = memory_dst_stages;
+  std::vector<VkImageMemoryBarrier> image_barriers;
+  image_barriers.reserve(barriers.size());
+  for (const Barrier& barrier : barriers) {
+    const Resource& resource = resources_[barrier.resource];
+    VkImageMemoryBarrier image_barrier = {};
+    image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barrier.srcAccessMask = barrier.src_access;
+    image_barrier.dstAccessMask = barrier.dst_access;
+    image_barrier.oldLayout = barrier.old_layout;
+    image_barrier.newLayout = barrier.new_layout;
+    image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.image = GetImage(resource, image_index);
+    image_barrier.subresourceRange.aspectMask = AspectMask(resource.format);
+    image_barrier.subresourceRange.levelCount = 1;
+    image_barrier.subresourceRange.layerCount = 1;
+    image_barriers.push_back(image_barrier);
+    src_stages |= barrier.src_stages;
+    dst_stages |= barrier.dst_stages;
+  }
+
+  VkMemoryBarrier memory_barrier = {};
+  memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  memory_barrier.srcAccessMask = memory_src_access;
+  memory_barrier.dstAccessMask = memory_dst_access;
+  const uint32_t memory_barrier_count = memory_dst_stages ? 1 : 0;
+
+  vkCmdPipelineBarrier(
+      command_buffer,
+      src_stages ? src_stages : kTopOfPipe,
+      dst_stages ? dst_stages : kBottomOfPipe, 0,
+      memory_barrier_count, &memory_barrier, 0, nullptr,
+      static_cast<uint32_t>(image_barriers.size()), image_barriers.data());
+}
+
+VkImage VulkanRenderGraph::GetImage(const Resource& resource,
+                                    uint32_t image_index) const {
+  DCHECK(!resource.images.empty());
+  return resource.images[std::min<size_t>(image_index,
+                                          resource.images.size() - 1)];
+}
+
+VkRenderPass VulkanRenderGraph::render_pass(PassId pass) const {
+  return passes_[pass].render_pass;
+}
+
+VkFramebuffer VulkanRenderGraph::framebuffer(PassId pass,
+                                             uint32_t image_index) const {
+  const std::vector<VkFramebuffer>& framebuffers = passes_[pass].framebuffers;
+  if (framebuffers.empty())
+    return VK_NULL_HANDLE;
+  return framebuffers[std::min<size_t>(image_index, framebuffers.size() - 1)];
+}
+
+bool VulkanRenderGraph::culled(PassId pass) const {
+  return passes_[pass].culled;
+}
@@ -0,0 +1,297 @@
+#ifndef VULKAN_RENDER_GRAPH_H_
+#define VULKAN_RENDER_GRAPH_H_
+
+#include <vulkan/vulkan.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "VulkanMemoryAllocator.h"
+
+class VulkanGpuProfiler;
+
+// Describes a frame as a list of passes that declare the images and buffers
+// they read and write, and derives the synchronization from those
+// declarations.
+//
+// Compile() works from the declarations alone:
+//  - passes that contribute nothing to an imported image are culled;
+//  - every graphics pass gets a render pass whose attachment layouts carry
+//    the layout transitions, whose load/store ops drop content nobody reads
+//    and whose external subpass dependency orders it after the previous
+//    users of its images;
+//  - explicit barriers remain only where an image is used outside of an
+//    attachment (sampled or storage) in a new layout, batched per pass;
+//    buffer hazards fold into the same dependencies;
+//  - transient images whose lifetimes do not overlap are assigned the same
+//    memory;
+//  - transient images that live inside a single render pass and are never
+//    stored, e.g. multisampled color resolved at the end of the pass, get
+//    TRANSIENT_ATTACHMENT usage and lazily allocated memory instead, which
+//    tiled GPUs never commit.
+//
+// CreateResources() creates what depends on the extent, i.e. the transient
+// images, their memory and the framebuffers; a resize only redoes that
+// part. Execute() records the compiled frame.
+//
+// Declaration order is execution order. All transient images cover the
+// graph's extent.
+class VulkanRenderGraph
+{
+public:
+  typedef uint32_t ResourceId;
+  typedef uint32_t PassId;
+  static const uint32_t kInvalidId = UINT32_MAX;
+
+  enum PassType {
+    kGraphicsPass,
+    kComputePass,
+  };
+
+  // An image owned outside the graph, e.g. the swapchain images. There may
+  // be one per image index; Execute() picks the one it is given.
+  struct ImportedImage {
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    // State at the start of the frame. For a swapchain image the stage is
+    // the one the acquire semaphore waits at.
+    VkImageLayout initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags initial_stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    // State to leave the image in for whoever uses it after the frame.
+    VkImageLayout final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags final_stages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    VkAccessFlags final_access = 0;
+  };
+
+  // What a pass's record function gets. |render_pass| and |framebuffer| are
+  // null for compute passes.
+  struct PassContext {
+    VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+    uint32_t image_index = 0;
+    VkRenderPass render_pass = VK_NULL_HANDLE;
+    VkFramebuffer framebuffer = VK_NULL_HANDLE;
+    uint32_t subpass = 0;
+    VkExtent2D extent = { 0, 0 };
+    VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE;
+  };
+  typedef std::function<void(const PassContext&)> RecordFunction;
+
+  struct Stats {
+    uint32_t pass_count = 0;
+    uint32_t culled_pass_count = 0;
+    // Explicit barriers recorded per frame, not counting render pass
+    // dependencies.
+    uint32_t barrier_count = 0;
+    uint32_t transient_image_count = 0;
+    uint32_t lazy_image_count = 0;
+    // Memory the transient images occupy, and what they would without
+    // aliasing.
+    // Lazy images are not counted.
+    VkDeviceSize transient_bytes = 0;
+    VkDeviceSize unaliased_bytes = 0;
+  };
+
+  VulkanRenderGraph();
+  ~VulkanRenderGraph();
+
+  // Declaration. Invalidates anything compiled.
+  ResourceId ImportImage(const std::string& name, const ImportedImage& image);
+  ResourceId CreateImage(const std::string& name, VkFormat format,
+                         VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+  // A buffer owned outside the graph that every frame uses the same way.
+  // The graph orders the accesses to it, including the next frame's after
+  // this one's, and never needs the handle.
+  ResourceId ImportBuffer(const std::string& name);
+  PassId AddPass(const std::string& name, PassType type,
+                 const RecordFunction& record);
+
+  // Attachments of a graphics pass, in attachment order.
+  void AddColorOutput(PassId pass, ResourceId image,
+                      VkAttachmentLoadOp load_op = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                      VkClearColorValue clear = VkClearColorValue());
+  void SetDepthStencilOutput(
+      PassId pass, ResourceId image,
+      VkAttachmentLoadOp load_op = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      VkClearDepthStencilValue clear = { 1.0f, 0 });
+  // Resolves the multisampled color output |color| of |pass| into the
+  // single-sampled |resolve| at the end of the pass.
+  void AddResolveOutput(PassId pass, ResourceId color, ResourceId resolve);
+  // Sampled by the pass's shaders.
+  void AddTextureInput(PassId pass, ResourceId image);
+  // Accessed as a storage image, typically by a compute pass.
+  void AddStorageImage(PassId pass, ResourceId image, bool write);
+  // Accessed by the pass's shaders as a storage buffer.
+  void AddStorageBuffer(PassId pass, ResourceId buffer, bool write);
+  // Fetched by a graphics pass's vertex input, e.g. per-instance data.
+  void AddVertexBuffer(PassId pass, ResourceId buffer);
+  // Keeps a pass that writes nothing the graph can see, e.g. one that only
+  // writes buffers, from being culled.
+  void SetSideEffects(PassId pass);
+
+  // Drops the declarations along with everything created from them.
+  void Reset();
+
+  VkResult Compile(VkDevice device);
+  // |images| and |views| are indexed by the image index given to Execute().
+  void SetImportedImages(ResourceId image, const std::vector<VkImage>& images,
+                         const std::vector<VkImageView>& views);
+  VkResult CreateResources(VulkanMemoryAllocator* allocator, VkExtent2D extent);
+  void DestroyResources();
+
+  // Per-frame choice, made before Execute(): SECONDARY_COMMAND_BUFFERS when
+  // the pass records its draws into secondaries.
+  void SetSubpassContents(PassId pass, VkSubpassContents contents);
+
+  // Records every pass that survived culling into |command_buffer|. With a
+  // |profiler| each pass is also a profiler scope under its name.
+  void Execute(VkCommandBuffer command_buffer, uint32_t image_index,
+               VulkanGpuProfiler* profiler = nullptr);
+
+  VkRenderPass render_pass(PassId pass) const;
+  VkFramebuffer framebuffer(PassId pass, uint32_t image_index) const;
+  bool culled(PassId pass) const;
+  const Stats& stats() const { return stats_; }
+
+private:
+  enum UseKind {
+    kColorAttachment,
+    kDepthStencilAttachment,
+    kResolveAttachment,
+    kTexture,
+    kStorage,
+    kStorageBuffer,
+    kVertexBuffer,
+  };
+
+  struct Use {
+    ResourceId resource = kInvalidId;
+    UseKind kind = kTexture;
+    bool write = false;
+    VkAttachmentLoadOp load_op = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    VkClearValue clear;
+    // For kResolveAttachment, the color output resolved into it.
+    ResourceId source = kInvalidId;
+    // Derived by Compile(). Attachments enter and leave the render pass in
+    // |initial_layout| and |final_layout|.
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags stages = 0;
+    VkAccessFlags access = 0;
+    VkImageLayout initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImageLayout final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    bool attachment() const {
+      return kColorAttachment == kind || kDepthStencilAttachment == kind ||
+             kResolveAttachment == kind;
+    }
+  };
+
+  struct Resource {
+    std::string name;
+    bool imported = false;
+    // Buffers are always imported and have no layout.
+    bool buffer = false;
+    ImportedImage import;
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+    // Union of every use, for creating transient images.
+    VkImageUsageFlags usage = 0;
+    // Passes (indices into passes_) of the first and last surviving use.
+    uint32_t first_use = kInvalidId;
+    uint32_t last_use = kInvalidId;
+    // Transient images sharing a memory slot alias each other.
+    uint32_t memory_slot = kInvalidId;
+    // Lives in lazily allocated memory of its own instead of a slot.
+    bool lazy = false;
+    std::vector<VkImage> images;
+    std::vector<VkImageView> views;
+    VulkanAllocation allocation;
+  };
+
+  struct Barrier {
+    ResourceId resource = kInvalidId;
+    VkImageLayout old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImageLayout new_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags src_stages = 0;
+    VkAccessFlags src_access = 0;
+    VkPipelineStageFlags dst_stages = 0;
+    VkAccessFlags dst_access = 0;
+  };
+
+  struct Pass {
+    std::string name;
+    PassType type = kGraphicsPass;
+    RecordFunction record;
+    std::vector<Use> uses;
+    bool side_effects = false;
+    bool culled = false;
+    VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE;
+    // Derived by Compile(). |barriers| are layout transitions recorded
+    // before the pass. Everything else the pass waits for is merged into
+    // one dependency: the external subpass dependency of a graphics pass,
+    // a global memory barrier before a compute pass.
+    std::vector<Barrier> barriers;
+    VkPipelineStageFlags wait_src_stages = 0;
+    VkAccessFlags wait_src_access = 0;
+    VkPipelineStageFlags wait_dst_stages = 0;
+    VkAccessFlags wait_dst_access = 0;
+    // Hands imported attachments over to their final users.
+    VkPipelineStageFlags signal_src_stages = 0;
+    VkAccessFlags signal_src_access = 0;
+    VkPipelineStageFlags signal_dst_stages = 0;
+    VkAccessFlags signal_dst_access = 0;
+    VkRenderPass render_pass = VK_NULL_HANDLE;
+    std::vector<VkClearValue> clear_values;
+    // One per image index when an attachment is imported, else one.
+    std::vector<VkFramebuffer> framebuffers;
+  };
+
+  // Synchronization state of a resource while Compile() walks the passes.
+  struct State {
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags write_stages = 0;
+    VkAccessFlags write_access = 0;
+    // Stages the last write has been made visible to.
+    VkPipelineStageFlags visible_stages = 0;
+    // Stages that read since the last write.
+    VkPipelineStageFlags read_stages = 0;
+  };
+
+  void AddUse(PassId pass, const Use& use);
+  void CullPasses();
+  void DeriveUses();
+  void ComputeLifetimes();
+  void AssignMemorySlots();
+  void ComputeSynchronization();
+  // Color outputs, resolve outputs, depth.
+  std::vector<const Use*> AttachmentUses(const Pass& pass) const;
+  VkResult CreateRenderPass(Pass* pass);
+  VkResult CreateFramebuffers(Pass* pass);
+  VkResult CreateTransientImage(Resource* resource);
+  VkImage GetImage(const Resource& resource, uint32_t image_index) const;
+  void RecordPass(VkCommandBuffer command_buffer, uint32_t image_index,
+                  const Pass& pass) const;
+  void RecordBarriers(VkCommandBuffer command_buffer, uint32_t image_index,
+                      const std::vector<Barrier>& barriers,
+                      VkPipelineStageFlags memory_src_stages,
+                      VkAccessFlags memory_src_access,
+                      VkPipelineStageFlags memory_dst_stages,
+                      VkAccessFlags memory_dst_access) const;
+  void DestroyRenderPasses();
+  void InvalidateCompile();
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VulkanMemoryAllocator* allocator_ = nullptr;
+  VkExtent2D extent_ = { 0, 0 };
+  bool compiled_ = false;
+  bool has_resources_ = false;
+
+  std::vector<Resource> resources_;
+  std::vector<Pass> passes_;
+  // Transitions of imported images into their final layouts, after the last
+  // pass.
+  std::vector<Barrier> final_barriers_;
+  std::vector<VulkanAllocation> memory_slots_;
+  Stats stats_;
+};
+
+#endif /* VULKAN_RENDER_GRAPH_H_ */
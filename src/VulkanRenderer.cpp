@@ -1,61 +1,195 @@
 
 #include "VulkanRenderer.h"
+#include "VulkanDebugUtils.h"
 #include "VulkanInstance.h"
 
-#include <iostream>
-#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 
-static std::vector<char> ReadAllBytes(char const* filename);
+namespace {
 
+struct Vertex {
+    float pos[2];
+    float color[3];
+};
 
-VulkanRenderer::VulkanRenderer(GLFWwindow* window)
+}  // namespace
+
+
+VulkanRenderer::VulkanRenderer(GLFWwindow* window, uint32_t framesInFlight)
     : mWindow(window) {
+  if (framesInFlight < 1)
+    framesInFlight = 1;
+  if (framesInFlight > kMaxFramesInFlight)
+    framesInFlight = kMaxFramesInFlight;
+  mFrames.resize(framesInFlight);
+  setInstanceCount(1);
+
+  const char* cache_path = getenv("WD_PIPELINE_CACHE");
+  mPipelineCachePath = cache_path ? cache_path : "pipeline_cache.bin";
+
+  const char* shader_pack = getenv("WD_SHADER_PACK");
+  if (shader_pack)
+    mShaderPackPath = shader_pack;
+
+  const char* device_selector = getenv("WD_DEVICE");
+  if (device_selector)
+    device_queue_.SetDeviceSelector(device_selector);
 }
 
 
-bool VulkanRenderer::Init() {
-  if (!createInstance()) {
-    DLOG(ERROR) << "Failed to create Vulkan instance";
-    return false;
-  }
+VulkanRenderer::VulkanRenderer(uint32_t width, uint32_t height, uint32_t framesInFlight)
+    : VulkanRenderer(nullptr, framesInFlight) {
+  mBackend = kHeadlessBackend;
+  mSwapchainExtent.width = width;
+  mSwapchainExtent.height = height;
+}
 
-  createSurface();
 
-  device_queue_.Initialize(VulkanDeviceQueue::GRAPHICS_QUEUE_FLAG |
-                           VulkanDeviceQueue::PRESENTATION_SUPPORT_QUEUE_FLAG);
+bool VulkanRenderer::Init() {
+  mStartupTrace.Start();
+  const bool ok = initPhases();
+  LOG(INFO) << mStartupTrace.Finish();
+  return ok;
+}
 
-  selectPhysicalDevice();
 
-  createLogicalDevice();
+bool VulkanRenderer::initPhases() {
+  // Failures without a VkResult of their own report the generic one.
+  const VkResult kFailed = VK_ERROR_INITIALIZATION_FAILED;
+  VulkanStartupTrace& trace = mStartupTrace;
 
-  createSwapchain();
+  if (!trace.RunPhase("instance", [&] {
+        return createInstance() ? VK_SUCCESS : kFailed;
+      }))
+    return false;
 
-  createImageViews();
+  // No async compute queue: compute work runs on the graphics queue (see
+  // VulkanParticleSystem).
+  uint32_t queue_options = VulkanDeviceQueue::GRAPHICS_QUEUE_FLAG |
+                           VulkanDeviceQueue::TRANSFER_QUEUE_FLAG |
+                           VulkanDeviceQueue::DESCRIPTOR_INDEXING_FLAG;
+  if (mBackend == kWindowBackend) {
+    if (!trace.RunPhase("surface", [&] { return createSurface(); }))
+      return false;
+    glfwSetWindowUserPointer(mWindow, this);
+    glfwSetFramebufferSizeCallback(mWindow, &VulkanRenderer::onFramebufferResized);
+    queue_options |= VulkanDeviceQueue::PRESENTATION_SUPPORT_QUEUE_FLAG;
+  }
 
-  createRenderPass();
+  if (!trace.RunPhase("device", [&]() -> VkResult {
+        if (!device_queue_.Initialize(queue_options))
+          return kFailed;
+        selectPhysicalDevice();
+        createLogicalDevice();
+        return VK_SUCCESS;
+      }))
+    return false;
 
-  createFrameBuffer();
+  if (!trace.RunPhase("allocator", [&]() -> VkResult {
+        if (!mMemoryAllocator.Initialize(mGpu, mDevice))
+          return kFailed;
+        mUploader.SetTransferQueue(mTransferQueueFamilyIndex, mTransferQueue);
+        if (!mUploader.Initialize(mDevice, &mMemoryAllocator,
+                                  mGraphicsQueueFamilyIndex, mGraphicsQueue,
+                                  VulkanUploader::kDefaultRingSize,
+                                  framesInFlight() + 1))
+          return kFailed;
+        return VK_SUCCESS;
+      }))
+    return false;
 
-  createCommandPool();
+  if (!trace.RunPhase("pipeline_cache", [&]() -> VkResult {
+        if (!mPipelineCache.Initialize(mGpu, mDevice, mPipelineCachePath) ||
+            !mPipelineBuilder.Initialize(mDevice, mPipelineCache.GetVulkanPipelineCache()))
+          return kFailed;
+        return VK_SUCCESS;
+      }))
+    return false;
 
-  createCommandBuffers();
+  if (mBackend == kHeadlessBackend) {
+    if (!trace.RunPhase("offscreen_images", [&] { return createOffscreenImages(); }))
+      return false;
+  } else {
+    if (!trace.RunPhase("swapchain", [&] { return createSwapchain(); }))
+      return false;
+  }
 
-  createGraphicsPipeline();
+  if (!trace.RunPhase("image_views", [&] { return createImageViews(); }) ||
+      !trace.RunPhase("render_pass", [&] { return createRenderPass(); }) ||
+      !trace.RunPhase("framebuffers", [&] { return createFrameBuffer(); }) ||
+      // Before the shaders, which depend on whether it is there.
+      !trace.RunPhase("bindless_table", [&] { return createBindlessTable(); }) ||
+      !trace.RunPhase("shaders", [&] { return createShaderModules(); }) ||
+      !trace.RunPhase("descriptor_set_layout", [&] { return createDescriptorSetLayout(); }) ||
+      !trace.RunPhase("pipeline_layout", [&] { return createPipelineLayout(); }) ||
+      !trace.RunPhase("meshes", [&] { return createMeshes(); }) ||
+      // Only queues the compile; the first frame waits for it.
+      !trace.RunPhase("pipeline", [&] { return createGraphicsPipeline(); }) ||
+      !trace.RunPhase("particles", [&] { return createParticles(); }) ||
+      // Only queues the decodes; textures show up as they stream in.
+      !trace.RunPhase("textures", [&] { return createTextures(); }) ||
+      !trace.RunPhase("frame_contexts", [&] { return createFrameContexts(); }) ||
+      !trace.RunPhase("descriptor_sets", [&] { return createDescriptorSets(); }))
+    return false;
 
-  recordCommandBuffer();
+  if (!trace.RunPhase("recorder", [&] {
+        return mRecorder.Initialize(mDevice, mGraphicsQueueFamilyIndex,
+                                    framesInFlight())
+                   ? VK_SUCCESS
+                   : kFailed;
+      }))
+    return false;
 
-  createSemaphores();
+  // Without timestamp support the profiler just stays disabled.
+  trace.RunPhase("gpu_profiler", [&] {
+    mGpuProfiler.Initialize(mGpu, mDevice, mGraphicsQueueFamilyIndex,
+                            framesInFlight());
+    return VK_SUCCESS;
+  });
 
   return true;
 }
 
 
 VulkanRenderer::~VulkanRenderer() {
-    destroySemaphores();
+    if (mDevice != VK_NULL_HANDLE)
+        vkDeviceWaitIdle(mDevice);
+
+    if (!mGpuProfileCsvPath.empty() && mGpuProfiler.enabled()) {
+        mGpuProfiler.Flush();
+        mGpuProfiler.WriteCsv(mGpuProfileCsvPath);
+    }
+    mGpuProfiler.Destroy();
+
+    mRecorder.Destroy();
+
+    destroyDescriptorSets();
+
+    destroyFrameContexts();
 
     destroyGraphicsPipeline();
 
-    destroyCommandPool();
+    destroyParticles();
+
+    destroyTextures();
+
+    destroyMeshes();
+
+    mPipelineBuilder.Destroy();
+
+    destroyPipelineLayout();
+
+    destroyBindlessTable();
+
+    destroyDescriptorSetLayout();
+
+    destroyShaderModules();
+
+    mPipelineCache.Destroy();
 
     destroyFrameBuffer();
 
@@ -63,7 +197,14 @@ VulkanRenderer::~VulkanRenderer() {
 
     destroyImageViews();
 
-    destroySwapchain();
+    if (mBackend == kHeadlessBackend)
+        destroyOffscreenImages();
+    else
+        destroySwapchain();
+
+    mUploader.Destroy();
+
+    mMemoryAllocator.Destroy();
 
     destroyLogicalDevice();
 
@@ -73,25 +214,102 @@ VulkanRenderer::~VulkanRenderer() {
 }
 
 
-void VulkanRenderer::render() {
+double VulkanRenderer::waitForFrameSlot() {
+    auto start = std::chrono::steady_clock::now();
+    vkWaitForFences(mDevice, 1, &mFrames[mCurrentFrame].mInFlightFence, VK_TRUE, UINT64_MAX);
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+bool VulkanRenderer::render() {
+    // A zero-sized (minimized) window has no swapchain to render into; keep
+    // the rebuild pending until it comes back.
+    if (mSwapchainDirty && !recreateSwapchain())
+        return false;
+
+    FrameContext& frame = mFrames[mCurrentFrame];
+
+    // The only CPU stall in the loop: wait until the GPU has retired the
+    // work this slot submitted framesInFlight() frames ago.
+    vkWaitForFences(mDevice, 1, &frame.mInFlightFence, VK_TRUE, UINT64_MAX);
+    if (mBindlessEnabled)
+        mBindlessTable.BeginFrame(mCurrentFrame);
+
     uint32_t image_idx;
-    vkAcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX, mSemaphoreImageAvailable, VK_NULL_HANDLE, &image_idx);
+    if (mBackend == kHeadlessBackend) {
+        // Every slot owns one offscreen image, and the fence above already
+        // proved the GPU is done with it.
+        image_idx = mCurrentFrame;
+    } else {
+        VkResult result = vkAcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX,
+                                                frame.mImageAvailable, VK_NULL_HANDLE, &image_idx);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            // Nothing was acquired and the slot's fence is still signaled, so
+            // the frame can simply be retried on the new swapchain.
+            mSwapchainDirty = true;
+            return false;
+        }
+        if (result == VK_SUBOPTIMAL_KHR)
+            mSwapchainDirty = true;
+        else if (result != VK_SUCCESS) {
+            DLOG(ERROR) << "vkAcquireNextImageKHR() failed: " << result;
+            return false;
+        }
+    }
+
+    vkResetFences(mDevice, 1, &frame.mInFlightFence);
 
-    VkSemaphore wait_semaphores[] = { mSemaphoreImageAvailable };
-    VkSemaphore signal_semaphores[] = { mSemaphoreRenderFinished };
+    // After the acquire, so a retried frame does not release the slot's
+    // textures twice. New handles are baked into the instance data.
+    if (!mTextures.empty()) {
+        for (VulkanTextureStreamer::TextureId texture : mTextures)
+            mTextureStreamer.Touch(texture);
+        if (mTextureStreamer.Update(mCurrentFrame))
+            markSceneDirty();
+    }
+
+    VkCommandBuffer command_buffer = prepareCommandBuffer(image_idx);
+
+    if (mParticleCount > 0) {
+        auto now = std::chrono::steady_clock::now();
+        mParticles.Update(mCurrentFrame, std::chrono::duration<float>(now - mLastFrameTime).count());
+        mLastFrameTime = now;
+    }
+
+    // Everything staged since the last frame goes out in one submission
+    // ahead of the frame that reads it.
+    mUploader.Submit();
+
+    VkSemaphore wait_semaphores[] = { frame.mImageAvailable };
+    VkSemaphore signal_semaphores[] = { frame.mRenderFinished };
     VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
 
+    const bool presents = mBackend == kWindowBackend;
+
     VkSubmitInfo submit_info {};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.waitSemaphoreCount = 1;
+    submit_info.waitSemaphoreCount = presents ? 1 : 0;
     submit_info.pWaitSemaphores = wait_semaphores;
     submit_info.pWaitDstStageMask = wait_stages;
     submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &mCommandBuffers[image_idx];
-    submit_info.signalSemaphoreCount = 1;
+    submit_info.pCommandBuffers = &command_buffer;
+    submit_info.signalSemaphoreCount = presents ? 1 : 0;
     submit_info.pSignalSemaphores = signal_semaphores;
 
-    vkQueueSubmit(mGraphicsQueue, 1, &submit_info, VK_NULL_HANDLE);
+    {
+        VulkanQueueDebugLabel label(mGraphicsQueue, "frame");
+        vkQueueSubmit(mGraphicsQueue, 1, &submit_info, frame.mInFlightFence);
+    }
+
+    if (++mFrameCount == 1) {
+        mStartupTrace.MarkFirstFrame();
+        LOG(INFO) << "startup first_frame_ms=" << mStartupTrace.first_frame_milliseconds();
+    }
+
+    if (!presents) {
+        mCurrentFrame = (mCurrentFrame + 1) % mFrames.size();
+        return true;
+    }
 
     VkSwapchainKHR swapchains[] = { mSwapchain };
     VkPresentInfoKHR present_info {};
@@ -103,7 +321,34 @@ void VulkanRenderer::render() {
     present_info.pImageIndices = &image_idx;
     present_info.pResults = nullptr;
 
-    vkQueuePresentKHR(mPresentQueue, &present_info);
+    VkResult result;
+    {
+        VulkanQueueDebugLabel label(mPresentQueue, "present");
+        result = vkQueuePresentKHR(mPresentQueue, &present_info);
+    }
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+        mSwapchainDirty = true;
+    else if (result != VK_SUCCESS)
+        DLOG(ERROR) << "vkQueuePresentKHR() failed: " << result;
+
+    mCurrentFrame = (mCurrentFrame + 1) % mFrames.size();
+    return true;
+}
+
+
+void VulkanRenderer::setPresentPolicy(PresentPolicy policy, uint32_t imageCount) {
+    if (policy == mPresentPolicy && imageCount == mRequestedImageCount)
+        return;
+    mPresentPolicy = policy;
+    mRequestedImageCount = imageCount;
+    if (mSwapchain != VK_NULL_HANDLE)
+        mSwapchainDirty = true;
+}
+
+
+void VulkanRenderer::waitIdle() {
+    if (mDevice != VK_NULL_HANDLE)
+        vkDeviceWaitIdle(mDevice);
 }
 
 
@@ -120,7 +365,7 @@ void VulkanRenderer::initExtensions()
 
 
 bool VulkanRenderer::createInstance() {
-  if (!InitializeVulkan())
+  if (!InitializeVulkan(mBackend == kHeadlessBackend))
     return false;
 
   mInstance = GetVulkanInstance();
@@ -132,16 +377,36 @@ void VulkanRenderer::destroyInstance() {
 }
 
 
+void VulkanRenderer::setQueuePriorities(float graphics, float transfer) {
+    DCHECK_EQ(static_cast<VkDevice>(VK_NULL_HANDLE), mDevice);
+    device_queue_.SetQueuePriority(VulkanDeviceQueue::GRAPHICS_QUEUE, graphics);
+    device_queue_.SetQueuePriority(VulkanDeviceQueue::TRANSFER_QUEUE, transfer);
+}
+
+void VulkanRenderer::setDeviceSelector(const std::string& selector) {
+    DCHECK_EQ(static_cast<VkDevice>(VK_NULL_HANDLE), mDevice);
+    device_queue_.SetDeviceSelector(selector);
+}
+
+void VulkanRenderer::setSampleCount(uint32_t samples) {
+    DCHECK_EQ(static_cast<VkDevice>(VK_NULL_HANDLE), mDevice);
+    mRequestedSamples = samples;
+}
+
 void VulkanRenderer::selectPhysicalDevice() {
   mGpu = device_queue_.GetVulkanPhysicalDevice();
   mGraphicsQueueFamilyIndex = device_queue_.GetVulkanQueueIndex();
   mPresentQueueFamilyIndex = device_queue_.GetVulkanQueueIndex();
+  mTransferQueueFamilyIndex =
+      device_queue_.GetVulkanQueueIndex(VulkanDeviceQueue::TRANSFER_QUEUE);
 }
 
 void VulkanRenderer::createLogicalDevice() {
   mDevice = device_queue_.GetVulkanDevice();
   mGraphicsQueue = device_queue_.GetVulkanQueue();
   mPresentQueue = device_queue_.GetVulkanQueue();
+  mTransferQueue =
+      device_queue_.GetVulkanQueue(VulkanDeviceQueue::TRANSFER_QUEUE);
 }
 
 
@@ -151,59 +416,63 @@ void VulkanRenderer::destroyLogicalDevice() {
 }
 
 
-void VulkanRenderer::createCommandPool()
-{
-    VkCommandPoolCreateInfo cmd_pool_create_info{};
-    cmd_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    cmd_pool_create_info.pNext = NULL;
-    cmd_pool_create_info.queueFamilyIndex = mGraphicsQueueFamilyIndex;
-    cmd_pool_create_info.flags = 0;
-
-    vkCreateCommandPool(mDevice, &cmd_pool_create_info, nullptr, &mCommandPool);
-}
-
-
-void VulkanRenderer::destroyCommandPool() {
-    vkDestroyCommandPool(mDevice, mCommandPool, nullptr);
-}
-
-
-void VulkanRenderer::createCommandBuffers() {
-    mCommandBuffers.resize(mSwapchainFramebuffers.size());
-
-    VkCommandBufferAllocateInfo cmd_buffer_alloc_info{};
-    cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmd_buffer_alloc_info.pNext = NULL;
-    cmd_buffer_alloc_info.commandPool = mCommandPool;
-    cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmd_buffer_alloc_info.commandBufferCount = (uint32_t)mCommandBuffers.size();
-
-    vkAllocateCommandBuffers(mDevice, &cmd_buffer_alloc_info, mCommandBuffers.data());
-}
-
-
-void VulkanRenderer::createSurface() {
-    glfwCreateWindowSurface(mInstance, mWindow, NULL, &mSurface);
+VkResult VulkanRenderer::createSurface() {
+    return glfwCreateWindowSurface(mInstance, mWindow, NULL, &mSurface);
 }
 
 
 void VulkanRenderer::destroySurface() {
+    if (mSurface == VK_NULL_HANDLE)
+        return;
     vkDestroySurfaceKHR(mInstance, mSurface, nullptr);
     mSurface = VK_NULL_HANDLE;
 }
 
 
-void VulkanRenderer::createSwapchain() {
+VkResult VulkanRenderer::createSwapchain() {
     SwapchainInfo swapchain_info;
     swapchain_info.querySwapchainSupport(mGpu, mSurface);
 
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(mWindow, &width, &height);
+
     mSurfaceFormat = swapchain_info.chooseSwapchainFormat();
-    mSwapchainExtent = swapchain_info.mCapabilities.currentExtent;
+    mSwapchainExtent = swapchain_info.chooseSwapchainExtent(width, height);
+
+    std::vector<VkPresentModeKHR> preferences;
+    switch (mPresentPolicy) {
+    case kPresentLowestLatency:
+        preferences = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR };
+        break;
+    case kPresentVsync:
+        preferences = { VK_PRESENT_MODE_FIFO_KHR };
+        break;
+    case kPresentAdaptive:
+        preferences = { VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+        break;
+    case kPresentUncapped:
+        preferences = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR };
+        break;
+    }
+    mPresentMode = swapchain_info.chooseSwapchainPresentMode(preferences);
+
+    // Mailbox needs a spare image to replace while one is being scanned out.
+    uint32_t image_count = mRequestedImageCount;
+    if (image_count == 0) {
+        image_count = swapchain_info.mCapabilities.minImageCount;
+        if (mPresentMode == VK_PRESENT_MODE_MAILBOX_KHR)
+            ++image_count;
+    }
+    image_count = swapchain_info.chooseSwapchainImageCount(image_count);
 
-    VkSwapchainCreateInfoKHR swapchain_create_info;
+    // Handing the retiring swapchain to the driver lets it recycle the old
+    // images instead of allocating a fresh set.
+    VkSwapchainKHR old_swapchain = mSwapchain;
+
+    VkSwapchainCreateInfoKHR swapchain_create_info {};
     swapchain_create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
     swapchain_create_info.surface = mSurface;
-    swapchain_create_info.minImageCount = swapchain_info.mCapabilities.minImageCount;
+    swapchain_create_info.minImageCount = image_count;
     swapchain_create_info.imageFormat = mSurfaceFormat.format;
     swapchain_create_info.imageColorSpace = mSurfaceFormat.colorSpace;
     swapchain_create_info.imageExtent = mSwapchainExtent;
@@ -211,16 +480,29 @@ void VulkanRenderer::createSwapchain() {
     swapchain_create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
     swapchain_create_info.preTransform = swapchain_info.mCapabilities.currentTransform;
     swapchain_create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    swapchain_create_info.presentMode = swapchain_info.chooseSwapchainPresentMode();
+    swapchain_create_info.presentMode = mPresentMode;
     swapchain_create_info.clipped = VK_TRUE;
-    swapchain_create_info.oldSwapchain = VK_NULL_HANDLE;
+    swapchain_create_info.oldSwapchain = old_swapchain;
+
+    VkResult result = vkCreateSwapchainKHR(mDevice, &swapchain_create_info, nullptr, &mSwapchain);
+    if (old_swapchain != VK_NULL_HANDLE)
+        vkDestroySwapchainKHR(mDevice, old_swapchain, nullptr);
+    if (result != VK_SUCCESS) {
+        DLOG(ERROR) << "vkCreateSwapchainKHR() failed: " << result;
+        mSwapchain = VK_NULL_HANDLE;
+        mSwapchainImages.clear();
+        return result;
+    }
 
-    vkCreateSwapchainKHR(mDevice, &swapchain_create_info, nullptr, &mSwapchain);
+    VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_SWAPCHAIN_KHR, mSwapchain, "swapchain");
 
-    uint32_t image_count = 0;
+    image_count = 0;
     vkGetSwapchainImagesKHR(mDevice, mSwapchain, &image_count, nullptr);
     mSwapchainImages.resize(image_count);
-    vkGetSwapchainImagesKHR(mDevice, mSwapchain, &image_count, mSwapchainImages.data());
+    result = vkGetSwapchainImagesKHR(mDevice, mSwapchain, &image_count, mSwapchainImages.data());
+    for (uint32_t i = 0; i < mSwapchainImages.size(); ++i)
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_IMAGE, mSwapchainImages[i], "swapchain image %u", i);
+    return result;
 }
 
 
@@ -230,7 +512,122 @@ void VulkanRenderer::destroySwapchain() {
 }
 
 
-void VulkanRenderer::createImageViews() {
+bool VulkanRenderer::recreateSwapchain() {
+    if (mBackend == kHeadlessBackend) {
+        mSwapchainDirty = false;
+        return true;
+    }
+
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(mWindow, &width, &height);
+    if (width == 0 || height == 0)
+        return false;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Only frames still in flight can reference the old views and
+    // framebuffers; wait for those rather than idling the whole device.
+    std::vector<VkFence> fences;
+    for (const auto& frame : mFrames)
+        fences.push_back(frame.mInFlightFence);
+    vkWaitForFences(mDevice, (uint32_t)fences.size(), fences.data(), VK_TRUE, UINT64_MAX);
+
+    const VkFormat old_format = mSurfaceFormat.format;
+
+    destroyFrameBuffer();
+    destroyImageViews();
+
+    createSwapchain();
+    if (mSwapchain == VK_NULL_HANDLE)
+        return false;
+
+    createImageViews();
+
+    // The render pass only depends on the format, which practically never
+    // changes. Viewport and scissor are dynamic, so a new extent alone
+    // keeps the pipeline.
+    if (mSurfaceFormat.format != old_format) {
+        // A compile still running references the old render pass;
+        // releasing a pipeline does not wait for it.
+        mPipelineBuilder.WaitForPipeline(mPipelineHandle);
+        if (mParticleCount > 0)
+            mParticles.WaitForPipelines();
+        destroyGraphicsPipeline();
+        if (mParticleCount > 0)
+            mParticles.DestroyDrawPipeline();
+        destroyRenderPass();
+        createRenderPass();
+        createGraphicsPipeline();
+        if (mParticleCount > 0)
+            mParticles.CreateDrawPipeline(mRenderPass, 0, mSampleCount);
+    }
+
+    createFrameBuffer();
+
+    // Recorded frames reference the old framebuffers.
+    markSceneDirty();
+
+    mSwapchainDirty = false;
+
+    auto end = std::chrono::steady_clock::now();
+    DLOG(INFO) << "Swapchain rebuilt at " << mSwapchainExtent.width << "x"
+               << mSwapchainExtent.height << " in "
+               << std::chrono::duration<double, std::milli>(end - start).count() << " ms";
+    return true;
+}
+
+
+void VulkanRenderer::onFramebufferResized(GLFWwindow* window, int width, int height) {
+    auto renderer = reinterpret_cast<VulkanRenderer*>(glfwGetWindowUserPointer(window));
+    if (renderer)
+        renderer->requestSwapchainRebuild();
+}
+
+
+VkResult VulkanRenderer::createOffscreenImages() {
+    // Same format the window path prefers, so the render pass and pipeline
+    // are built exactly as they are for a swapchain.
+    mSurfaceFormat.format = VK_FORMAT_R8G8B8A8_UNORM;
+    mSurfaceFormat.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+
+    mSwapchainImages.resize(mFrames.size());
+    mOffscreenMemory.resize(mFrames.size());
+
+    for (size_t i = 0; i < mSwapchainImages.size(); ++i) {
+        VkImageCreateInfo image_create_info {};
+        image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_create_info.imageType = VK_IMAGE_TYPE_2D;
+        image_create_info.format = mSurfaceFormat.format;
+        image_create_info.extent = { mSwapchainExtent.width, mSwapchainExtent.height, 1 };
+        image_create_info.mipLevels = 1;
+        image_create_info.arrayLayers = 1;
+        image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                  VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        if (!mMemoryAllocator.CreateImage(image_create_info, VulkanMemoryAllocator::kGpuOnly,
+                                          &mSwapchainImages[i], &mOffscreenMemory[i])) {
+            DLOG(ERROR) << "Failed to create offscreen image " << i;
+            return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        }
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_IMAGE, mSwapchainImages[i], "offscreen image %zu", i);
+    }
+    return VK_SUCCESS;
+}
+
+
+void VulkanRenderer::destroyOffscreenImages() {
+    for (size_t i = 0; i < mSwapchainImages.size(); ++i)
+        mMemoryAllocator.DestroyImage(mSwapchainImages[i], &mOffscreenMemory[i]);
+    mSwapchainImages.clear();
+    mOffscreenMemory.clear();
+}
+
+
+VkResult VulkanRenderer::createImageViews() {
     mSwapchainImageViews.resize(mSwapchainImages.size());
 
     for (uint32_t i = 0; i < mSwapchainImages.size(); i++) {
@@ -251,8 +648,12 @@ void VulkanRenderer::createImageViews() {
         imageview_create_info.subresourceRange.baseArrayLayer = 0;
         imageview_create_info.subresourceRange.layerCount = 1;
 
-        vkCreateImageView(mDevice, &imageview_create_info, nullptr, &mSwapchainImageViews[i]);
+        VkResult result = vkCreateImageView(mDevice, &imageview_create_info, nullptr, &mSwapchainImageViews[i]);
+        if (result != VK_SUCCESS)
+            return result;
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_IMAGE_VIEW, mSwapchainImageViews[i], "swapchain view %u", i);
     }
+    return VK_SUCCESS;
 }
 
 
@@ -260,267 +661,657 @@ void VulkanRenderer::destroyImageViews() {
     for (auto view : mSwapchainImageViews) {
         vkDestroyImageView(mDevice, view, nullptr);
     }
+    mSwapchainImageViews.clear();
 }
 
 
-void VulkanRenderer::createRenderPass() {
-    VkAttachmentDescription color_attachment{};
-    color_attachment.format = mSurfaceFormat.format;
-    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+void VulkanRenderer::selectAttachmentFormats() {
+    // D16 is the one format every device supports; the others have more
+    // precision.
+    const VkFormat depth_formats[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D24_UNORM_S8_UINT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_D16_UNORM,
+    };
+    mDepthFormat = VK_FORMAT_D16_UNORM;
+    for (VkFormat format : depth_formats) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(mGpu, format, &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            mDepthFormat = format;
+            break;
+        }
+    }
 
-    VkAttachmentReference color_attachment_ref{};
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(mGpu, &properties);
+    const VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts &
+                                         properties.limits.framebufferDepthSampleCounts;
+    uint32_t samples = std::min(std::max(mRequestedSamples, 1u), 8u);
+    while (samples > 1 && !(supported & samples))
+        samples >>= 1;
+    if (samples != mRequestedSamples)
+        LOG(WARNING) << "MSAA " << mRequestedSamples << "x not supported, using " << samples << "x";
+    mSampleCount = static_cast<VkSampleCountFlagBits>(samples);
+}
 
-    VkSubpassDescription subpass{};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_attachment_ref;
 
-    VkRenderPassCreateInfo render_pass_create_info{};
-    render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_create_info.attachmentCount = 1;
-    render_pass_create_info.pAttachments = &color_attachment;
-    render_pass_create_info.subpassCount = 1;
-    render_pass_create_info.pSubpasses = &subpass;
-    render_pass_create_info.dependencyCount = 0;
-    render_pass_create_info.pDependencies = nullptr;
+VkResult VulkanRenderer::createRenderPass() {
+    selectAttachmentFormats();
+
+    // The frame as a render graph, which derives the render passes, their
+    // layouts and dependencies. For now one pass drawing into the swapchain
+    // image, through a multisampled color image resolved at the end of the
+    // pass when MSAA is on. Depth (and multisampled color) never leave the
+    // pass, so the graph puts them in lazily allocated memory.
+    mRenderGraph.Reset();
+
+    VulkanRenderGraph::ImportedImage backbuffer;
+    backbuffer.format = mSurfaceFormat.format;
+    // Whatever the image held is cleared. The acquire semaphore is waited
+    // on at color output, so the first write is ordered after it.
+    backbuffer.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    backbuffer.initial_stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    if (mBackend == kHeadlessBackend) {
+        // Offscreen images are left ready to be copied out for readback.
+        backbuffer.final_layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        backbuffer.final_stages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        backbuffer.final_access = VK_ACCESS_TRANSFER_READ_BIT;
+    } else {
+        backbuffer.final_layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    }
+    mBackbuffer = mRenderGraph.ImportImage("backbuffer", backbuffer);
+
+    // Simulated in place: the graph orders the dispatch after the previous
+    // frame's draw and before this one's.
+    if (mParticleCount > 0) {
+        mParticleBuffer = mRenderGraph.ImportBuffer("particles");
+        mSimulatePass = mRenderGraph.AddPass("particles_simulate", VulkanRenderGraph::kComputePass,
+                                             [this](const VulkanRenderGraph::PassContext& context) {
+                                                 mParticles.RecordSimulate(context.command_buffer,
+                                                                           mCurrentFrame);
+                                             });
+        mRenderGraph.AddStorageBuffer(mSimulatePass, mParticleBuffer, true);
+    }
 
-    vkCreateRenderPass(mDevice, &render_pass_create_info, nullptr, &mRenderPass);
+    mMainPass = mRenderGraph.AddPass("main_pass", VulkanRenderGraph::kGraphicsPass,
+                                     [this](const VulkanRenderGraph::PassContext& context) {
+                                         recordMainPass(context);
+                                     });
+    VkClearColorValue clear_color = {{ 0.0f, 0.0f, 0.0f, 1.0f }};
+    if (mSampleCount != VK_SAMPLE_COUNT_1_BIT) {
+        VulkanRenderGraph::ResourceId color =
+            mRenderGraph.CreateImage("msaa_color", mSurfaceFormat.format, mSampleCount);
+        mRenderGraph.AddColorOutput(mMainPass, color, VK_ATTACHMENT_LOAD_OP_CLEAR, clear_color);
+        mRenderGraph.AddResolveOutput(mMainPass, color, mBackbuffer);
+    } else {
+        mRenderGraph.AddColorOutput(mMainPass, mBackbuffer, VK_ATTACHMENT_LOAD_OP_CLEAR, clear_color);
+    }
+    VulkanRenderGraph::ResourceId depth =
+        mRenderGraph.CreateImage("depth", mDepthFormat, mSampleCount);
+    mRenderGraph.SetDepthStencilOutput(mMainPass, depth);
+    if (mParticleCount > 0)
+        mRenderGraph.AddVertexBuffer(mMainPass, mParticleBuffer);
+
+    VkResult result = mRenderGraph.Compile(mDevice);
+    mRenderPass = mRenderGraph.render_pass(mMainPass);
+    return result;
 }
 
 
 void VulkanRenderer::destroyRenderPass() {
-    vkDestroyRenderPass(mDevice, mRenderPass, nullptr);
+    mRenderGraph.Reset();
     mRenderPass = VK_NULL_HANDLE;
 }
 
 
-void VulkanRenderer::createFrameBuffer() {
-    mSwapchainFramebuffers.resize(mSwapchainImageViews.size());
+VkResult VulkanRenderer::createFrameBuffer() {
+    // Framebuffers and transient attachments follow the extent.
+    mRenderGraph.SetImportedImages(mBackbuffer, mSwapchainImages, mSwapchainImageViews);
+    return mRenderGraph.CreateResources(&mMemoryAllocator, mSwapchainExtent);
+}
+
+
+void VulkanRenderer::destroyFrameBuffer() {
+    mRenderGraph.DestroyResources();
+}
+
+
+VkResult VulkanRenderer::createShaderModules() {
+    mShaderLibrary.Initialize(mDevice);
+    // A pack that fails to open only loses its overrides; the embedded
+    // shaders still work.
+    if (!mShaderPackPath.empty() && !mShaderLibrary.AddPack(mShaderPackPath))
+        DLOG(WARNING) << "Ignoring shader pack " << mShaderPackPath;
+
+    // Texturing samples the bindless table; without it instances stay
+    // untextured.
+    const bool textured = mBindlessEnabled && !mTexturePaths.empty();
+    mVertShaderModule = mShaderLibrary.GetModule(textured ? "textured.vert" : "shader.vert");
+    mFragShaderModule = mShaderLibrary.GetModule(textured ? "textured.frag" : "shader.frag");
+    if (mVertShaderModule == VK_NULL_HANDLE || mFragShaderModule == VK_NULL_HANDLE)
+        return VK_ERROR_INITIALIZATION_FAILED;
+    return VK_SUCCESS;
+}
+
+
+void VulkanRenderer::destroyShaderModules() {
+    // The library owns the modules.
+    mShaderLibrary.Destroy();
+    mFragShaderModule = VK_NULL_HANDLE;
+    mVertShaderModule = VK_NULL_HANDLE;
+}
+
 
-    for (size_t i = 0 ; i < mSwapchainImageViews.size(); ++i) {
-        VkImageView attachments[] = { mSwapchainImageViews[i] };
+VkResult VulkanRenderer::createDescriptorSetLayout() {
+    VkDescriptorSetLayoutBinding instance_binding {};
+    instance_binding.binding = 0;
+    instance_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    instance_binding.descriptorCount = 1;
+    instance_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
-        VkFramebufferCreateInfo frame_buffer_create_info{};
-        frame_buffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        frame_buffer_create_info.pNext = NULL;
-        frame_buffer_create_info.renderPass = mRenderPass;
-        frame_buffer_create_info.attachmentCount = 1;
-        frame_buffer_create_info.pAttachments = attachments;
-        frame_buffer_create_info.width = mSwapchainExtent.width;
-        frame_buffer_create_info.height = mSwapchainExtent.height;
-        frame_buffer_create_info.layers = 1;
+    VkDescriptorSetLayoutCreateInfo layout_info {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 1;
+    layout_info.pBindings = &instance_binding;
+
+    VkResult result = vkCreateDescriptorSetLayout(mDevice, &layout_info, nullptr, &mDescriptorSetLayout);
+    if (result == VK_SUCCESS)
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, mDescriptorSetLayout, "instance set layout");
+    return result;
+}
 
-        vkCreateFramebuffer(mDevice, &frame_buffer_create_info, nullptr, &mSwapchainFramebuffers[i]);
+
+void VulkanRenderer::destroyDescriptorSetLayout() {
+    vkDestroyDescriptorSetLayout(mDevice, mDescriptorSetLayout, nullptr);
+    mDescriptorSetLayout = VK_NULL_HANDLE;
+}
+
+
+VkResult VulkanRenderer::createDescriptorSets() {
+    VkDescriptorPoolSize pool_size {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = (uint32_t)mFrames.size();
+
+    VkDescriptorPoolCreateInfo pool_info {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = (uint32_t)mFrames.size();
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+
+    VkResult result = vkCreateDescriptorPool(mDevice, &pool_info, nullptr, &mDescriptorPool);
+    if (result != VK_SUCCESS)
+        return result;
+    VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_DESCRIPTOR_POOL, mDescriptorPool, "instance set pool");
+
+    for (size_t i = 0; i < mFrames.size(); ++i) {
+        FrameContext& frame = mFrames[i];
+        VkDescriptorSetAllocateInfo alloc_info {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = mDescriptorPool;
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &mDescriptorSetLayout;
+        result = vkAllocateDescriptorSets(mDevice, &alloc_info, &frame.mInstanceSet);
+        if (result != VK_SUCCESS)
+            return result;
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_DESCRIPTOR_SET, frame.mInstanceSet, "instance set %zu", i);
+
+        // The whole arena is visible; draws find their instances through
+        // DrawConstants::instance_base.
+        VkDescriptorBufferInfo buffer_info {};
+        buffer_info.buffer = frame.mTransientArena.buffer();
+        buffer_info.offset = 0;
+        buffer_info.range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet write {};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = frame.mInstanceSet;
+        write.dstBinding = 0;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.pBufferInfo = &buffer_info;
+        vkUpdateDescriptorSets(mDevice, 1, &write, 0, nullptr);
     }
+    return VK_SUCCESS;
 }
 
 
-void VulkanRenderer::destroyFrameBuffer() {
-    for (auto framebuffer : mSwapchainFramebuffers) {
-        vkDestroyFramebuffer(mDevice, framebuffer, nullptr);
-    }
-}
-
-
-void VulkanRenderer::createGraphicsPipeline() {
-    VkShaderModule vert_shader_module;
-    VkShaderModule frag_shader_module;
-
-    auto vert_code = ReadAllBytes("./shader/vert.spv");
-    auto frag_code = ReadAllBytes("./shader/frag.spv");
-
-    createShaderModule(vert_code, vert_shader_module);
-    createShaderModule(frag_code, frag_shader_module);
-
-    VkPipelineShaderStageCreateInfo vert_stage_create_info{};
-    vert_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vert_stage_create_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vert_stage_create_info.module = vert_shader_module;
-    vert_stage_create_info.pName = "main";
-    vert_stage_create_info.pSpecializationInfo = nullptr;
-
-    VkPipelineShaderStageCreateInfo frag_stage_create_info{};
-    frag_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    frag_stage_create_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    frag_stage_create_info.module = frag_shader_module;
-    frag_stage_create_info.pName = "main";
-    frag_stage_create_info.pSpecializationInfo = nullptr;
-
-    VkPipelineShaderStageCreateInfo shader_stages[] = { vert_stage_create_info, frag_stage_create_info };
-
-    VkPipelineVertexInputStateCreateInfo vertex_input_info{};
-    vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_info.vertexBindingDescriptionCount = 0;
-    vertex_input_info.pVertexBindingDescriptions = nullptr;
-    vertex_input_info.vertexAttributeDescriptionCount = 0;
-    vertex_input_info.pVertexAttributeDescriptions = nullptr;
-
-    VkPipelineInputAssemblyStateCreateInfo input_assembly{};
-    input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    input_assembly.primitiveRestartEnable = VK_FALSE;
-
-    VkViewport viewport{ 0.0f, 0.0f, (float)mSwapchainExtent.width, (float)mSwapchainExtent.height };
-    VkRect2D scissor{};
-    scissor.offset = { 0, 0 };
-    scissor.extent = mSwapchainExtent;
-
-    VkPipelineViewportStateCreateInfo viewport_state{};
-    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewport_state.viewportCount = 1;
-    viewport_state.pViewports = &viewport;
-    viewport_state.scissorCount = 1;
-    viewport_state.pScissors = &scissor;
-
-    VkPipelineRasterizationStateCreateInfo rasterizer{};
-    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-    rasterizer.depthBiasConstantFactor = 0.0f;
-    rasterizer.depthBiasClamp = 0.0f;
-    rasterizer.depthBiasSlopeFactor = 0.0f;
-
-    VkPipelineMultisampleStateCreateInfo multisampling{};
-    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    multisampling.minSampleShading = 1.0f;
-    multisampling.pSampleMask = nullptr;
-    multisampling.alphaToCoverageEnable = VK_FALSE;
-    multisampling.alphaToOneEnable = VK_FALSE;
-
-    VkPipelineColorBlendAttachmentState color_blend_attachment {};
-    color_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-                                            VK_COLOR_COMPONENT_G_BIT |
-                                            VK_COLOR_COMPONENT_B_BIT |
-                                            VK_COLOR_COMPONENT_A_BIT;
-    color_blend_attachment.blendEnable = VK_FALSE;
-    color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-    color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
-    color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-    color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
-
-    VkPipelineColorBlendStateCreateInfo color_blending {};
-    color_blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    color_blending.logicOpEnable = VK_FALSE;
-    color_blending.logicOp = VK_LOGIC_OP_COPY;
-    color_blending.attachmentCount = 1;
-    color_blending.pAttachments = &color_blend_attachment;
-    color_blending.blendConstants[0] = 0.0f;
-    color_blending.blendConstants[1] = 0.0f;
-    color_blending.blendConstants[2] = 0.0f;
-    color_blending.blendConstants[3] = 0.0f;
-
-    VkPipelineLayoutCreateInfo pipeline_layout_info;
+void VulkanRenderer::destroyDescriptorSets() {
+    vkDestroyDescriptorPool(mDevice, mDescriptorPool, nullptr);
+    mDescriptorPool = VK_NULL_HANDLE;
+    for (auto& frame : mFrames)
+        frame.mInstanceSet = VK_NULL_HANDLE;
+}
+
+
+void VulkanRenderer::bindMainDescriptorSets(VkCommandBuffer commandBuffer,
+                                            VkDescriptorSet instanceSet) const {
+    const VkDescriptorSet sets[] = { instanceSet, mBindlessTable.descriptor_set() };
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout,
+                            0, mBindlessEnabled ? 2 : 1, sets, 0, nullptr);
+}
+
+
+VkResult VulkanRenderer::createBindlessTable() {
+    // Without descriptor indexing the main layout simply has no set 1.
+    if (!device_queue_.descriptor_indexing_enabled())
+        return VK_SUCCESS;
+    mBindlessEnabled = mBindlessTable.Initialize(
+        mDevice, device_queue_.descriptor_indexing_properties(), framesInFlight());
+    return mBindlessEnabled ? VK_SUCCESS : VK_ERROR_INITIALIZATION_FAILED;
+}
+
+
+void VulkanRenderer::destroyBindlessTable() {
+    mBindlessTable.Destroy();
+    mBindlessEnabled = false;
+}
+
+
+VkResult VulkanRenderer::createPipelineLayout() {
+    VkPipelineLayoutCreateInfo pipeline_layout_info {};
     pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipeline_layout_info.setLayoutCount = 0;
-    pipeline_layout_info.pSetLayouts = nullptr;
-    pipeline_layout_info.pushConstantRangeCount = 0;
-    pipeline_layout_info.pPushConstantRanges = 0;
-
-    vkCreatePipelineLayout(mDevice, &pipeline_layout_info, nullptr, &mPipelineLayout);
-
-    VkGraphicsPipelineCreateInfo pipeline_info {};
-    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_info.stageCount = 2;
-    pipeline_info.pStages = shader_stages;
-    pipeline_info.pVertexInputState = &vertex_input_info;
-    pipeline_info.pInputAssemblyState = &input_assembly;
-    pipeline_info.pViewportState = &viewport_state;
-    pipeline_info.pRasterizationState = &rasterizer;
-    pipeline_info.pMultisampleState = &multisampling;
-    pipeline_info.pDepthStencilState = nullptr;
-    pipeline_info.pColorBlendState = &color_blending;
-    pipeline_info.pDynamicState = nullptr;
-    pipeline_info.layout = mPipelineLayout;
-    pipeline_info.renderPass = mRenderPass;
-    pipeline_info.subpass = 0;
-    pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
-    pipeline_info.basePipelineIndex = -1;
-
-    vkCreateGraphicsPipelines(mDevice, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &mPipeline);
-
-    vkDestroyShaderModule(mDevice, frag_shader_module, nullptr);
-    vkDestroyShaderModule(mDevice, vert_shader_module, nullptr);
+    VkPushConstantRange push_constant_range {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(DrawConstants);
+
+    const VkDescriptorSetLayout set_layouts[] = { mDescriptorSetLayout,
+                                                  mBindlessTable.set_layout() };
+    static_assert(kBindlessSet == 1, "set_layouts follows the set indices");
+    pipeline_layout_info.setLayoutCount = mBindlessEnabled ? 2 : 1;
+    pipeline_layout_info.pSetLayouts = set_layouts;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+    VkResult result = vkCreatePipelineLayout(mDevice, &pipeline_layout_info, nullptr, &mPipelineLayout);
+    if (result == VK_SUCCESS)
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_PIPELINE_LAYOUT, mPipelineLayout, "main pipeline layout");
+    return result;
+}
+
+
+void VulkanRenderer::destroyPipelineLayout() {
+    vkDestroyPipelineLayout(mDevice, mPipelineLayout, nullptr);
+    mPipelineLayout = VK_NULL_HANDLE;
+}
+
+
+VkResult VulkanRenderer::createGraphicsPipeline() {
+    GraphicsPipelineDesc desc;
+    desc.vertex_shader = mVertShaderModule;
+    desc.fragment_shader = mFragShaderModule;
+    desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    desc.cull_mode = VK_CULL_MODE_BACK_BIT;
+    desc.front_face = VK_FRONT_FACE_CLOCKWISE;
+    desc.samples = mSampleCount;
+    // Early-Z rejects occluded fragments before shading.
+    desc.depth_test = true;
+    desc.depth_write = true;
+    desc.depth_compare = VK_COMPARE_OP_LESS;
+    mVertexLayout.ApplyTo(&desc);
+    desc.layout = mPipelineLayout;
+    desc.render_pass = mRenderPass;
+    desc.subpass = 0;
+
+    // Compiles on the builder's worker threads; recordCommandBuffer() picks
+    // the pipeline up as soon as it is ready.
+    mPipelineHandle = mPipelineBuilder.RequestGraphicsPipeline(desc);
+    if (mPipelineHandle == VulkanPipelineBuilder::kInvalidHandle)
+        return VK_ERROR_INITIALIZATION_FAILED;
+    return VK_SUCCESS;
 }
 
 
 void VulkanRenderer::destroyGraphicsPipeline() {
-    vkDestroyPipeline(mDevice, mPipeline, nullptr);
-    mPipeline = VK_NULL_HANDLE;
+    mPipelineBuilder.Release(mPipelineHandle);
+    mPipelineHandle = VulkanPipelineBuilder::kInvalidHandle;
 }
 
 
-void VulkanRenderer::createShaderModule(const std::vector<char>& code, VkShaderModule& shaderModule) {
-    VkShaderModuleCreateInfo create_info{};
-    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = code.size();
-    create_info.pCode = (uint32_t*)code.data();
+VkResult VulkanRenderer::createMeshes() {
+    static const Vertex vertices[] = {
+        { {  0.0f, -0.5f }, { 1.0f, 0.0f, 0.0f } },
+        { {  0.5f,  0.5f }, { 0.0f, 1.0f, 0.0f } },
+        { { -0.5f,  0.5f }, { 0.0f, 0.0f, 1.0f } },
+    };
+    static const uint16_t indices[] = { 0, 1, 2 };
+
+    mVertexLayout = VertexLayout();
+    mVertexLayout.AddBinding(0, sizeof(Vertex))
+                 .AddAttribute(0, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, pos))
+                 .AddAttribute(1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color));
+
+    if (!mMesh.Initialize(&mMemoryAllocator, &mUploader, sizeof(Vertex),
+                          vertices, arraysize(vertices),
+                          indices, arraysize(indices), VK_INDEX_TYPE_UINT16)) {
+        DLOG(ERROR) << "Failed to create the triangle mesh";
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+    VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_BUFFER, mMesh.vertex_buffer(), "triangle vertices");
+    VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_BUFFER, mMesh.index_buffer(), "triangle indices");
+    return VK_SUCCESS;
+}
+
 
-    vkCreateShaderModule(mDevice, &create_info, nullptr, &shaderModule);
+void VulkanRenderer::destroyMeshes() {
+    mMesh.Destroy();
 }
 
 
-void VulkanRenderer::recordCommandBuffer() {
-    for (size_t i = 0; i < mCommandBuffers.size(); ++i) {
-        VkCommandBufferBeginInfo begin_info {};
-        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-        begin_info.pInheritanceInfo = nullptr;
+VkResult VulkanRenderer::createParticles() {
+    if (mParticleCount == 0)
+        return VK_SUCCESS;
+    if (!mParticles.Initialize(mGpu, mDevice, &mMemoryAllocator, &mShaderLibrary,
+                               &mPipelineBuilder, mParticleCount, framesInFlight()) ||
+        !mParticles.CreateDrawPipeline(mRenderPass, 0, mSampleCount))
+        return VK_ERROR_INITIALIZATION_FAILED;
+    mLastFrameTime = std::chrono::steady_clock::now();
+    return VK_SUCCESS;
+}
+
+
+void VulkanRenderer::destroyParticles() {
+    if (mParticleCount > 0)
+        mParticles.Destroy();
+}
+
+
+VkResult VulkanRenderer::createTextures() {
+    if (mTexturePaths.empty())
+        return VK_SUCCESS;
+    if (!mBindlessEnabled) {
+        DLOG(WARNING) << "Textures need descriptor indexing; drawing untextured";
+        return VK_SUCCESS;
+    }
+    if (!mTextureStreamer.Initialize(mDevice, &mMemoryAllocator, &mUploader, &mBindlessTable,
+                                     framesInFlight()))
+        return VK_ERROR_INITIALIZATION_FAILED;
+    for (const std::string& path : mTexturePaths)
+        mTextures.push_back(mTextureStreamer.Load(path));
+    return VK_SUCCESS;
+}
+
+
+void VulkanRenderer::destroyTextures() {
+    mTextureStreamer.Destroy();
+    mTextures.clear();
+}
 
-        vkBeginCommandBuffer(mCommandBuffers[i], &begin_info);
-        {
-            VkRenderPassBeginInfo render_pass_begin_info {};
-            render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            render_pass_begin_info.renderPass = mRenderPass;
-            render_pass_begin_info.framebuffer = mSwapchainFramebuffers[i];
 
-            render_pass_begin_info.renderArea.offset = { 0, 0 };
-            render_pass_begin_info.renderArea.extent = mSwapchainExtent;
+void VulkanRenderer::setInstanceCount(uint32_t count) {
+    // A square grid of cells covering clip space, one triangle per cell.
+    uint32_t columns = 1;
+    while (columns * columns < count)
+        ++columns;
+    const float cell = 2.0f / columns;
 
-            VkClearValue clear_color = { 0.0f, 0.0f, 0.0f, 1.0f };
-            render_pass_begin_info.clearValueCount = 1;
-            render_pass_begin_info.pClearValues = &clear_color;
+    mInstances.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        InstanceData& instance = mInstances[i];
+        memset(&instance, 0, sizeof(instance));
+        // The mesh spans [-0.5, 0.5], i.e. half of clip space.
+        instance.transform[0] = cell * 0.5f;
+        instance.transform[5] = cell * 0.5f;
+        instance.transform[10] = 1.0f;
+        instance.transform[15] = 1.0f;
+        instance.transform[12] = -1.0f + cell * (i % columns + 0.5f);
+        instance.transform[13] = -1.0f + cell * (i / columns + 0.5f);
+        instance.color[0] = instance.color[1] = instance.color[2] = instance.color[3] = 1.0f;
+        instance.material_index = i % 4;
+        instance.texture_index = VulkanBindlessTable::kInvalidHandle;
+        instance.sampler_index = VulkanBindlessTable::kInvalidHandle;
+    }
+    markSceneDirty();
+}
 
-            vkCmdBeginRenderPass(mCommandBuffers[i], &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-            {
-                vkCmdBindPipeline(mCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, mPipeline);
-                vkCmdDraw(mCommandBuffers[i], 3, 1, 0, 0);
+
+VkCommandBuffer VulkanRenderer::prepareCommandBuffer(uint32_t imageIndex) {
+    FrameContext& frame = mFrames[mCurrentFrame];
+
+    // A pipeline finishing its background compile changes what gets drawn.
+    VkPipeline pipeline = mPipelineBuilder.GetPipeline(mPipelineHandle);
+    if (pipeline != mRecordedPipeline) {
+        // Compiled on a worker thread, so it is named once it shows up.
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_PIPELINE, pipeline, "main pipeline");
+        mRecordedPipeline = pipeline;
+        markSceneDirty();
+    }
+    if (mParticleCount > 0 && mParticles.UpdatePipelines())
+        markSceneDirty();
+
+    // Content that changed since the previous frame is likely to change
+    // again: record it once and throw it away. Otherwise record for reuse.
+    const bool animating = mContentVersion != mPreviousContentVersion;
+    mPreviousContentVersion = mContentVersion;
+
+    if (frame.mReplayBuffers.size() < mSwapchainImages.size()) {
+        frame.mReplayBuffers.resize(mSwapchainImages.size(), VK_NULL_HANDLE);
+        frame.mReplayValid.resize(mSwapchainImages.size(), false);
+    }
+
+    if (frame.mContentVersion == mContentVersion && frame.mReplayValid[imageIndex]) {
+        // Zero-cost path: nothing to record, the GPU runs it again as is.
+        mGpuProfiler.ReplayFrame(mCurrentFrame);
+        ++mReplayedFrames;
+        return frame.mReplayBuffers[imageIndex];
+    }
+
+    if (frame.mContentVersion != mContentVersion) {
+        // Everything this slot recorded is stale, and its fence has
+        // signaled: drop it all at once.
+        vkResetCommandPool(mDevice, frame.mCommandPool, 0);
+        mRecorder.BeginFrame(mCurrentFrame);
+        frame.mReplayValid.assign(frame.mReplayValid.size(), false);
+        frame.mContentVersion = mContentVersion;
+    } else {
+        // Other images' recordings of this slot stay valid.
+        mRecorder.ContinueFrame(mCurrentFrame);
+    }
+
+    VkCommandBuffer command_buffer = frame.mCommandBuffer;
+    bool one_time = animating;
+    if (!one_time) {
+        if (frame.mReplayBuffers[imageIndex] == VK_NULL_HANDLE) {
+            VkCommandBufferAllocateInfo alloc_info {};
+            alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            alloc_info.commandPool = frame.mCommandPool;
+            alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            alloc_info.commandBufferCount = 1;
+            VkResult result = vkAllocateCommandBuffers(mDevice, &alloc_info,
+                                                       &frame.mReplayBuffers[imageIndex]);
+            if (result == VK_SUCCESS) {
+                VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_COMMAND_BUFFER, frame.mReplayBuffers[imageIndex],
+                              "frame %u replay %u", mCurrentFrame, imageIndex);
+            } else {
+                // Record this frame once into the slot's own buffer instead;
+                // the allocation is retried next time.
+                DLOG(ERROR) << "vkAllocateCommandBuffers() failed: " << result;
+                frame.mReplayBuffers[imageIndex] = VK_NULL_HANDLE;
+                one_time = true;
             }
-            vkCmdEndRenderPass(mCommandBuffers[i]);
         }
-        vkEndCommandBuffer(mCommandBuffers[i]);
+        if (!one_time)
+            command_buffer = frame.mReplayBuffers[imageIndex];
+    }
+
+    recordCommandBuffer(command_buffer, imageIndex, one_time);
+    frame.mTransientArena.Flush();
+    if (!one_time)
+        frame.mReplayValid[imageIndex] = true;
+    ++mRecordedFrames;
+    return command_buffer;
+}
+
+
+void VulkanRenderer::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                                         bool oneTimeSubmit) {
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = oneTimeSubmit ? VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0;
+    begin_info.pInheritanceInfo = nullptr;
+
+    vkBeginCommandBuffer(commandBuffer, &begin_info);
+    mGpuProfiler.BeginFrame(commandBuffer, mCurrentFrame);
+
+    // Until the pipeline finishes compiling in the background the frame is
+    // just cleared.
+    FrameContext& frame = mFrames[mCurrentFrame];
+    bool has_draws = false;
+    if (mRecordedPipeline != VK_NULL_HANDLE) {
+        // Rewritten on every recording of the slot; recordings for other
+        // images of the same content version lay it out identically.
+        frame.mTransientArena.Reset();
+        mDrawBatch.Reset();
+        // Handles move as the textures stream in, each time marking the
+        // scene dirty.
+        for (size_t i = 0; !mTextures.empty() && i < mInstances.size(); ++i) {
+            InstanceData& instance = mInstances[i];
+            instance.texture_index = mTextureStreamer.handle(mTextures[i % mTextures.size()]);
+            instance.sampler_index = mTextureStreamer.sampler();
+        }
+        mDrawBatch.Add(&mMesh, mInstances.data(), (uint32_t)mInstances.size());
+        has_draws = mDrawBatch.Prepare(&frame.mTransientArena);
+    }
+
+    // Small draw lists are cheaper to record inline than to fan out.
+    const bool parallel = has_draws &&
+                          mDrawBatch.draw_count() >= kParallelRecordMinDraws;
+    mRenderGraph.SetSubpassContents(mMainPass,
+                                    parallel ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                                             : VK_SUBPASS_CONTENTS_INLINE);
+    mRecordingOneTimeSubmit = oneTimeSubmit;
+
+    // Each pass is also a profiler scope.
+    mRenderGraph.Execute(commandBuffer, imageIndex, &mGpuProfiler);
+    vkEndCommandBuffer(commandBuffer);
+}
+
+
+void VulkanRenderer::recordMainPass(const VulkanRenderGraph::PassContext& context) {
+    const FrameContext& frame = mFrames[mCurrentFrame];
+    VkPipeline pipeline = mRecordedPipeline;
+    if (context.contents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS) {
+        recordDrawsParallel(context, pipeline);
+        return;
+    }
+
+    VkCommandBuffer commandBuffer = context.command_buffer;
+    // A failed Prepare() leaves no draws behind.
+    if (pipeline != VK_NULL_HANDLE && mDrawBatch.draw_count() > 0) {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        VulkanPipelineBuilder::SetViewportAndScissor(commandBuffer, context.extent);
+        bindMainDescriptorSets(commandBuffer, frame.mInstanceSet);
+        mDrawBatch.RecordDraws(commandBuffer, mPipelineLayout, 0, mDrawBatch.draw_count());
     }
+    if (mParticleCount > 0)
+        mParticles.RecordDraw(commandBuffer, context.extent);
 }
 
 
-void VulkanRenderer::createSemaphores() {
+void VulkanRenderer::recordDrawsParallel(const VulkanRenderGraph::PassContext& context,
+                                         VkPipeline pipeline) {
+    const FrameContext& frame = mFrames[mCurrentFrame];
+
+    // Fixed slices, so the same draw list always lands in the same
+    // secondaries in the same order, whichever thread records them.
+    const uint32_t draw_count = mDrawBatch.draw_count();
+    const uint32_t task_count = std::min(draw_count, mRecorder.thread_count() * 2);
+    const uint32_t slice = (draw_count + task_count - 1) / task_count;
+    // The particles get one more secondary of their own, recorded last.
+    const uint32_t particle_task = mParticleCount > 0 ? task_count : UINT32_MAX;
+
+    VkCommandBufferInheritanceInfo inheritance {};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = context.render_pass;
+    inheritance.subpass = context.subpass;
+    inheritance.framebuffer = context.framebuffer;
+
+    const std::vector<VkCommandBuffer>& secondaries = mRecorder.Record(
+        particle_task == UINT32_MAX ? task_count : task_count + 1, inheritance,
+        [&](VkCommandBuffer secondary, uint32_t task) {
+            if (task == particle_task) {
+                mParticles.RecordDraw(secondary, context.extent);
+                return;
+            }
+            // Secondaries inherit no state from the primary.
+            vkCmdBindPipeline(secondary, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            VulkanPipelineBuilder::SetViewportAndScissor(secondary, context.extent);
+            bindMainDescriptorSets(secondary, frame.mInstanceSet);
+            mDrawBatch.RecordDraws(secondary, mPipelineLayout, task * slice, slice);
+        }, mRecordingOneTimeSubmit);
+
+    vkCmdExecuteCommands(context.command_buffer, (uint32_t)secondaries.size(), secondaries.data());
+}
+
+
+VkResult VulkanRenderer::createFrameContexts() {
     VkSemaphoreCreateInfo semaphore_info {};
     semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    vkCreateSemaphore(mDevice, &semaphore_info, nullptr, &mSemaphoreImageAvailable);
-    vkCreateSemaphore(mDevice, &semaphore_info, nullptr, &mSemaphoreRenderFinished);
+    // Fences start signaled so the first wait on each slot returns at once.
+    VkFenceCreateInfo fence_info {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    VkCommandPoolCreateInfo cmd_pool_create_info {};
+    cmd_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_create_info.queueFamilyIndex = mGraphicsQueueFamilyIndex;
+    // Replay buffers are re-recorded one by one while the rest of the slot's
+    // recordings stay valid.
+    cmd_pool_create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                                 VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+    VkResult result = VK_SUCCESS;
+    for (size_t i = 0; i < mFrames.size(); ++i) {
+        FrameContext& frame = mFrames[i];
+        if ((result = vkCreateSemaphore(mDevice, &semaphore_info, nullptr, &frame.mImageAvailable)) != VK_SUCCESS ||
+            (result = vkCreateSemaphore(mDevice, &semaphore_info, nullptr, &frame.mRenderFinished)) != VK_SUCCESS ||
+            (result = vkCreateFence(mDevice, &fence_info, nullptr, &frame.mInFlightFence)) != VK_SUCCESS ||
+            (result = vkCreateCommandPool(mDevice, &cmd_pool_create_info, nullptr, &frame.mCommandPool)) != VK_SUCCESS)
+            return result;
+
+        VkCommandBufferAllocateInfo cmd_buffer_alloc_info {};
+        cmd_buffer_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        cmd_buffer_alloc_info.commandPool = frame.mCommandPool;
+        cmd_buffer_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        cmd_buffer_alloc_info.commandBufferCount = 1;
+
+        result = vkAllocateCommandBuffers(mDevice, &cmd_buffer_alloc_info, &frame.mCommandBuffer);
+        if (result != VK_SUCCESS)
+            return result;
+
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_SEMAPHORE, frame.mImageAvailable, "frame %zu image available", i);
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_SEMAPHORE, frame.mRenderFinished, "frame %zu render finished", i);
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_FENCE, frame.mInFlightFence, "frame %zu in flight", i);
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_COMMAND_POOL, frame.mCommandPool, "frame %zu", i);
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_COMMAND_BUFFER, frame.mCommandBuffer, "frame %zu", i);
+
+        if (!frame.mTransientArena.Initialize(&mMemoryAllocator, kTransientArenaSize,
+                                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                              VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                                              VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                              VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT))
+            return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        VK_DEBUG_NAME(mDevice, VK_OBJECT_TYPE_BUFFER, frame.mTransientArena.buffer(), "frame %zu arena", i);
+    }
+    mCurrentFrame = 0;
+    return VK_SUCCESS;
 }
 
 
-void VulkanRenderer::destroySemaphores() {
-    vkDestroySemaphore(mDevice, mSemaphoreImageAvailable, nullptr);
-    vkDestroySemaphore(mDevice, mSemaphoreRenderFinished, nullptr);
+void VulkanRenderer::destroyFrameContexts() {
+    for (auto& frame : mFrames) {
+        frame.mTransientArena.Destroy();
+        vkDestroyCommandPool(mDevice, frame.mCommandPool, nullptr);
+        vkDestroyFence(mDevice, frame.mInFlightFence, nullptr);
+        vkDestroySemaphore(mDevice, frame.mRenderFinished, nullptr);
+        vkDestroySemaphore(mDevice, frame.mImageAvailable, nullptr);
+        frame = FrameContext();
+    }
+    mRecordedPipeline = VK_NULL_HANDLE;
 }
 
 
@@ -549,28 +1340,37 @@ VkSurfaceFormatKHR SwapchainInfo::chooseSwapchainFormat() {
 }
 
 
-VkPresentModeKHR SwapchainInfo::chooseSwapchainPresentMode() {
-    for (const auto& mode : mPresentModes) {
-        if (mode == VK_PRESENT_MODE_FIFO_KHR)
-            return mode;
-    }
-    return mPresentModes[0];
+VkExtent2D SwapchainInfo::chooseSwapchainExtent(uint32_t width, uint32_t height) {
+    // UINT32_MAX means the surface size follows the swapchain, so the window's
+    // framebuffer size decides.
+    if (mCapabilities.currentExtent.width != UINT32_MAX)
+        return mCapabilities.currentExtent;
+
+    VkExtent2D extent = { width, height };
+    extent.width = std::max(mCapabilities.minImageExtent.width,
+                            std::min(mCapabilities.maxImageExtent.width, extent.width));
+    extent.height = std::max(mCapabilities.minImageExtent.height,
+                             std::min(mCapabilities.maxImageExtent.height, extent.height));
+    return extent;
 }
 
 
-static std::vector<char> ReadAllBytes(char const* filename)
-{
-    std::ifstream ifs(filename, std::ios::binary|std::ios::ate);
-    if (!ifs.is_open()) {
-        std::cout << "failed to load " << filename << std::endl;
-        std::exit(-1);
+VkPresentModeKHR SwapchainInfo::chooseSwapchainPresentMode(const std::vector<VkPresentModeKHR>& preferences) {
+    for (const auto& preferred : preferences) {
+        for (const auto& mode : mPresentModes) {
+            if (mode == preferred)
+                return mode;
+        }
     }
-    std::ifstream::pos_type pos = ifs.tellg();
-
-    std::vector<char> result(pos);
+    // FIFO is the only mode every implementation must support.
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
 
-    ifs.seekg(0, std::ios::beg);
-    ifs.read(&result[0], pos);
 
-    return result;
+uint32_t SwapchainInfo::chooseSwapchainImageCount(uint32_t requested) {
+    uint32_t count = std::max(requested, mCapabilities.minImageCount);
+    // A maxImageCount of 0 means there is no upper limit.
+    if (mCapabilities.maxImageCount > 0)
+        count = std::min(count, mCapabilities.maxImageCount);
+    return count;
 }
@@ -2,60 +2,280 @@
 #ifndef VULKAN_RENDERER_H_
 #define VULKAN_RENDERER_H_
 
+#include <chrono>
+#include <string>
 #include <vector>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include "VulkanBindlessTable.h"
 #include "VulkanDeviceQueue.h"
+#include "VulkanDrawBatch.h"
+#include "VulkanGpuProfiler.h"
+#include "VulkanMemoryAllocator.h"
+#include "VulkanMesh.h"
+#include "VulkanParallelRecorder.h"
+#include "VulkanParticleSystem.h"
+#include "VulkanPipelineBuilder.h"
+#include "VulkanPipelineCache.h"
+#include "VulkanRenderGraph.h"
+#include "VulkanShaderLibrary.h"
+#include "VulkanStartupTrace.h"
+#include "VulkanTextureStreamer.h"
+#include "VulkanUploader.h"
 
 class VulkanRenderer
 {
 public:
-    VulkanRenderer(GLFWwindow*);
+    static const uint32_t kDefaultFramesInFlight = 2;
+    static const uint32_t kMaxFramesInFlight = 4;
+    // Set index of the bindless table in the main pipeline layout.
+    static const uint32_t kBindlessSet = 1;
+
+    enum Backend {
+        // Renders into a GLFW window surface through a swapchain.
+        kWindowBackend,
+        // Renders into device-local images owned by the renderer. Needs no
+        // display, surface or swapchain extension.
+        kHeadlessBackend,
+    };
+
+    enum PresentPolicy {
+        // MAILBOX, falling back to IMMEDIATE: newest frame wins, no tearing
+        // where the driver supports mailbox.
+        kPresentLowestLatency,
+        // FIFO: classic vsync, always supported.
+        kPresentVsync,
+        // FIFO_RELAXED: vsync, but late frames are shown immediately.
+        kPresentAdaptive,
+        // IMMEDIATE, falling back to MAILBOX: no throttling, for benchmarks.
+        kPresentUncapped,
+    };
+
+    // |framesInFlight| bounds how many frames the CPU may queue ahead of the
+    // GPU. It is clamped to [1, kMaxFramesInFlight].
+    VulkanRenderer(GLFWwindow*, uint32_t framesInFlight = kDefaultFramesInFlight);
+
+    // Creates a headless renderer drawing into |width| x |height| images.
+    VulkanRenderer(uint32_t width, uint32_t height,
+                   uint32_t framesInFlight = kDefaultFramesInFlight);
     ~VulkanRenderer();
 
+    // Logs a one-line start-up report (see VulkanStartupTrace) either way.
     bool Init();
-    void render();
+    // Returns false if no frame was submitted, e.g. while the window is
+    // minimized or the swapchain is out of date; the frame slot then stays
+    // the same.
+    bool render();
+
+    // Blocks until the next frame's slot is free, i.e. the GPU retired the
+    // frame submitted framesInFlight() frames ago, and returns how long that
+    // took in milliseconds. render() waits for the same fence, so calling
+    // this first only moves the wait, e.g. after input was sampled.
+    double waitForFrameSlot();
+    // The slot waitForFrameSlot() and the next render() use.
+    uint32_t currentFrameSlot() const { return mCurrentFrame; }
+
+    // Blocks until the GPU has finished all submitted frames.
+    void waitIdle();
+
+    // Rebuilds the swapchain before the next frame, e.g. after a resize. The
+    // window backend also triggers this itself on framebuffer size changes
+    // and on VK_ERROR_OUT_OF_DATE_KHR / VK_SUBOPTIMAL_KHR.
+    void requestSwapchainRebuild() { mSwapchainDirty = true; }
+
+    // Selects the present mode and swapchain depth. |imageCount| is clamped
+    // to the surface capabilities; 0 picks the driver minimum, plus one spare
+    // image for mailbox. Takes effect through a swapchain rebuild before the
+    // next frame, so it can be switched at any time.
+    void setPresentPolicy(PresentPolicy policy, uint32_t imageCount = 0);
+    PresentPolicy presentPolicy() const { return mPresentPolicy; }
+    // The mode actually in use, after falling back for driver support.
+    VkPresentModeKHR presentMode() const { return mPresentMode; }
+
+    // Number of triangle instances drawn, laid out on a grid. All of them
+    // go out through a single indirect draw.
+    void setInstanceCount(uint32_t count);
+    uint32_t instanceCount() const { return (uint32_t)mInstances.size(); }
+
+    // Particles simulated by a compute shader every frame and drawn after
+    // the triangles (see VulkanParticleSystem); 0, the default, disables
+    // them. Only effective before Init().
+    void setParticleCount(uint32_t count) { mParticleCount = count; }
+    uint32_t particleCount() const { return mParticleCount; }
+
+    // Images (binary PPM) mapped onto the instances in turn, streamed in
+    // the background (see VulkanTextureStreamer); instances draw untextured
+    // until theirs arrives. Needs the bindless table. Only effective before
+    // Init().
+    void setTexturePaths(const std::vector<std::string>& paths) { mTexturePaths = paths; }
+    const VulkanTextureStreamer::Stats& textureStats() const { return mTextureStreamer.stats(); }
+
+    // Tells the renderer that recorded content changed: draw lists, instance
+    // data, anything baked into the command buffers. Buffer contents updated
+    // through the uploader do not count. Frames re-record only after this
+    // (or a swapchain rebuild); unchanged frames resubmit the command buffer
+    // recorded for their slot and image.
+    void markSceneDirty() { ++mContentVersion; }
+
+    uint64_t recordedFrameCount() const { return mRecordedFrames; }
+    uint64_t replayedFrameCount() const { return mReplayedFrames; }
+
+    // Relative priorities of the graphics and transfer queues, in [0, 1].
+    // Only effective before Init().
+    void setQueuePriorities(float graphics, float transfer);
+
+    // Pins the GPU instead of taking the highest ranked one; see
+    // VulkanDeviceQueue::SetDeviceSelector() for the syntax. Defaults to
+    // $WD_DEVICE. Only effective before Init().
+    void setDeviceSelector(const std::string& selector);
+
+    // MSAA sample count, 1, 2, 4 or 8; clamped to what the device supports
+    // for color and depth attachments together. Multisampled color and depth
+    // live in lazily allocated memory where available and are resolved
+    // within the render pass. Only effective before Init().
+    void setSampleCount(uint32_t samples);
+    // The count actually in use.
+    VkSampleCountFlagBits sampleCount() const { return mSampleCount; }
+
+    Backend backend() const { return mBackend; }
+    uint32_t framesInFlight() const { return (uint32_t)mFrames.size(); }
+    uint64_t frameCount() const { return mFrameCount; }
+
+    const VulkanMemoryAllocator& memoryAllocator() const { return mMemoryAllocator; }
+    // Stages vertex/index data; uploads reach the GPU before the next frame.
+    VulkanUploader& uploader() { return mUploader; }
+    // Bound as set kBindlessSet of every main pass draw; null if the device
+    // lacks descriptor indexing. Handles removed from it are recycled
+    // framesInFlight() frames later.
+    VulkanBindlessTable* bindlessTable() {
+        return mBindlessEnabled ? &mBindlessTable : nullptr;
+    }
+
+    const VulkanGpuProfiler& gpuProfiler() const { return mGpuProfiler; }
+    // Per-phase timings and results of Init(), and the time to first frame.
+    const VulkanStartupTrace& startupTrace() const { return mStartupTrace; }
+    // When set, the GPU scope statistics are written there as CSV on exit.
+    void setGpuProfileCsvPath(const std::string& path) { mGpuProfileCsvPath = path; }
+
+    // File the pipeline cache is loaded from at Init() and saved to on
+    // shutdown. Defaults to $WD_PIPELINE_CACHE, else "pipeline_cache.bin";
+    // an empty path disables persistence. Must be set before Init().
+    void setPipelineCachePath(const std::string& path) { mPipelineCachePath = path; }
+
+    // Shader pack (see ShaderPack) whose shaders replace the ones compiled
+    // into the binary. Defaults to $WD_SHADER_PACK. Must be set before Init().
+    void setShaderPackPath(const std::string& path) { mShaderPackPath = path; }
 
 private:
+    bool initPhases();
     void initExtensions();
     bool createInstance();
     void destroyInstance();
 
-    void createSurface();
+    VkResult createSurface();
     void destroySurface();
 
     void selectPhysicalDevice();
     void createLogicalDevice();
     void destroyLogicalDevice();
 
-    void createCommandPool();
-    void destroyCommandPool();
-    void createCommandBuffers();
-
-    void createSwapchain();
+    VkResult createSwapchain();
     void destroySwapchain();
+    bool recreateSwapchain();
+
+    static void onFramebufferResized(GLFWwindow* window, int width, int height);
+
+    VkResult createOffscreenImages();
+    void destroyOffscreenImages();
 
-    void createImageViews();
+    VkResult createImageViews();
     void destroyImageViews();
 
-    void createRenderPass();
+    // Picks the depth format and clamps the sample count.
+    void selectAttachmentFormats();
+    VkResult createRenderPass();
     void destroyRenderPass();
 
-    void createFrameBuffer();
+    VkResult createFrameBuffer();
     void destroyFrameBuffer();
 
-    void createGraphicsPipeline();
-    void destroyGraphicsPipeline();
+    VkResult createShaderModules();
+    void destroyShaderModules();
+
+    VkResult createDescriptorSetLayout();
+    void destroyDescriptorSetLayout();
 
-    void createShaderModule(const std::vector<char>& code, VkShaderModule& shaderModule);
+    VkResult createDescriptorSets();
+    void destroyDescriptorSets();
+    // Binds the instance set and, if enabled, the bindless table.
+    void bindMainDescriptorSets(VkCommandBuffer commandBuffer,
+                                VkDescriptorSet instanceSet) const;
 
-    void recordCommandBuffer();
+    VkResult createBindlessTable();
+    void destroyBindlessTable();
 
-    void createSemaphores();
-    void destroySemaphores();
+    VkResult createPipelineLayout();
+    void destroyPipelineLayout();
 
+    VkResult createGraphicsPipeline();
+    void destroyGraphicsPipeline();
+
+    VkResult createMeshes();
+    void destroyMeshes();
+
+    VkResult createParticles();
+    void destroyParticles();
+
+    VkResult createTextures();
+    void destroyTextures();
+
+    // Picks the command buffer for this frame, re-recording only if the
+    // content changed since the slot last recorded for |imageIndex|.
+    VkCommandBuffer prepareCommandBuffer(uint32_t imageIndex);
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                             bool oneTimeSubmit);
+    // Record function of the graph's main pass.
+    void recordMainPass(const VulkanRenderGraph::PassContext& context);
+    // Records the prepared draw batch into secondaries on mRecorder's
+    // threads and executes them from the pass's command buffer.
+    void recordDrawsParallel(const VulkanRenderGraph::PassContext& context,
+                             VkPipeline pipeline);
+
+    VkResult createFrameContexts();
+    void destroyFrameContexts();
+
+    static const VkDeviceSize kTransientArenaSize = 16 * 1024 * 1024;
+    // Draw count, i.e. distinct meshes, from which the main pass is
+    // recorded in parallel, each secondary taking a range of the draws.
+    // Scenes with a few meshes record inline however many instances they
+    // draw: an instanced draw is one command whatever its size.
+    static const uint32_t kParallelRecordMinDraws = 256;
+
+    // Everything one frame slot owns. A slot is reused only after its fence
+    // has signaled, so its semaphores and command pool are never touched
+    // while the GPU still reads them.
+    struct FrameContext {
+        VkSemaphore mImageAvailable = VK_NULL_HANDLE;
+        VkSemaphore mRenderFinished = VK_NULL_HANDLE;
+        VkFence mInFlightFence = VK_NULL_HANDLE;
+        VkCommandPool mCommandPool = VK_NULL_HANDLE;
+        // Recorded with ONE_TIME_SUBMIT while the content keeps changing.
+        VkCommandBuffer mCommandBuffer = VK_NULL_HANDLE;
+        // Reusable recordings per swapchain image, resubmitted as long as
+        // mContentVersion matches the renderer's.
+        std::vector<VkCommandBuffer> mReplayBuffers;
+        std::vector<bool> mReplayValid;
+        uint64_t mContentVersion = 0;
+        // Per-frame transient data (uniforms, instance data, dynamic
+        // geometry), reset once the fence proves the GPU is done with it.
+        VulkanLinearArena mTransientArena;
+        // Binds mTransientArena's buffer as the instance storage buffer.
+        VkDescriptorSet mInstanceSet = VK_NULL_HANDLE;
+    };
+
+    Backend mBackend = kWindowBackend;
     GLFWwindow* mWindow = nullptr;
 
     VkInstance mInstance = VK_NULL_HANDLE;
@@ -67,27 +287,85 @@ private:
     uint32_t mPresentQueueFamilyIndex = UINT32_MAX;
     VkQueue mGraphicsQueue = VK_NULL_HANDLE;
     VkQueue mPresentQueue = VK_NULL_HANDLE;
-
-    VkCommandPool mCommandPool = VK_NULL_HANDLE;
-    std::vector<VkCommandBuffer> mCommandBuffers;
+    // Falls back to the graphics family when the device has no dedicated
+    // one.
+    uint32_t mTransferQueueFamilyIndex = UINT32_MAX;
+    VkQueue mTransferQueue = VK_NULL_HANDLE;
 
     VkSurfaceKHR mSurface = VK_NULL_HANDLE;
     VkSurfaceFormatKHR mSurfaceFormat;
+    VkFormat mDepthFormat = VK_FORMAT_UNDEFINED;
+    uint32_t mRequestedSamples = 1;
+    VkSampleCountFlagBits mSampleCount = VK_SAMPLE_COUNT_1_BIT;
 
     VkSwapchainKHR mSwapchain = VK_NULL_HANDLE;
+    bool mSwapchainDirty = false;
+    PresentPolicy mPresentPolicy = kPresentVsync;
+    uint32_t mRequestedImageCount = 0;
+    VkPresentModeKHR mPresentMode = VK_PRESENT_MODE_FIFO_KHR;
     VkExtent2D mSwapchainExtent;
     std::vector<VkImage> mSwapchainImages;
     std::vector<VkImageView> mSwapchainImageViews;
-
-    std::vector<VkFramebuffer> mSwapchainFramebuffers;
-
+    // Backing memory of the headless images in mSwapchainImages.
+    std::vector<VulkanAllocation> mOffscreenMemory;
+
+    // The frame's passes. Owns the render passes, framebuffers and
+    // transient attachments; mRenderPass is the main pass's.
+    VulkanRenderGraph mRenderGraph;
+    VulkanRenderGraph::ResourceId mBackbuffer = VulkanRenderGraph::kInvalidId;
+    VulkanRenderGraph::PassId mMainPass = VulkanRenderGraph::kInvalidId;
     VkRenderPass mRenderPass = VK_NULL_HANDLE;
 
+    VkDescriptorSetLayout mDescriptorSetLayout = VK_NULL_HANDLE;
+    VkDescriptorPool mDescriptorPool = VK_NULL_HANDLE;
+    VulkanBindlessTable mBindlessTable;
+    bool mBindlessEnabled = false;
     VkPipelineLayout mPipelineLayout = VK_NULL_HANDLE;
-    VkPipeline mPipeline = VK_NULL_HANDLE;
-
-    VkSemaphore mSemaphoreImageAvailable = VK_NULL_HANDLE;
-    VkSemaphore mSemaphoreRenderFinished = VK_NULL_HANDLE;
+    VkShaderModule mVertShaderModule = VK_NULL_HANDLE;
+    VkShaderModule mFragShaderModule = VK_NULL_HANDLE;
+    VulkanShaderLibrary mShaderLibrary;
+    std::string mShaderPackPath;
+    VulkanPipelineBuilder::Handle mPipelineHandle = VulkanPipelineBuilder::kInvalidHandle;
+
+    VulkanMemoryAllocator mMemoryAllocator;
+    VulkanUploader mUploader;
+
+    VertexLayout mVertexLayout;
+    VulkanMesh mMesh;
+    std::vector<InstanceData> mInstances;
+    VulkanDrawBatch mDrawBatch;
+
+    uint32_t mParticleCount = 0;
+    VulkanParticleSystem mParticles;
+    VulkanRenderGraph::ResourceId mParticleBuffer = VulkanRenderGraph::kInvalidId;
+    VulkanRenderGraph::PassId mSimulatePass = VulkanRenderGraph::kInvalidId;
+    // Simulation time step.
+    std::chrono::steady_clock::time_point mLastFrameTime;
+
+    std::vector<std::string> mTexturePaths;
+    VulkanTextureStreamer mTextureStreamer;
+    std::vector<VulkanTextureStreamer::TextureId> mTextures;
+    VulkanParallelRecorder mRecorder;
+
+    std::vector<FrameContext> mFrames;
+    uint32_t mCurrentFrame = 0;
+    uint64_t mFrameCount = 0;
+
+    uint64_t mContentVersion = 1;
+    uint64_t mPreviousContentVersion = 0;
+    VkPipeline mRecordedPipeline = VK_NULL_HANDLE;
+    // Whether the recording in progress is submitted only once.
+    bool mRecordingOneTimeSubmit = false;
+    uint64_t mRecordedFrames = 0;
+    uint64_t mReplayedFrames = 0;
+
+    VulkanPipelineCache mPipelineCache;
+    std::string mPipelineCachePath;
+    VulkanPipelineBuilder mPipelineBuilder;
+
+    VulkanGpuProfiler mGpuProfiler;
+    VulkanStartupTrace mStartupTrace;
+    std::string mGpuProfileCsvPath;
 
     VulkanDeviceQueue device_queue_;
 };
@@ -97,7 +375,10 @@ public:
     void querySwapchainSupport(VkPhysicalDevice, VkSurfaceKHR);
 
     VkSurfaceFormatKHR chooseSwapchainFormat();
-    VkPresentModeKHR chooseSwapchainPresentMode();
+    VkExtent2D chooseSwapchainExtent(uint32_t width, uint32_t height);
+    // Returns the first of |preferences| the surface supports, else FIFO.
+    VkPresentModeKHR chooseSwapchainPresentMode(const std::vector<VkPresentModeKHR>& preferences);
+    uint32_t chooseSwapchainImageCount(uint32_t requested);
 
     VkSurfaceCapabilitiesKHR mCapabilities;
     std::vector<VkSurfaceFormatKHR> mSurfaceFormats;
@@ -0,0 +1,207 @@
+
+#include "VulkanShaderLibrary.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanInstance.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct EmbeddedShader {
+  const char* name;
+  const uint32_t* code;
+  size_t size;
+};
+
+// Generated by shader/build_shaders.py, the pre-build step; missing means
+// the step did not run. Builds relying on shader packs alone generate an
+// empty table with --pack-only.
+#include "shaders/EmbeddedShaders.inc"
+
+const uint32_t kPackMagic = 0x50534457;  // 'WDSP'
+const uint32_t kPackVersion = 1;
+const size_t kPackNameSize = 56;
+const size_t kPackHeaderSize = 3 * sizeof(uint32_t);
+const size_t kPackEntrySize = kPackNameSize + 2 * sizeof(uint32_t);
+const uint32_t kSpirvMagic = 0x07230203;
+
+uint32_t ReadUint32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+
+ShaderPack::ShaderPack() {}
+
+ShaderPack::~ShaderPack() {
+  Close();
+}
+
+bool ShaderPack::Open(const std::string& path) {
+  Close();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DLOG(ERROR) << "Cannot open shader pack " << path;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive.
+  close(fd);
+  if (MAP_FAILED == data) {
+    DLOG(ERROR) << "mmap() of " << path << " failed";
+    return false;
+  }
+  data_ = static_cast<const char*>(data);
+  size_ = static_cast<size_t>(st.st_size);
+
+  if (!Parse()) {
+    DLOG(ERROR) << "Malformed shader pack " << path;
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void ShaderPack::Close() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+  data_ = nullptr;
+  size_ = 0;
+  shaders_.clear();
+}
+
+bool ShaderPack::Parse() {
+  if (size_ < kPackHeaderSize || ReadUint32(data_) != kPackMagic ||
+      ReadUint32(data_ + 4) != kPackVersion)
+    return false;
+
+  const uint32_t count = ReadUint32(data_ + 8);
+  if (count > (size_ - kPackHeaderSize) / kPackEntrySize)
+    return false;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    const char* entry = data_ + kPackHeaderSize + i * kPackEntrySize;
+    const uint32_t offset = ReadUint32(entry + kPackNameSize);
+    const uint32_t size = ReadUint32(entry + kPackNameSize + 4);
+    // pCode must be 4-byte aligned; the mapping itself is page aligned.
+    if (offset % sizeof(uint32_t) || size % sizeof(uint32_t) ||
+        size < sizeof(uint32_t) || offset > size_ || size > size_ - offset)
+      return false;
+
+    ShaderCode shader;
+    shader.code = reinterpret_cast<const uint32_t*>(data_ + offset);
+    shader.size = size;
+    if (shader.code[0] != kSpirvMagic)
+      return false;
+    shaders_[std::string(entry, strnlen(entry, kPackNameSize))] = shader;
+  }
+  return true;
+}
+
+bool ShaderPack::Find(const std::string& name, ShaderCode* shader) const {
+  auto it = shaders_.find(name);
+  if (it == shaders_.end())
+    return false;
+  *shader = it->second;
+  return true;
+}
+
+
+VulkanShaderLibrary::VulkanShaderLibrary() {}
+
+VulkanShaderLibrary::~VulkanShaderLibrary() {
+  DCHECK(modules_.empty());
+}
+
+void VulkanShaderLibrary::Initialize(VkDevice device) {
+  vk_device_ = device;
+}
+
+void VulkanShaderLibrary::Destroy() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& module : modules_) {
+    if (VK_NULL_HANDLE != module.second)
+      vkDestroyShaderModule(vk_device_, module.second, nullptr);
+  }
+  modules_.clear();
+  packs_.clear();
+  vk_device_ = VK_NULL_HANDLE;
+}
+
+bool VulkanShaderLibrary::AddPack(const std::string& path) {
+  std::unique_ptr<ShaderPack> pack(new ShaderPack);
+  if (!pack->Open(path))
+    return false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  packs_.push_back(std::move(pack));
+  return true;
+}
+
+VkShaderModule VulkanShaderLibrary::GetModule(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = modules_.find(name);
+  if (it != modules_.end())
+    return it->second;
+
+  ShaderCode shader;
+  if (!FindCode(name, &shader)) {
+    DLOG(ERROR) << "Unknown shader " << name;
+    return VK_NULL_HANDLE;
+  }
+
+  VkShaderModuleCreateInfo create_info = {};
+  create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  create_info.codeSize = shader.size;
+  create_info.pCode = shader.code;
+
+  VkShaderModule module = VK_NULL_HANDLE;
+  VkResult result =
+      vkCreateShaderModule(vk_device_, &create_info, nullptr, &module);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateShaderModule(" << name << ") failed: " << result;
+    return VK_NULL_HANDLE;
+  }
+  VK_DEBUG_NAME(vk_device_, VK_OBJECT_TYPE_SHADER_MODULE, module, "%s",
+                name.c_str());
+  modules_[name] = module;
+  return module;
+}
+
+bool VulkanShaderLibrary::FindCode(const std::string& name,
+                                   ShaderCode* shader) const {
+  for (auto it = packs_.rbegin(); it != packs_.rend(); ++it) {
+    if ((*it)->Find(name, shader))
+      return true;
+  }
+  return FindEmbedded(name, shader);
+}
+
+// static
+bool VulkanShaderLibrary::FindEmbedded(const std::string& name,
+                                       ShaderCode* shader) {
+  for (const EmbeddedShader* embedded = kEmbeddedShaders; embedded->name;
+       ++embedded) {
+    if (name == embedded->name) {
+      shader->code = embedded->code;
+      shader->size = embedded->size;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,77 @@
+#ifndef VULKAN_SHADER_LIBRARY_H_
+#define VULKAN_SHADER_LIBRARY_H_
+
+#include <vulkan/vulkan.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// SPIR-V words of one shader; |size| is in bytes, as VkShaderModuleCreateInfo
+// wants it.
+struct ShaderCode {
+  const uint32_t* code = nullptr;
+  size_t size = 0;
+};
+
+// A file of precompiled shaders, memory-mapped read-only so modules are
+// created straight from the page cache without copying. Written by
+// shader/build_shaders.py --pack. Layout, little endian:
+//
+//   uint32_t magic ('WDSP'), version, count
+//   count x { char name[56]; uint32_t offset, size }  // offset from start
+//   SPIR-V, each shader 16-byte aligned
+class ShaderPack
+{
+public:
+  ShaderPack();
+  ~ShaderPack();
+
+  bool Open(const std::string& path);
+  void Close();
+
+  bool Find(const std::string& name, ShaderCode* shader) const;
+
+private:
+  bool Parse();
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  std::unordered_map<std::string, ShaderCode> shaders_;
+};
+
+// Creates every shader module once and hands out the same VkShaderModule to
+// all pipelines using it.
+//
+// Shaders are looked up by source file name ("shader.vert"), first in the
+// packs added with AddPack(), most recent first, then among the shaders
+// compiled into the binary by shader/build_shaders.py. Thread-safe.
+class VulkanShaderLibrary
+{
+public:
+  VulkanShaderLibrary();
+  ~VulkanShaderLibrary();
+
+  void Initialize(VkDevice device);
+  // Destroys the modules; pipelines created from them stay valid.
+  void Destroy();
+
+  bool AddPack(const std::string& path);
+
+  // VK_NULL_HANDLE if |name| is unknown or fails to compile.
+  VkShaderModule GetModule(const std::string& name);
+
+  static bool FindEmbedded(const std::string& name, ShaderCode* shader);
+
+private:
+  bool FindCode(const std::string& name, ShaderCode* shader) const;
+
+  VkDevice vk_device_ = VK_NULL_HANDLE;
+  std::vector<std::unique_ptr<ShaderPack>> packs_;
+  std::unordered_map<std::string, VkShaderModule> modules_;
+  std::mutex mutex_;
+};
+
+#endif /* VULKAN_SHADER_LIBRARY_H_ */
@@ -0,0 +1,123 @@
+
+#include "VulkanStartupTrace.h"
+#include "VulkanInstance.h"
+
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+
+VulkanStartupTrace::VulkanStartupTrace() {}
+
+VulkanStartupTrace::~VulkanStartupTrace() {}
+
+void VulkanStartupTrace::Start() {
+  phases_.clear();
+  total_milliseconds_ = 0.0;
+  first_frame_milliseconds_ = -1.0;
+  start_ = Clock::now();
+}
+
+bool VulkanStartupTrace::RunPhase(const char* name,
+                                  const std::function<VkResult()>& phase) {
+  Phase record;
+  record.name = name;
+  Clock::time_point start = Clock::now();
+  record.result = phase();
+  record.milliseconds = MillisecondsSince(start);
+  phases_.push_back(record);
+
+  if (VK_SUCCESS != record.result) {
+    DLOG(ERROR) << "Start-up phase " << name << " failed: "
+                << ResultName(record.result);
+    return false;
+  }
+  return true;
+}
+
+std::string VulkanStartupTrace::Finish() {
+  total_milliseconds_ = MillisecondsSince(start_);
+  return ToString();
+}
+
+void VulkanStartupTrace::MarkFirstFrame() {
+  if (first_frame_milliseconds_ < 0.0)
+    first_frame_milliseconds_ = MillisecondsSince(start_);
+}
+
+VkResult VulkanStartupTrace::result() const {
+  for (const Phase& phase : phases_) {
+    if (VK_SUCCESS != phase.result)
+      return phase.result;
+  }
+  return VK_SUCCESS;
+}
+
+std::string VulkanStartupTrace::ToString() const {
+  std::ostringstream stream;
+  stream << std::fixed << std::setprecision(2);
+  stream << "startup ok=" << (VK_SUCCESS == result() ? 1 : 0)
+         << " total_ms=" << total_milliseconds_;
+  if (first_frame_milliseconds_ >= 0.0)
+    stream << " first_frame_ms=" << first_frame_milliseconds_;
+  for (const Phase& phase : phases_) {
+    stream << " " << phase.name << "=" << phase.milliseconds << "/"
+           << ResultName(phase.result);
+  }
+  return stream.str();
+}
+
+// static
+const char* VulkanStartupTrace::ResultName(VkResult result) {
+  switch (result) {
+    case VK_SUCCESS:
+      return "VK_SUCCESS";
+    case VK_NOT_READY:
+      return "VK_NOT_READY";
+    case VK_TIMEOUT:
+      return "VK_TIMEOUT";
+    case VK_INCOMPLETE:
+      return "VK_INCOMPLETE";
+    case VK_ERROR_OUT_OF_HOST_MEMORY:
+      return "VK_ERROR_OUT_OF_HOST_MEMORY";
+    case VK_ERROR_OUT_OF_DEVICE_MEMORY:
+      return "VK_ERROR_OUT_OF_DEVICE_MEMORY";
+    case VK_ERROR_INITIALIZATION_FAILED:
+      return "VK_ERROR_INITIALIZATION_FAILED";
+    case VK_ERROR_DEVICE_LOST:
+      return "VK_ERROR_DEVICE_LOST";
+    case VK_ERROR_MEMORY_MAP_FAILED:
+      return "VK_ERROR_MEMORY_MAP_FAILED";
+    case VK_ERROR_LAYER_NOT_PRESENT:
+      return "VK_ERROR_LAYER_NOT_PRESENT";
+    case VK_ERROR_EXTENSION_NOT_PRESENT:
+      return "VK_ERROR_EXTENSION_NOT_PRESENT";
+    case VK_ERROR_FEATURE_NOT_PRESENT:
+      return "VK_ERROR_FEATURE_NOT_PRESENT";
+    case VK_ERROR_INCOMPATIBLE_DRIVER:
+      return "VK_ERROR_INCOMPATIBLE_DRIVER";
+    case VK_ERROR_TOO_MANY_OBJECTS:
+      return "VK_ERROR_TOO_MANY_OBJECTS";
+    case VK_ERROR_FORMAT_NOT_SUPPORTED:
+      return "VK_ERROR_FORMAT_NOT_SUPPORTED";
+    case VK_ERROR_SURFACE_LOST_KHR:
+      return "VK_ERROR_SURFACE_LOST_KHR";
+    case VK_ERROR_NATIVE_WINDOW_IN_USE_KHR:
+      return "VK_ERROR_NATIVE_WINDOW_IN_USE_KHR";
+    case VK_SUBOPTIMAL_KHR:
+      return "VK_SUBOPTIMAL_KHR";
+    case VK_ERROR_OUT_OF_DATE_KHR:
+      return "VK_ERROR_OUT_OF_DATE_KHR";
+    default:
+      return "VK_RESULT_UNKNOWN";
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef VULKAN_STARTUP_TRACE_H_
+#define VULKAN_STARTUP_TRACE_H_
+
+#include <vulkan/vulkan.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Wall time and VkResult of each phase of renderer start-up, plus the time
+// to the first submitted frame.
+//
+// Phases run in order through RunPhase(); the trace stops at the first
+// failing one, so the report shows exactly where start-up broke. Times come
+// from std::chrono::steady_clock.
+class VulkanStartupTrace
+{
+public:
+  struct Phase {
+    std::string name;
+    double milliseconds = 0.0;
+    VkResult result = VK_SUCCESS;
+  };
+
+  VulkanStartupTrace();
+  ~VulkanStartupTrace();
+
+  // Drops any previous trace and starts the clock.
+  void Start();
+  // Times |phase| and records its result. Returns whether it succeeded.
+  bool RunPhase(const char* name, const std::function<VkResult()>& phase);
+  // Stops the clock. Returns the one-line report.
+  std::string Finish();
+  // Records the time from Start() to the first frame; later calls are
+  // ignored.
+  void MarkFirstFrame();
+
+  const std::vector<Phase>& phases() const { return phases_; }
+  // The first failure, VK_SUCCESS if every phase succeeded.
+  VkResult result() const;
+  double total_milliseconds() const { return total_milliseconds_; }
+  // Negative until MarkFirstFrame().
+  double first_frame_milliseconds() const { return first_frame_milliseconds_; }
+
+  // "startup ok=1 total_ms=41.20 instance=3.10/VK_SUCCESS ...": key=value
+  // pairs, phases as <name>=<ms>/<result>.
+  std::string ToString() const;
+
+  static const char* ResultName(VkResult result);
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  Clock::time_point start_;
+  std::vector<Phase> phases_;
+  double total_milliseconds_ = 0.0;
+  double first_frame_milliseconds_ = -1.0;
+};
+
+#endif /* VULKAN_STARTUP_TRACE_H_ */
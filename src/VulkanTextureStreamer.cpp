@@ -0,0 +1,585 @@
+#include "VulkanTextureStreamer.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanInstance.h"
+#include "VulkanUploader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+namespace {
+
+// Larger images are rejected rather than decoded.
+const uint32_t kMaxDimension = 16384;
+
+uint32_t LevelDimension(uint32_t dimension, uint32_t level) {
+  return std::max(dimension >> level, 1u);
+}
+
+// Reads the header values of a binary PPM, skipping comments.
+bool ReadPpmValue(std::ifstream* file, uint32_t* value) {
+  for (;;) {
+    *file >> std::ws;
+    if (file->peek() != '#')
+      break;
+    std::string comment;
+    std::getline(*file, comment);
+  }
+  return static_cast<bool>(*file >> *value);
+}
+
+// Box filter, clamping at odd edges.
+void Downsample(uint32_t width, uint32_t height, const uint8_t* src,
+                uint32_t dst_width, uint32_t dst_height, uint8_t* dst) {
+  for (uint32_t y = 0; y < dst_height; ++y) {
+    const uint32_t y0 = std::min(y * 2, height - 1);
+    const uint32_t y1 = std::min(y * 2 + 1, height - 1);
+    for (uint32_t x = 0; x < dst_width; ++x) {
+      const uint32_t x0 = std::min(x * 2, width - 1);
+      const uint32_t x1 = std::min(x * 2 + 1, width - 1);
+      for (uint32_t c = 0; c < 4; ++c) {
+        const uint32_t sum = src[(y0 * width + x0) * 4 + c] +
+                             src[(y0 * width + x1) * 4 + c] +
+                             src[(y1 * width + x0) * 4 + c] +
+                             src[(y1 * width + x1) * 4 + c];
+        dst[(y * dst_width + x) * 4 + c] = static_cast<uint8_t>((sum + 2) / 4);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+
+const VulkanTextureStreamer::TextureId VulkanTextureStreamer::kInvalidTexture;
+const VkFormat VulkanTextureStreamer::kFormat;
+const uint32_t VulkanTextureStreamer::kTailDimension;
+const VkDeviceSize VulkanTextureStreamer::kDefaultBudget;
+const VkDeviceSize VulkanTextureStreamer::kUploadBytesPerFrame;
+
+VulkanTextureStreamer::VulkanTextureStreamer() {}
+
+VulkanTextureStreamer::~VulkanTextureStreamer() {
+  DCHECK(workers_.empty());
+}
+
+bool VulkanTextureStreamer::Initialize(VkDevice device,
+                                       VulkanMemoryAllocator* allocator,
+                                       VulkanUploader* uploader,
+                                       VulkanBindlessTable* table,
+                                       uint32_t frame_slots,
+                                       VkDeviceSize budget,
+                                       uint32_t thread_count) {
+  DCHECK(workers_.empty());
+  device_ = device;
+  allocator_ = allocator;
+  uploader_ = uploader;
+  table_ = table;
+  budget_ = budget;
+  // A level is uploaded in one piece, and half the ring keeps it from
+  // waiting on itself.
+  max_level_bytes_ = uploader_->ring_size() / 2;
+  garbage_.assign(frame_slots, std::vector<Garbage>());
+  committed_bytes_ = 0;
+  frame_ = 0;
+  stopping_ = false;
+
+  VkSamplerCreateInfo sampler_info = {};
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  // Views start at the finest resident level, which is LOD 0.
+  sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+  VkResult result = vkCreateSampler(device_, &sampler_info, nullptr, &sampler_);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateSampler() failed: " << result;
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_SAMPLER, sampler_, "texture sampler");
+  sampler_handle_ = table_->AddSampler(sampler_);
+  if (VulkanBindlessTable::kInvalidHandle == sampler_handle_) {
+    Destroy();
+    return false;
+  }
+
+  if (thread_count == 0)
+    thread_count = std::max(std::thread::hardware_concurrency() / 2, 1u);
+  for (uint32_t i = 0; i < thread_count; ++i)
+    workers_.push_back(std::thread(&VulkanTextureStreamer::WorkerLoop, this));
+  return true;
+}
+
+void VulkanTextureStreamer::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queue_cv_.notify_all();
+  for (std::thread& worker : workers_)
+    worker.join();
+  workers_.clear();
+  queue_.clear();
+  decoded_.clear();
+
+  for (Texture& texture : textures_) {
+    RetireView(&texture);
+    if (texture.next.image != texture.current.image)
+      Retire(&texture.next);
+    Retire(&texture.current);
+  }
+  textures_.clear();
+  streaming_.clear();
+  for (uint32_t slot = 0; slot < garbage_.size(); ++slot)
+    DestroyGarbage(slot);
+  garbage_.clear();
+
+  if (VulkanBindlessTable::kInvalidHandle != sampler_handle_)
+    table_->RemoveSampler(sampler_handle_);
+  sampler_handle_ = VulkanBindlessTable::kInvalidHandle;
+  if (VK_NULL_HANDLE != sampler_)
+    vkDestroySampler(device_, sampler_, nullptr);
+  sampler_ = VK_NULL_HANDLE;
+  device_ = VK_NULL_HANDLE;
+}
+
+VulkanTextureStreamer::TextureId VulkanTextureStreamer::Load(
+    const std::string& path) {
+  const TextureId id = static_cast<TextureId>(textures_.size());
+  textures_.push_back(Texture());
+  Texture& texture = textures_.back();
+  texture.path = path;
+  texture.decoding = true;
+  texture.last_used = frame_;
+
+  Decoded job;
+  job.texture = id;
+  job.path = path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(job));
+  }
+  queue_cv_.notify_one();
+  return id;
+}
+
+void VulkanTextureStreamer::Touch(TextureId texture) {
+  textures_[texture].last_used = frame_ + 1;
+}
+
+bool VulkanTextureStreamer::Update(uint32_t frame_slot) {
+  ++frame_;
+  frame_slot_ = frame_slot;
+  handles_changed_ = false;
+  DestroyGarbage(frame_slot);
+  CollectDecoded();
+
+  VkDeviceSize upload_budget = kUploadBytesPerFrame;
+  for (size_t i = 0; i < streaming_.size();) {
+    if (Stream(&textures_[streaming_[i]], &upload_budget))
+      streaming_.erase(streaming_.begin() + i);
+    else
+      ++i;
+  }
+  RequestReloads();
+
+  stats_.textures = static_cast<uint32_t>(textures_.size());
+  stats_.full_resolution = 0;
+  for (const Texture& texture : textures_) {
+    if (VK_NULL_HANDLE != texture.view && texture.view_level == 0)
+      ++stats_.full_resolution;
+  }
+  stats_.committed_bytes = committed_bytes_;
+  return handles_changed_;
+}
+
+void VulkanTextureStreamer::WorkerLoop() {
+  for (;;) {
+    Decoded job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    job.ok = Decode(job.path, max_level_bytes_, &job);
+    if (!job.ok)
+      LOG(WARNING) << "Failed to decode texture " << job.path;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    decoded_.push_back(std::move(job));
+  }
+}
+
+// static
+bool VulkanTextureStreamer::Decode(const std::string& path,
+                                   VkDeviceSize max_level_bytes,
+                                   Decoded* decoded) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  std::string magic;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t max_value = 0;
+  if (!(file >> magic) || magic != "P6" || !ReadPpmValue(&file, &width) ||
+      !ReadPpmValue(&file, &height) || !ReadPpmValue(&file, &max_value))
+    return false;
+  // Exactly one whitespace character separates the header from the raster.
+  file.get();
+  if (width == 0 || height == 0 || width > kMaxDimension ||
+      height > kMaxDimension || max_value != 255)
+    return false;
+
+  std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+  if (!file.read(reinterpret_cast<char*>(rgb.data()), rgb.size()))
+    return false;
+
+  decoded->levels.clear();
+  decoded->levels.push_back(Level());
+  Level& base = decoded->levels.back();
+  base.width = width;
+  base.height = height;
+  base.pixels.resize(static_cast<size_t>(width) * height * 4);
+  for (size_t i = 0; i < static_cast<size_t>(width) * height; ++i) {
+    base.pixels[i * 4 + 0] = rgb[i * 3 + 0];
+    base.pixels[i * 4 + 1] = rgb[i * 3 + 1];
+    base.pixels[i * 4 + 2] = rgb[i * 3 + 2];
+    base.pixels[i * 4 + 3] = 255;
+  }
+
+  while (decoded->levels.back().width > 1 ||
+         decoded->levels.back().height > 1) {
+    const Level& src = decoded->levels.back();
+    Level level;
+    level.width = LevelDimension(src.width, 1);
+    level.height = LevelDimension(src.height, 1);
+    level.pixels.resize(static_cast<size_t>(level.width) * level.height * 4);
+    Downsample(src.width, src.height, src.pixels.data(), level.width,
+               level.height, level.pixels.data());
+    decoded->levels.push_back(std::move(level));
+  }
+
+  size_t first = 0;
+  while (first + 1 < decoded->levels.size() &&
+         decoded->levels[first].pixels.size() > max_level_bytes)
+    ++first;
+  decoded->levels.erase(decoded->levels.begin(),
+                        decoded->levels.begin() + first);
+  return true;
+}
+
+void VulkanTextureStreamer::CollectDecoded() {
+  std::deque<Decoded> decoded;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    decoded.swap(decoded_);
+  }
+
+  for (Decoded& result : decoded) {
+    Texture& texture = textures_[result.texture];
+    texture.decoding = false;
+    if (!result.ok) {
+      ++stats_.decode_failures;
+      continue;
+    }
+
+    if (texture.level_count == 0) {
+      texture.width = result.levels[0].width;
+      texture.height = result.levels[0].height;
+      texture.level_count = static_cast<uint32_t>(result.levels.size());
+      texture.tail_level = texture.level_count - 1;
+      while (texture.tail_level > 0 &&
+             std::max(result.levels[texture.tail_level - 1].width,
+                      result.levels[texture.tail_level - 1].height) <=
+                 kTailDimension)
+        --texture.tail_level;
+      texture.tail.assign(result.levels.begin() + texture.tail_level,
+                          result.levels.end());
+      texture.current.uploaded_level = texture.level_count;
+      texture.view_level = texture.level_count;
+    }
+    DCHECK_EQ(texture.level_count, result.levels.size());
+    texture.levels = std::move(result.levels);
+    StartStreaming(result.texture);
+  }
+}
+
+bool VulkanTextureStreamer::CreateNext(Texture* texture, uint32_t first_level) {
+  DCHECK_EQ(static_cast<VkImage>(VK_NULL_HANDLE), texture->next.image);
+  VkImageCreateInfo image_info = {};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = kFormat;
+  image_info.extent.width = LevelDimension(texture->width, first_level);
+  image_info.extent.height = LevelDimension(texture->height, first_level);
+  image_info.extent.depth = 1;
+  image_info.mipLevels = texture->level_count - first_level;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage =
+      VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  // Written on the transfer queue and handed over level by level.
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  Image& next = texture->next;
+  if (!allocator_->CreateImage(image_info, VulkanMemoryAllocator::kGpuOnly,
+                               &next.image, &next.memory)) {
+    DLOG(ERROR) << "Failed to allocate texture " << texture->path;
+    return false;
+  }
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_IMAGE, next.image, "%s mip %u",
+                texture->path.c_str(), first_level);
+  next.first_level = first_level;
+  next.uploaded_level = texture->level_count;
+  committed_bytes_ += next.memory.size;
+  return true;
+}
+
+void VulkanTextureStreamer::StartStreaming(TextureId id) {
+  Texture& texture = textures_[id];
+  const uint32_t resident_level = VK_NULL_HANDLE != texture.current.image
+                                      ? texture.current.first_level
+                                      : texture.level_count;
+
+  // The finest chain that fits once the least recently used textures are
+  // evicted; the tail always gets in.
+  const VkDeviceSize available =
+      budget_ + EvictableBytes(id) -
+      std::min(committed_bytes_, budget_ + EvictableBytes(id));
+  uint32_t first_level = 0;
+  while (first_level < texture.tail_level &&
+         ChainBytes(texture, first_level) > available)
+    ++first_level;
+
+  if (first_level >= resident_level ||
+      (first_level < texture.tail_level &&
+       !MakeRoom(ChainBytes(texture, first_level), id)) ||
+      !CreateNext(&texture, first_level)) {
+    texture.levels.clear();
+    texture.levels.shrink_to_fit();
+    return;
+  }
+  streaming_.push_back(id);
+}
+
+bool VulkanTextureStreamer::Stream(Texture* texture,
+                                   VkDeviceSize* upload_budget) {
+  Image& next = texture->next;
+  bool uploaded = false;
+  while (next.uploaded_level > next.first_level) {
+    const uint32_t level = next.uploaded_level - 1;
+    const Level& data = texture->levels[level];
+    const VkDeviceSize size = data.pixels.size();
+    // A level larger than a frame's budget still goes out on its own.
+    if ((size > *upload_budget && *upload_budget < kUploadBytesPerFrame) ||
+        !uploader_->HasRoom(size))
+      break;
+
+    VkExtent3D extent = { data.width, data.height, 1 };
+    void* mapped = uploader_->ReserveImage(
+        next.image, level - next.first_level, extent, size);
+    if (!mapped)
+      break;
+    memcpy(mapped, data.pixels.data(), size);
+    next.uploaded_level = level;
+    *upload_budget -= std::min(size, *upload_budget);
+    stats_.bytes_uploaded += size;
+    uploaded = true;
+  }
+
+  // Switching before |next| shows as much as |current| would blur it. A
+  // failed switch is retried the next frame.
+  if (next.uploaded_level < texture->level_count &&
+      next.uploaded_level <= texture->view_level &&
+      (uploaded || next.image != texture->current.image))
+    Present(texture);
+
+  if (next.uploaded_level > next.first_level ||
+      next.image != texture->current.image)
+    return false;
+  texture->next = Image();
+  texture->levels.clear();
+  texture->levels.shrink_to_fit();
+  return true;
+}
+
+bool VulkanTextureStreamer::Present(Texture* texture) {
+  Image& next = texture->next;
+  VkImageViewCreateInfo view_info = {};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = next.image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = kFormat;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.baseMipLevel =
+      next.uploaded_level - next.first_level;
+  view_info.subresourceRange.levelCount =
+      texture->level_count - next.uploaded_level;
+  view_info.subresourceRange.layerCount = 1;
+  VkImageView view = VK_NULL_HANDLE;
+  VkResult result = vkCreateImageView(device_, &view_info, nullptr, &view);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateImageView() failed: " << result;
+    return false;
+  }
+  VulkanBindlessTable::Handle handle = table_->AddSampledImage(
+      view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  if (VulkanBindlessTable::kInvalidHandle == handle) {
+    vkDestroyImageView(device_, view, nullptr);
+    return false;
+  }
+
+  RetireView(texture);
+  if (texture->current.image != next.image)
+    Retire(&texture->current);
+  texture->current = next;
+  texture->view = view;
+  texture->view_level = next.uploaded_level;
+  texture->handle = handle;
+  handles_changed_ = true;
+  return true;
+}
+
+bool VulkanTextureStreamer::Evict(TextureId id) {
+  Texture& texture = textures_[id];
+  DCHECK(Evictable(id, kInvalidTexture));
+  if (!uploader_->HasRoom(ChainBytes(texture, texture.tail_level)) ||
+      !CreateNext(&texture, texture.tail_level))
+    return false;
+
+  // Tiny, so it all goes out at once, whatever the frame's budget.
+  Image& next = texture.next;
+  for (uint32_t level = texture.level_count; level-- > texture.tail_level;) {
+    const Level& data = texture.tail[level - texture.tail_level];
+    VkExtent3D extent = { data.width, data.height, 1 };
+    void* mapped = uploader_->ReserveImage(
+        next.image, level - next.first_level, extent, data.pixels.size());
+    if (!mapped) {
+      Retire(&next);
+      return false;
+    }
+    memcpy(mapped, data.pixels.data(), data.pixels.size());
+    stats_.bytes_uploaded += data.pixels.size();
+  }
+  next.uploaded_level = next.first_level;
+  if (!Present(&texture)) {
+    Retire(&next);
+    return false;
+  }
+  texture.next = Image();
+  ++stats_.evictions;
+  return true;
+}
+
+void VulkanTextureStreamer::RequestReloads() {
+  for (TextureId id = 0; id < textures_.size(); ++id) {
+    Texture& texture = textures_[id];
+    // Used this frame, missing its finest levels and not on its way yet.
+    if (texture.last_used < frame_ || texture.decoding ||
+        VK_NULL_HANDLE != texture.next.image ||
+        VK_NULL_HANDLE == texture.current.image ||
+        texture.current.first_level == 0)
+      continue;
+    if (committed_bytes_ + ChainBytes(texture, 0) >
+        budget_ + EvictableBytes(id))
+      continue;
+
+    texture.decoding = true;
+    ++stats_.reloads;
+    Decoded job;
+    job.texture = id;
+    job.path = texture.path;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(job));
+    }
+    queue_cv_.notify_one();
+  }
+}
+
+// static
+VkDeviceSize VulkanTextureStreamer::ChainBytes(const Texture& texture,
+                                               uint32_t first_level) {
+  VkDeviceSize bytes = 0;
+  for (uint32_t level = first_level; level < texture.level_count; ++level) {
+    bytes += static_cast<VkDeviceSize>(LevelDimension(texture.width, level)) *
+             LevelDimension(texture.height, level) * 4;
+  }
+  return bytes;
+}
+
+bool VulkanTextureStreamer::Evictable(TextureId id, TextureId except) const {
+  const Texture& texture = textures_[id];
+  return id != except && texture.last_used < frame_ &&
+         VK_NULL_HANDLE == texture.next.image &&
+         VK_NULL_HANDLE != texture.current.image &&
+         texture.current.first_level < texture.tail_level;
+}
+
+VkDeviceSize VulkanTextureStreamer::EvictableBytes(TextureId except) const {
+  VkDeviceSize bytes = 0;
+  for (TextureId id = 0; id < textures_.size(); ++id) {
+    if (!Evictable(id, except))
+      continue;
+    const Texture& texture = textures_[id];
+    bytes += ChainBytes(texture, texture.current.first_level) -
+             ChainBytes(texture, texture.tail_level);
+  }
+  return bytes;
+}
+
+bool VulkanTextureStreamer::MakeRoom(VkDeviceSize bytes, TextureId except) {
+  while (committed_bytes_ + bytes > budget_) {
+    TextureId victim = kInvalidTexture;
+    for (TextureId id = 0; id < textures_.size(); ++id) {
+      if (Evictable(id, except) &&
+          (kInvalidTexture == victim ||
+           textures_[id].last_used < textures_[victim].last_used))
+        victim = id;
+    }
+    if (kInvalidTexture == victim || !Evict(victim))
+      return false;
+  }
+  return true;
+}
+
+void VulkanTextureStreamer::Retire(Image* image) {
+  if (VK_NULL_HANDLE == image->image)
+    return;
+  Garbage garbage;
+  garbage.image = image->image;
+  garbage.memory = image->memory;
+  garbage_[frame_slot_].push_back(garbage);
+  committed_bytes_ -= image->memory.size;
+  *image = Image();
+}
+
+void VulkanTextureStreamer::RetireView(Texture* texture) {
+  if (VulkanBindlessTable::kInvalidHandle != texture->handle)
+    table_->RemoveSampledImage(texture->handle);
+  texture->handle = VulkanBindlessTable::kInvalidHandle;
+  if (VK_NULL_HANDLE == texture->view)
+    return;
+  Garbage garbage;
+  garbage.view = texture->view;
+  garbage_[frame_slot_].push_back(garbage);
+  texture->view = VK_NULL_HANDLE;
+}
+
+void VulkanTextureStreamer::DestroyGarbage(uint32_t frame_slot) {
+  for (Garbage& garbage : garbage_[frame_slot]) {
+    if (VK_NULL_HANDLE != garbage.view)
+      vkDestroyImageView(device_, garbage.view, nullptr);
+    if (VK_NULL_HANDLE != garbage.image)
+      allocator_->DestroyImage(garbage.image, &garbage.memory);
+  }
+  garbage_[frame_slot].clear();
+}
@@ -0,0 +1,219 @@
+#ifndef VULKAN_TEXTURE_STREAMER_H_
+#define VULKAN_TEXTURE_STREAMER_H_
+
+#include <vulkan/vulkan.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "VulkanBindlessTable.h"
+#include "VulkanMemoryAllocator.h"
+
+class VulkanUploader;
+
+// Streams textures from disk into sampled images without ever blocking the
+// render thread.
+//
+// Load() only queues the file: a worker thread decodes it and builds its
+// mip chain. Update(), once per frame on the render thread, uploads the
+// levels coarsest first through the uploader's staging ring (on the
+// transfer queue when there is one), no more than kUploadBytesPerFrame and
+// only what the ring takes without waiting. After every frame that added
+// levels the texture's bindless handle moves to a view of everything
+// uploaded so far, so a blurry texture shows within a frame of decoding
+// and sharpens to full resolution over the next ones. The uploader submits
+// ahead of the frame, so a level is complete before anything samples it.
+//
+// Device memory is held to a budget. A texture that does not fit gets only
+// the coarser levels that do, down to its mip tail (the levels of at most
+// kTailDimension texels), which is kept on the CPU for every texture. To
+// make room, the least recently used textures fall back to their tail; a
+// texture used again is reloaded from disk once its full chain fits.
+//
+// Replaced images, views and handles are released framesInFlight frames
+// later, once no frame can sample them; they no longer count against the
+// budget meanwhile.
+//
+// Reads binary PPM (P6, 8 bits per channel). Levels larger than half the
+// staging ring are dropped, i.e. the chain starts at the first level that
+// fits. Not thread-safe; used from the render thread.
+class VulkanTextureStreamer
+{
+public:
+  typedef uint32_t TextureId;
+
+  struct Stats {
+    uint32_t textures = 0;
+    // Textures showing their full chain.
+    uint32_t full_resolution = 0;
+    VkDeviceSize committed_bytes = 0;
+    uint64_t bytes_uploaded = 0;
+    uint64_t evictions = 0;
+    uint64_t reloads = 0;
+    uint64_t decode_failures = 0;
+  };
+
+  static const TextureId kInvalidTexture = UINT32_MAX;
+  static const VkFormat kFormat = VK_FORMAT_R8G8B8A8_UNORM;
+  // Largest dimension of the mip levels kept on the CPU.
+  static const uint32_t kTailDimension = 64;
+  static const VkDeviceSize kDefaultBudget = 256 * 1024 * 1024;
+  static const VkDeviceSize kUploadBytesPerFrame = 8 * 1024 * 1024;
+
+  VulkanTextureStreamer();
+  ~VulkanTextureStreamer();
+
+  // |frame_slots| is the number of frames in flight. |thread_count| 0 uses
+  // half the hardware threads for decoding.
+  bool Initialize(VkDevice device, VulkanMemoryAllocator* allocator,
+                  VulkanUploader* uploader, VulkanBindlessTable* table,
+                  uint32_t frame_slots, VkDeviceSize budget = kDefaultBudget,
+                  uint32_t thread_count = 0);
+  // The caller guarantees the GPU no longer uses anything.
+  void Destroy();
+
+  // Queues |path| for decoding and returns at once.
+  TextureId Load(const std::string& path);
+
+  // Marks |texture| as used by the frame being built, which keeps it from
+  // eviction and lets an evicted texture reload.
+  void Touch(TextureId texture);
+  // Call once per frame once |frame_slot|'s fence has signaled, after the
+  // table's BeginFrame() and before the uploader's Submit(). Returns true
+  // when any handle changed, which changes what frames have to record.
+  bool Update(uint32_t frame_slot);
+
+  // The sampled-image handle frames should use, kInvalidHandle until the
+  // first levels are in.
+  VulkanBindlessTable::Handle handle(TextureId texture) const {
+    return textures_[texture].handle;
+  }
+  // Trilinear and repeating.
+  VulkanBindlessTable::Handle sampler() const { return sampler_handle_; }
+
+  const Stats& stats() const { return stats_; }
+
+private:
+  struct Level {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // Tightly packed RGBA8 rows.
+    std::vector<uint8_t> pixels;
+  };
+
+  struct Decoded {
+    TextureId texture = kInvalidTexture;
+    std::string path;
+    bool ok = false;
+    // The whole chain, finest first.
+    std::vector<Level> levels;
+  };
+
+  // Holds chain levels [first_level, level_count) of its texture.
+  struct Image {
+    VkImage image = VK_NULL_HANDLE;
+    VulkanAllocation memory;
+    uint32_t first_level = 0;
+    // Finest chain level uploaded; the texture's level_count while empty.
+    uint32_t uploaded_level = 0;
+  };
+
+  struct Texture {
+    std::string path;
+    // Set by the first decode. Level 0 of the chain is width x height.
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t level_count = 0;
+    uint32_t tail_level = 0;
+    // Levels [tail_level, level_count), kept for good.
+    std::vector<Level> tail;
+    // The decoded chain while |next| streams in.
+    std::vector<Level> levels;
+    bool decoding = false;
+
+    // Sampled through |view|, levels [view_level, level_count).
+    Image current;
+    VkImageView view = VK_NULL_HANDLE;
+    uint32_t view_level = 0;
+    VulkanBindlessTable::Handle handle = VulkanBindlessTable::kInvalidHandle;
+    // Being uploaded; replaces |current| once it shows at least as much.
+    Image next;
+
+    uint64_t last_used = 0;
+  };
+
+  struct Garbage {
+    VkImage image = VK_NULL_HANDLE;
+    VulkanAllocation memory;
+    VkImageView view = VK_NULL_HANDLE;
+  };
+
+  void WorkerLoop();
+  // Decodes |path| into |decoded|'s chain, dropping levels over
+  // |max_level_bytes|.
+  static bool Decode(const std::string& path, VkDeviceSize max_level_bytes,
+                     Decoded* decoded);
+  void CollectDecoded();
+
+  // Creates |texture|.next for chain levels [first_level, level_count).
+  bool CreateNext(Texture* texture, uint32_t first_level);
+  // Picks how much of a freshly decoded chain to upload and starts it.
+  void StartStreaming(TextureId id);
+  // Uploads |texture|.next's next levels. Returns true when done.
+  bool Stream(Texture* texture, VkDeviceSize* upload_budget);
+  // Points |texture|'s handle at everything uploaded to |next|.
+  bool Present(Texture* texture);
+  // Drops |texture| back to its mip tail.
+  bool Evict(TextureId id);
+  void RequestReloads();
+
+  // Bytes of chain levels [first_level, level_count) of |texture|.
+  static VkDeviceSize ChainBytes(const Texture& texture, uint32_t first_level);
+  // Budget that evicting every texture not used this frame, bar |except|,
+  // would free.
+  VkDeviceSize EvictableBytes(TextureId except) const;
+  // Evicts least recently used textures until |bytes| more fit.
+  bool MakeRoom(VkDeviceSize bytes, TextureId except);
+  bool Evictable(TextureId id, TextureId except) const;
+
+  void Retire(Image* image);
+  void RetireView(Texture* texture);
+  void DestroyGarbage(uint32_t frame_slot);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VulkanMemoryAllocator* allocator_ = nullptr;
+  VulkanUploader* uploader_ = nullptr;
+  VulkanBindlessTable* table_ = nullptr;
+  VkDeviceSize budget_ = 0;
+  VkDeviceSize max_level_bytes_ = 0;
+
+  VkSampler sampler_ = VK_NULL_HANDLE;
+  VulkanBindlessTable::Handle sampler_handle_ =
+      VulkanBindlessTable::kInvalidHandle;
+
+  std::vector<Texture> textures_;
+  // Textures with a |next| image, in the order they started.
+  std::vector<TextureId> streaming_;
+  // Live images; garbage is not counted.
+  VkDeviceSize committed_bytes_ = 0;
+  std::vector<std::vector<Garbage> > garbage_;
+  uint32_t frame_slot_ = 0;
+  uint64_t frame_ = 0;
+  bool handles_changed_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable queue_cv_;
+  std::deque<Decoded> queue_;
+  std::deque<Decoded> decoded_;
+  std::vector<std::thread> workers_;
+  bool stopping_ = false;
+
+  Stats stats_;
+};
+
+#endif /* VULKAN_TEXTURE_STREAMER_H_ */
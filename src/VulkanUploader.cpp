@@ -0,0 +1,610 @@
+
+#include "VulkanUploader.h"
+#include "VulkanDebugUtils.h"
+#include "VulkanInstance.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Stages that read uploaded data.
+const VkPipelineStageFlags kConsumerStages =
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+    VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+// Accesses that read uploaded data.
+const VkAccessFlags kConsumerAccess =
+    VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+    VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT |
+    VK_ACCESS_SHADER_READ_BIT;
+
+const VkPipelineStageFlags kBottomOfPipe = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+// Stages that sample uploaded images.
+const VkPipelineStageFlags kImageConsumerStages =
+    VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+// Transition of the one mip level |region| copies into.
+VkImageMemoryBarrier LevelBarrier(VkImage image,
+                                  const VkBufferImageCopy& region,
+                                  VkImageLayout old_layout,
+                                  VkImageLayout new_layout) {
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = old_layout;
+  barrier.newLayout = new_layout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = region.imageSubresource.aspectMask;
+  barrier.subresourceRange.baseMipLevel = region.imageSubresource.mipLevel;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.baseArrayLayer =
+      region.imageSubresource.baseArrayLayer;
+  barrier.subresourceRange.layerCount = region.imageSubresource.layerCount;
+  return barrier;
+}
+
+}  // namespace
+
+
+const VkDeviceSize VulkanUploader::kDefaultRingSize;
+const VkDeviceSize VulkanUploader::kAlignment;
+
+VulkanUploader::VulkanUploader() {}
+
+VulkanUploader::~VulkanUploader() {
+  DCHECK(submissions_.empty());
+}
+
+void VulkanUploader::SetTransferQueue(uint32_t family_index, VkQueue queue) {
+  DCHECK(submissions_.empty());
+  transfer_family_index_ = family_index;
+  transfer_queue_ = queue;
+}
+
+bool VulkanUploader::Initialize(VkDevice device,
+                                VulkanMemoryAllocator* allocator,
+                                uint32_t queue_family_index, VkQueue queue,
+                                VkDeviceSize ring_size, uint32_t slot_count) {
+  DCHECK(submissions_.empty());
+  device_ = device;
+  allocator_ = allocator;
+  queue_ = queue;
+  queue_family_index_ = queue_family_index;
+
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = AlignUp(ring_size, kAlignment);
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  // Both queues read the ring; nothing is ever written to it on the GPU, so
+  // concurrent sharing costs nothing here.
+  uint32_t families[] = { queue_family_index_, transfer_family_index_ };
+  if (has_transfer_queue()) {
+    buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    buffer_info.queueFamilyIndexCount = arraysize(families);
+    buffer_info.pQueueFamilyIndices = families;
+  } else {
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  }
+  if (!allocator_->CreateBuffer(buffer_info, VulkanMemoryAllocator::kCpuToGpu,
+                                &ring_buffer_, &ring_)) {
+    DLOG(ERROR) << "Failed to create the staging ring";
+    return false;
+  }
+  // The allocation may be larger than asked for; only use what the buffer
+  // covers.
+  ring_.size = buffer_info.size;
+  DCHECK(ring_.mapped);
+  VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_BUFFER, ring_buffer_, "staging ring");
+
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  VkSemaphoreCreateInfo semaphore_info = {};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  submissions_.resize(std::max(slot_count, 1u));
+  for (Submission& submission : submissions_) {
+    if (!CreateCommandBuffer(queue_family_index_, &submission.command_pool,
+                             &submission.command_buffer)) {
+      Destroy();
+      return false;
+    }
+    if (has_transfer_queue()) {
+      if (!CreateCommandBuffer(transfer_family_index_,
+                               &submission.transfer_command_pool,
+                               &submission.transfer_command_buffer)) {
+        Destroy();
+        return false;
+      }
+      vkCreateSemaphore(device_, &semaphore_info, nullptr,
+                        &submission.transfer_done);
+    }
+    vkCreateFence(device_, &fence_info, nullptr, &submission.fence);
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_COMMAND_BUFFER,
+                  submission.command_buffer, "upload");
+    VK_DEBUG_NAME(device_, VK_OBJECT_TYPE_COMMAND_BUFFER,
+                  submission.transfer_command_buffer, "upload transfer");
+  }
+
+  head_ = tail_ = flushed_ = 0;
+  next_submission_ = 0;
+  return true;
+}
+
+bool VulkanUploader::CreateCommandBuffer(uint32_t family_index,
+                                         VkCommandPool* pool,
+                                         VkCommandBuffer* command_buffer) {
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = family_index;
+
+  VkResult result = vkCreateCommandPool(device_, &pool_info, nullptr, pool);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkCreateCommandPool() failed: " << result;
+    return false;
+  }
+
+  VkCommandBufferAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.commandPool = *pool;
+  alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  alloc_info.commandBufferCount = 1;
+  vkAllocateCommandBuffers(device_, &alloc_info, command_buffer);
+  return true;
+}
+
+void VulkanUploader::Destroy() {
+  WaitIdle();
+  for (Submission& submission : submissions_) {
+    if (VK_NULL_HANDLE != submission.fence)
+      vkDestroyFence(device_, submission.fence, nullptr);
+    if (VK_NULL_HANDLE != submission.transfer_done)
+      vkDestroySemaphore(device_, submission.transfer_done, nullptr);
+    if (VK_NULL_HANDLE != submission.transfer_command_pool)
+      vkDestroyCommandPool(device_, submission.transfer_command_pool, nullptr);
+    if (VK_NULL_HANDLE != submission.command_pool)
+      vkDestroyCommandPool(device_, submission.command_pool, nullptr);
+  }
+  submissions_.clear();
+  pending_.clear();
+  pending_initial_.clear();
+  pending_images_.clear();
+  pending_bytes_ = 0;
+
+  if (allocator_)
+    allocator_->DestroyBuffer(ring_buffer_, &ring_);
+  ring_buffer_ = VK_NULL_HANDLE;
+  allocator_ = nullptr;
+  device_ = VK_NULL_HANDLE;
+}
+
+bool VulkanUploader::Upload(VkBuffer dst, VkDeviceSize dst_offset,
+                            const void* data, VkDeviceSize size,
+                            bool initial) {
+  const char* src = static_cast<const char*>(data);
+  // Half the ring per chunk keeps a big upload from waiting on itself.
+  const VkDeviceSize max_chunk = std::max(ring_.size / 2, kAlignment);
+  while (size > 0) {
+    VkDeviceSize chunk = std::min(size, max_chunk);
+    void* mapped = Reserve(dst, dst_offset, chunk, initial);
+    if (!mapped)
+      return false;
+    memcpy(mapped, src, chunk);
+    src += chunk;
+    dst_offset += chunk;
+    size -= chunk;
+  }
+  return true;
+}
+
+void* VulkanUploader::Reserve(VkBuffer dst, VkDeviceSize dst_offset,
+                              VkDeviceSize size, bool initial) {
+  VkDeviceSize offset = 0;
+  if (size == 0 || !AllocateRing(size, &offset))
+    return nullptr;
+
+  std::vector<Copy>& pending = initial ? pending_initial_ : pending_;
+
+  // Back-to-back uploads into one buffer collapse into a single region.
+  if (!pending.empty()) {
+    Copy& last = pending.back();
+    if (last.dst == dst &&
+        last.region.srcOffset + last.region.size == offset &&
+        last.region.dstOffset + last.region.size == dst_offset) {
+      last.region.size += size;
+      pending_bytes_ += size;
+      return static_cast<char*>(ring_.mapped) + offset;
+    }
+  }
+
+  Copy copy;
+  copy.dst = dst;
+  copy.region.srcOffset = offset;
+  copy.region.dstOffset = dst_offset;
+  copy.region.size = size;
+  pending.push_back(copy);
+  pending_bytes_ += size;
+  return static_cast<char*>(ring_.mapped) + offset;
+}
+
+void* VulkanUploader::ReserveImage(VkImage image, uint32_t level,
+                                   VkExtent3D extent, VkDeviceSize size) {
+  VkDeviceSize offset = 0;
+  if (size == 0 || !AllocateRing(size, &offset))
+    return nullptr;
+
+  ImageCopy copy = {};
+  copy.dst = image;
+  copy.region.bufferOffset = offset;
+  copy.region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  copy.region.imageSubresource.mipLevel = level;
+  copy.region.imageSubresource.baseArrayLayer = 0;
+  copy.region.imageSubresource.layerCount = 1;
+  copy.region.imageExtent = extent;
+  pending_images_.push_back(copy);
+  pending_bytes_ += size;
+  return static_cast<char*>(ring_.mapped) + offset;
+}
+
+bool VulkanUploader::HasRoom(VkDeviceSize size) {
+  if (size > ring_.size)
+    return false;
+  RetireCompleted();
+  return NextRingPosition(size) + size - tail_ <= ring_.size;
+}
+
+bool VulkanUploader::Submit() {
+  if (!HasPendingCopies())
+    return true;
+
+  Submission& submission = submissions_[next_submission_];
+  if (submission.in_flight) {
+    // More uploads in flight than slots; wait for the oldest, which is this
+    // one.
+    ++stats_.stalls;
+    vkWaitForFences(device_, 1, &submission.fence, VK_TRUE, UINT64_MAX);
+    RetireCompleted();
+  }
+
+  FlushRing(flushed_, head_);
+  flushed_ = head_;
+
+  const size_t copy_count =
+      pending_.size() + pending_initial_.size() + pending_images_.size();
+  const bool use_transfer_queue =
+      has_transfer_queue() &&
+      (!pending_initial_.empty() || !pending_images_.empty());
+  if (!use_transfer_queue) {
+    // Everything goes through the graphics queue.
+    pending_.insert(pending_.end(), pending_initial_.begin(),
+                    pending_initial_.end());
+    pending_initial_.clear();
+  }
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  if (use_transfer_queue) {
+    vkResetCommandPool(device_, submission.transfer_command_pool, 0);
+    VkCommandBuffer transfer_command_buffer =
+        submission.transfer_command_buffer;
+    vkBeginCommandBuffer(transfer_command_buffer, &begin_info);
+    if (!pending_initial_.empty()) {
+      RecordCopies(transfer_command_buffer, &pending_initial_);
+      RecordOwnershipTransfer(transfer_command_buffer, pending_initial_, true);
+    }
+    if (!pending_images_.empty())
+      RecordImageCopies(transfer_command_buffer, pending_images_, true);
+    vkEndCommandBuffer(transfer_command_buffer);
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &transfer_command_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &submission.transfer_done;
+
+    VulkanQueueDebugLabel label(transfer_queue_, "initial uploads");
+    VkResult result =
+        vkQueueSubmit(transfer_queue_, 1, &submit_info, VK_NULL_HANDLE);
+    if (VK_SUCCESS != result) {
+      DLOG(ERROR) << "vkQueueSubmit(transfer) failed: " << result;
+      return false;
+    }
+  }
+
+  vkResetCommandPool(device_, submission.command_pool, 0);
+  VkCommandBuffer command_buffer = submission.command_buffer;
+  vkBeginCommandBuffer(command_buffer, &begin_info);
+
+
+  if (use_transfer_queue) {
+    if (!pending_initial_.empty())
+      RecordOwnershipTransfer(command_buffer, pending_initial_, false);
+    if (!pending_images_.empty())
+      RecordImageAcquire(command_buffer, pending_images_);
+  } else if (!pending_images_.empty()) {
+    RecordImageCopies(command_buffer, pending_images_, false);
+  }
+
+  if (!pending_.empty()) {
+    // Earlier frames may still read the ranges about to be overwritten.
+    // Reads need only an execution dependency before the transfer writes.
+    vkCmdPipelineBarrier(command_buffer, kConsumerStages,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 0, nullptr);
+
+    RecordCopies(command_buffer, &pending_);
+
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = kConsumerAccess;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         kConsumerStages, 0, 1, &barrier, 0, nullptr, 0,
+                         nullptr);
+  }
+
+  vkEndCommandBuffer(command_buffer);
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &command_buffer;
+  // The acquire barriers wait for the release on the transfer queue. They
+  // cover the consumer stages, so the semaphore waits there too.
+  if (use_transfer_queue) {
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &submission.transfer_done;
+    submit_info.pWaitDstStageMask = &kConsumerStages;
+  }
+
+  vkResetFences(device_, 1, &submission.fence);
+  VulkanQueueDebugLabel label(queue_, "uploads");
+  VkResult result = vkQueueSubmit(queue_, 1, &submit_info, submission.fence);
+  if (VK_SUCCESS != result) {
+    DLOG(ERROR) << "vkQueueSubmit() failed: " << result;
+    return false;
+  }
+
+  // The graphics side waits for the transfer side, so its fence retires
+  // both and ring space still frees up in submission order.
+  submission.ring_end = head_;
+  submission.in_flight = true;
+  next_submission_ = (next_submission_ + 1) % submissions_.size();
+
+  stats_.bytes_uploaded += pending_bytes_;
+  stats_.copies += copy_count;
+  ++stats_.submissions;
+  pending_.clear();
+  pending_initial_.clear();
+  pending_images_.clear();
+  pending_bytes_ = 0;
+  return true;
+}
+
+void VulkanUploader::RecordCopies(VkCommandBuffer command_buffer,
+                                  std::vector<Copy>* copies) {
+  std::stable_sort(copies->begin(), copies->end(),
+                   [](const Copy& a, const Copy& b) { return a.dst < b.dst; });
+  std::vector<VkBufferCopy> regions;
+  for (size_t i = 0; i < copies->size();) {
+    regions.clear();
+    size_t j = i;
+    for (; j < copies->size() && (*copies)[j].dst == (*copies)[i].dst; ++j)
+      regions.push_back((*copies)[j].region);
+    vkCmdCopyBuffer(command_buffer, ring_buffer_, (*copies)[i].dst,
+                    static_cast<uint32_t>(regions.size()), regions.data());
+    i = j;
+  }
+}
+
+void VulkanUploader::RecordOwnershipTransfer(VkCommandBuffer command_buffer,
+                                             const std::vector<Copy>& copies,
+                                             bool release) {
+  // |copies| is sorted by destination; one barrier per buffer.
+  std::vector<VkBufferMemoryBarrier> barriers;
+  for (size_t i = 0; i < copies.size(); ++i) {
+    if (i > 0 && copies[i].dst == copies[i - 1].dst)
+      continue;
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    // Only the release half makes the writes available, and only the
+    // acquire half makes them visible.
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = 0;
+    if (release)
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    else
+      barrier.dstAccessMask = kConsumerAccess;
+    barrier.srcQueueFamilyIndex = transfer_family_index_;
+    barrier.dstQueueFamilyIndex = queue_family_index_;
+    barrier.buffer = copies[i].dst;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    barriers.push_back(barrier);
+  }
+
+  VkPipelineStageFlags src_stages = kConsumerStages;
+  VkPipelineStageFlags dst_stages = kConsumerStages;
+  if (release) {
+    src_stages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dst_stages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  }
+  vkCmdPipelineBarrier(command_buffer, src_stages, dst_stages, 0, 0, nullptr,
+                       static_cast<uint32_t>(barriers.size()),
+                       barriers.data(), 0, nullptr);
+}
+
+void VulkanUploader::RecordImageCopies(VkCommandBuffer command_buffer,
+                                       const std::vector<ImageCopy>& copies,
+                                       bool release) {
+  // The levels are new, so whatever they held may be discarded.
+  std::vector<VkImageMemoryBarrier> barriers;
+  for (const ImageCopy& copy : copies) {
+    VkImageMemoryBarrier barrier =
+        LevelBarrier(copy.dst, copy.region, VK_IMAGE_LAYOUT_UNDEFINED,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers.push_back(barrier);
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, static_cast<uint32_t>(barriers.size()),
+                       barriers.data());
+
+  for (const ImageCopy& copy : copies) {
+    vkCmdCopyBufferToImage(command_buffer, ring_buffer_, copy.dst,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                           &copy.region);
+  }
+
+  barriers.clear();
+  for (const ImageCopy& copy : copies) {
+    VkImageMemoryBarrier barrier =
+        LevelBarrier(copy.dst, copy.region,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    if (release) {
+      barrier.srcQueueFamilyIndex = transfer_family_index_;
+      barrier.dstQueueFamilyIndex = queue_family_index_;
+    } else {
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    barriers.push_back(barrier);
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       release ? kBottomOfPipe : kImageConsumerStages,
+                       0, 0, nullptr, 0, nullptr,
+                       static_cast<uint32_t>(barriers.size()),
+                       barriers.data());
+}
+
+void VulkanUploader::RecordImageAcquire(VkCommandBuffer command_buffer,
+                                        const std::vector<ImageCopy>& copies) {
+  // Repeats the release's layout transition, as the hand-over requires.
+  std::vector<VkImageMemoryBarrier> barriers;
+  for (const ImageCopy& copy : copies) {
+    VkImageMemoryBarrier barrier =
+        LevelBarrier(copy.dst, copy.region,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.srcQueueFamilyIndex = transfer_family_index_;
+    barrier.dstQueueFamilyIndex = queue_family_index_;
+    barriers.push_back(barrier);
+  }
+  vkCmdPipelineBarrier(command_buffer, kConsumerStages, kImageConsumerStages,
+                       0, 0, nullptr, 0, nullptr,
+                       static_cast<uint32_t>(barriers.size()),
+                       barriers.data());
+}
+
+void VulkanUploader::WaitIdle() {
+  while (WaitOldest()) {
+  }
+}
+
+bool VulkanUploader::AllocateRing(VkDeviceSize size, VkDeviceSize* offset) {
+  if (size > ring_.size) {
+    DLOG(ERROR) << "Upload of " << size << " bytes exceeds the staging ring";
+    return false;
+  }
+
+  for (;;) {
+    uint64_t position = NextRingPosition(size);
+    if (position + size - tail_ <= ring_.size) {
+      head_ = position + size;
+      *offset = position % ring_.size;
+      return true;
+    }
+
+    if (RetireCompleted())
+      continue;
+    if (WaitOldest()) {
+      ++stats_.stalls;
+      continue;
+    }
+    if (!HasPendingCopies()) {
+      // The ring is idle; restart at offset 0 so any size up to the ring
+      // fits.
+      DCHECK(pending_.empty() && pending_initial_.empty() &&
+             pending_images_.empty());
+      head_ = tail_ = flushed_ = AlignUp(head_, ring_.size);
+      continue;
+    }
+    // Nothing in flight: the ring is full of queued copies. Submit them and
+    // wait, then retry.
+    ++stats_.stalls;
+    if (!Submit())
+      return false;
+  }
+}
+
+uint64_t VulkanUploader::NextRingPosition(VkDeviceSize size) const {
+  uint64_t position = AlignUp(head_, kAlignment);
+  // An allocation never wraps; skip the rest of the lap instead.
+  if (position % ring_.size + size > ring_.size)
+    position = AlignUp(position, ring_.size);
+  return position;
+}
+
+bool VulkanUploader::RetireCompleted() {
+  bool retired = false;
+  // Submissions complete in order, starting with the oldest.
+  for (size_t i = 0; i < submissions_.size(); ++i) {
+    Submission& submission =
+        submissions_[(next_submission_ + i) % submissions_.size()];
+    if (!submission.in_flight)
+      continue;
+    if (VK_SUCCESS != vkGetFenceStatus(device_, submission.fence))
+      break;
+    submission.in_flight = false;
+    tail_ = submission.ring_end;
+    retired = true;
+  }
+  return retired;
+}
+
+bool VulkanUploader::WaitOldest() {
+  for (size_t i = 0; i < submissions_.size(); ++i) {
+    Submission& submission =
+        submissions_[(next_submission_ + i) % submissions_.size()];
+    if (!submission.in_flight)
+      continue;
+    vkWaitForFences(device_, 1, &submission.fence, VK_TRUE, UINT64_MAX);
+    RetireCompleted();
+    return true;
+  }
+  return false;
+}
+
+void VulkanUploader::FlushRing(uint64_t begin, uint64_t end) {
+  if (begin == end || allocator_->IsHostCoherent(ring_.memory_type))
+    return;
+
+  if (end - begin >= ring_.size) {
+    allocator_->Flush(ring_, 0, ring_.size);
+    return;
+  }
+  VkDeviceSize first = begin % ring_.size;
+  VkDeviceSize last = end % ring_.size;
+  if (first < last) {
+    allocator_->Flush(ring_, first, last - first);
+  } else {
+    allocator_->Flush(ring_, first, ring_.size - first);
+    allocator_->Flush(ring_, 0, last);
+  }
+}
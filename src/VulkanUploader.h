@@ -0,0 +1,182 @@
+#ifndef VULKAN_UPLOADER_H_
+#define VULKAN_UPLOADER_H_
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+#include "VulkanMemoryAllocator.h"
+
+// Streams data into device-local buffers through a persistently mapped
+// staging ring.
+//
+// Upload() copies into the ring and queues a VkBufferCopy; Submit() records
+// every queued copy into one command buffer and submits it, once per frame.
+// Each submission carries a fence and remembers how far into the ring it
+// reached, so ring space is reclaimed as soon as the fence signals. The CPU
+// only waits when the ring is exhausted by uploads still in flight.
+//
+// With a dedicated transfer queue, initial uploads into buffers the GPU has
+// not used yet run there, on the copy engine, and are handed over to the
+// graphics family with a queue family ownership transfer: released on the
+// transfer queue, acquired on the graphics queue behind a semaphore. Updates
+// of buffers already in use stay on the graphics queue, where they are
+// ordered against the frames reading them.
+//
+// Image mip levels are always initial uploads: each goes from UNDEFINED to
+// TRANSFER_DST_OPTIMAL, is copied, and ends up in SHADER_READ_ONLY_OPTIMAL
+// on the graphics family, through the same hand-over when there is a
+// transfer queue.
+//
+// Not thread-safe; used from the render thread.
+class VulkanUploader
+{
+public:
+  struct Stats {
+    uint64_t bytes_uploaded = 0;
+    uint64_t copies = 0;
+    uint64_t submissions = 0;
+    // Times the CPU had to wait for ring space.
+    uint64_t stalls = 0;
+  };
+
+  static const VkDeviceSize kDefaultRingSize = 32 * 1024 * 1024;
+
+  VulkanUploader();
+  ~VulkanUploader();
+
+  // Routes initial uploads through |queue| of |family_index| when it differs
+  // from the graphics family. Must be called before Initialize().
+  void SetTransferQueue(uint32_t family_index, VkQueue queue);
+
+  // |slot_count| bounds how many upload submissions may be in flight; it
+  // should be at least the renderer's frames in flight.
+  bool Initialize(VkDevice device, VulkanMemoryAllocator* allocator,
+                  uint32_t queue_family_index, VkQueue queue,
+                  VkDeviceSize ring_size = kDefaultRingSize,
+                  uint32_t slot_count = 3);
+  void Destroy();
+
+  // Queues a copy of |size| bytes of |data| into |dst| at |dst_offset|.
+  // Uploads larger than the ring are split and submitted piecewise.
+  // |initial| promises that no GPU work has used |dst| yet, which lets the
+  // copy run on the transfer queue.
+  bool Upload(VkBuffer dst, VkDeviceSize dst_offset, const void* data,
+              VkDeviceSize size, bool initial = false);
+  // Like Upload(), but returns ring memory for the caller to fill before the
+  // next Submit(), saving a copy. |size| must fit in the ring.
+  void* Reserve(VkBuffer dst, VkDeviceSize dst_offset, VkDeviceSize size,
+                bool initial = false);
+  // Like Reserve(), for mip |level| (layer 0, color aspect) of |image|,
+  // which is |extent| texels at that level. |size| bytes of tightly packed
+  // rows fill the whole level. The level must not have been used by the
+  // GPU; frames submitted after the next Submit() can sample it.
+  void* ReserveImage(VkImage image, uint32_t level, VkExtent3D extent,
+                     VkDeviceSize size);
+  // Whether a Reserve*() of |size| bytes would succeed right now, without
+  // waiting for uploads in flight. Lets callers that must not block spread
+  // their uploads over frames.
+  bool HasRoom(VkDeviceSize size);
+
+  // Submits every queued copy in one batch. A no-op when nothing is queued.
+  // Later submissions to the same queue see the uploaded data.
+  bool Submit();
+  // Blocks until every submitted upload has completed.
+  void WaitIdle();
+
+  bool has_transfer_queue() const {
+    return VK_NULL_HANDLE != transfer_queue_ &&
+           transfer_family_index_ != queue_family_index_;
+  }
+
+  VkDeviceSize pending_bytes() const { return pending_bytes_; }
+  VkDeviceSize ring_size() const { return ring_.size; }
+  const Stats& stats() const { return stats_; }
+
+private:
+  // Start alignment of each upload inside the ring.
+  static const VkDeviceSize kAlignment = 16;
+
+  struct Copy {
+    VkBuffer dst;
+    VkBufferCopy region;
+  };
+
+  struct ImageCopy {
+    VkImage dst;
+    VkBufferImageCopy region;
+  };
+
+  struct Submission {
+    VkCommandPool command_pool = VK_NULL_HANDLE;
+    VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+    // Transfer queue side, when there is one.
+    VkCommandPool transfer_command_pool = VK_NULL_HANDLE;
+    VkCommandBuffer transfer_command_buffer = VK_NULL_HANDLE;
+    VkSemaphore transfer_done = VK_NULL_HANDLE;
+    // Signaled by the graphics side, which always comes last.
+    VkFence fence = VK_NULL_HANDLE;
+    // Ring position (see head_) this submission's data ends at.
+    uint64_t ring_end = 0;
+    bool in_flight = false;
+  };
+
+  // Reserves |size| contiguous ring bytes and returns their offset in the
+  // ring buffer, waiting for in-flight uploads if necessary.
+  bool AllocateRing(VkDeviceSize size, VkDeviceSize* offset);
+  // Ring position an allocation of |size| bytes would start at.
+  uint64_t NextRingPosition(VkDeviceSize size) const;
+  // True while staged copies of any kind await Submit().
+  bool HasPendingCopies() const {
+    return !pending_.empty() || !pending_initial_.empty() ||
+           !pending_images_.empty();
+  }
+  // Reclaims ring space of completed submissions. Returns true if any.
+  bool RetireCompleted();
+  bool CreateCommandBuffer(uint32_t family_index, VkCommandPool* pool,
+                           VkCommandBuffer* command_buffer);
+  // Records |copies|, one vkCmdCopyBuffer per destination.
+  void RecordCopies(VkCommandBuffer command_buffer, std::vector<Copy>* copies);
+  // Release (on the transfer queue) or acquire (on the graphics queue)
+  // barriers handing the destinations of |copies| to the graphics family.
+  void RecordOwnershipTransfer(VkCommandBuffer command_buffer,
+                               const std::vector<Copy>& copies, bool release);
+  // Records |copies| with the layout transitions around them. With
+  // |release| the final transition is the release half of the hand-over to
+  // the graphics family, which RecordImageAcquire() completes.
+  void RecordImageCopies(VkCommandBuffer command_buffer,
+                         const std::vector<ImageCopy>& copies, bool release);
+  void RecordImageAcquire(VkCommandBuffer command_buffer,
+                          const std::vector<ImageCopy>& copies);
+  // Waits for the oldest submission in flight. Returns false if none.
+  bool WaitOldest();
+  void FlushRing(uint64_t begin, uint64_t end);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VulkanMemoryAllocator* allocator_ = nullptr;
+  VkQueue queue_ = VK_NULL_HANDLE;
+  uint32_t queue_family_index_ = 0;
+  VkQueue transfer_queue_ = VK_NULL_HANDLE;
+  uint32_t transfer_family_index_ = 0;
+
+  VkBuffer ring_buffer_ = VK_NULL_HANDLE;
+  VulkanAllocation ring_;
+  // Monotonic byte positions; the ring offset is position % ring size.
+  // [tail_, head_) is in use by queued or in-flight copies.
+  uint64_t head_ = 0;
+  uint64_t tail_ = 0;
+  uint64_t flushed_ = 0;
+
+  std::vector<Submission> submissions_;
+  uint32_t next_submission_ = 0;
+
+  std::vector<Copy> pending_;
+  // Copies into buffers not used by the GPU yet.
+  std::vector<Copy> pending_initial_;
+  std::vector<ImageCopy> pending_images_;
+  VkDeviceSize pending_bytes_ = 0;
+
+  Stats stats_;
+};
+
+#endif /* VULKAN_UPLOADER_H_ */
@@ -1,21 +1,153 @@
 
 #include "VulkanRenderer.h"
+#include "FramePacer.h"
+#include "VulkanInstance.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Renders |frames| frames offscreen and reports the throughput. Used on
+// machines without a display (e.g. lavapipe/SwiftShader CI boxes).
+static int runHeadless(uint32_t frames, uint32_t instances, uint32_t samples,
+                       uint32_t particles,
+                       const std::vector<std::string>& textures,
+                       const char* gpu_profile_csv, const char* device) {
+  VulkanRenderer renderer(800, 600);
+  renderer.setInstanceCount(instances);
+  renderer.setSampleCount(samples);
+  renderer.setParticleCount(particles);
+  renderer.setTexturePaths(textures);
+  if (device)
+    renderer.setDeviceSelector(device);
+  if (gpu_profile_csv)
+    renderer.setGpuProfileCsvPath(gpu_profile_csv);
+  if (!renderer.Init()) {
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < frames; ++i) {
+    renderer.render();
+  }
+  renderer.waitIdle();
+  auto end = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  LOG(INFO) << "headless: " << renderer.frameCount() << " frames in "
+            << seconds * 1000.0 << " ms ("
+            << (seconds > 0.0 ? renderer.frameCount() / seconds : 0.0)
+            << " fps), " << renderer.recordedFrameCount() << " recorded, "
+            << renderer.replayedFrameCount() << " replayed";
+  if (!textures.empty()) {
+    const VulkanTextureStreamer::Stats& stats = renderer.textureStats();
+    LOG(INFO) << "textures: " << stats.full_resolution << "/" << stats.textures
+              << " at full resolution, " << stats.committed_bytes
+              << " bytes resident, " << stats.bytes_uploaded << " uploaded, "
+              << stats.evictions << " evictions, " << stats.reloads
+              << " reloads, " << stats.decode_failures << " failed";
+  }
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
+  bool headless = false;
+  uint32_t headless_frames = 1000;
+  const char* gpu_profile_csv = nullptr;
+  VulkanRenderer::PresentPolicy present_policy = VulkanRenderer::kPresentVsync;
+  uint32_t swapchain_images = 0;
+  uint32_t instances = 1;
+  uint32_t samples = 1;
+  uint32_t particles = 0;
+  std::vector<std::string> textures;
+  const char* device = nullptr;
+  double target_fps = 0.0;
+  bool pacing = true;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      headless_frames = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--gpu-profile-csv") == 0 && i + 1 < argc) {
+      gpu_profile_csv = argv[++i];
+    } else if (strcmp(argv[i], "--present") == 0 && i + 1 < argc) {
+      const char* policy = argv[++i];
+      if (strcmp(policy, "low-latency") == 0)
+        present_policy = VulkanRenderer::kPresentLowestLatency;
+      else if (strcmp(policy, "adaptive") == 0)
+        present_policy = VulkanRenderer::kPresentAdaptive;
+      else if (strcmp(policy, "uncapped") == 0)
+        present_policy = VulkanRenderer::kPresentUncapped;
+      else
+        present_policy = VulkanRenderer::kPresentVsync;
+    } else if (strcmp(argv[i], "--swapchain-images") == 0 && i + 1 < argc) {
+      swapchain_images = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+      instances = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc) {
+      samples = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--particles") == 0 && i + 1 < argc) {
+      particles = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc) {
+      textures.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--target-fps") == 0 && i + 1 < argc) {
+      target_fps = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--no-pacing") == 0) {
+      pacing = false;
+    } else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+      device = argv[++i];
+    }
+  }
+
+  if (headless)
+    return runHeadless(headless_frames, instances, samples, particles,
+                       textures, gpu_profile_csv, device);
+
   glfwInit();
 
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
   GLFWwindow* window = glfwCreateWindow(800, 600, "Voodoo by Witch Doctor", nullptr, nullptr);
 
   VulkanRenderer renderer(window);
+  renderer.setPresentPolicy(present_policy, swapchain_images);
+  renderer.setInstanceCount(instances);
+  renderer.setSampleCount(samples);
+  renderer.setParticleCount(particles);
+  renderer.setTexturePaths(textures);
+  if (device)
+    renderer.setDeviceSelector(device);
+  if (gpu_profile_csv)
+    renderer.setGpuProfileCsvPath(gpu_profile_csv);
   if (!renderer.Init()) {
     return 0;
   }
 
+  // Input is sampled right before the frame is built, as late as the
+  // pacer dares; the report goes out every few seconds.
+  FramePacer pacer(renderer.framesInFlight());
+  pacer.SetEnabled(pacing);
+  if (target_fps > 0.0)
+    pacer.SetTargetFrameTime(1000.0 / target_fps);
+  auto last_report = std::chrono::steady_clock::now();
   while (!glfwWindowShouldClose(window)) {
-    renderer.render();
-
+    pacer.WaitForInput();
     glfwPollEvents();
+    pacer.MarkInputSampled();
+
+    // Skipped frames (minimized window, stale swapchain) keep the slot and
+    // are not counted as presented.
+    pacer.MarkSlotFree(renderer.currentFrameSlot(),
+                       renderer.waitForFrameSlot());
+    if (renderer.render())
+      pacer.MarkPresented();
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_report >= std::chrono::seconds(5)) {
+      LOG(INFO) << pacer.Report();
+      last_report = now;
+    }
   }
 
   glfwDestroyWindow(window);